@@ -0,0 +1,151 @@
+#include <coroio/all.hpp>
+
+#include <messages.h>
+#include <server.h>
+#include <local.h>
+
+#include <algorithm>
+#include <csignal>
+#include <queue>
+#include <vector>
+
+using namespace NNet;
+
+struct TBenchStats {
+    uint64_t Ops = 0;
+    std::vector<uint64_t> Latencies; // us
+};
+
+template<typename TSocket>
+TVoidSuspendedTask BenchReader(TSocket& socket, std::queue<ITimeSource::Time>& times, uint64_t& inflight, TBenchStats& stats, TTimeSource& timeSource) {
+    try {
+        while (true) {
+            auto response = co_await TMessageReader(socket).Read();
+            auto t = times.front(); times.pop();
+            auto dt = std::chrono::duration_cast<std::chrono::microseconds>(timeSource.Now() - t);
+            stats.Latencies.push_back(dt.count());
+            stats.Ops++;
+            inflight--;
+        }
+    } catch (const std::exception& ex) {
+        std::cout << "BenchReader Exception: " << ex.what() << "\n";
+    }
+    co_return;
+}
+
+template<typename TPoller, typename TSocket>
+TVoidTask BenchConnection(TPoller& poller, TSocket socket, int size, uint64_t maxInflight, ITimeSource::Time deadline, TBenchStats& stats, int& running) {
+    TTimeSource timeSource;
+    std::queue<ITimeSource::Time> times;
+    uint64_t inflight = 0;
+    std::vector<char> data(size, 'x');
+
+    co_await socket.Connect();
+    auto reader = BenchReader(socket, times, inflight, stats, timeSource);
+
+    TCommandRequest header;
+    header.Type = static_cast<uint32_t>(TCommandRequest::MessageType);
+    header.Flags = TCommandRequest::EWrite;
+    header.Len = sizeof(header) + size;
+    auto byteWriter = TByteWriter(socket);
+
+    try {
+        while (timeSource.Now() < deadline) {
+            while (inflight >= maxInflight) {
+                co_await poller.Yield();
+            }
+            inflight++;
+            times.push(timeSource.Now());
+            co_await byteWriter.Write(&header, sizeof(header));
+            co_await byteWriter.Write(data.data(), data.size());
+        }
+        while (inflight > 0) {
+            co_await poller.Yield();
+        }
+    } catch (const std::exception& ex) {
+        std::cout << "Exception: " << ex.what() << "\n";
+    }
+    reader.destroy();
+    running--;
+    co_return;
+}
+
+void usage(const char* prog) {
+    std::cerr << prog << " --node ip:port:id [--connections 16] [--inflight 128] [--size 64] [--seconds 10] [--tcp]\n";
+    exit(0);
+}
+
+int main(int argc, char** argv) {
+    signal(SIGPIPE, SIG_IGN);
+    std::vector<THost> hosts;
+    int connections = 16;
+    uint64_t inflight = 128;
+    int size = 64;
+    int seconds = 10;
+    bool tcp = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--node") && i < argc - 1) {
+            // address:port:id
+            hosts.push_back(THost{argv[++i]});
+        } else if (!strcmp(argv[i], "--connections") && i < argc - 1) {
+            connections = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--inflight") && i < argc - 1) {
+            inflight = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--size") && i < argc - 1) {
+            size = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--seconds") && i < argc - 1) {
+            seconds = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--tcp")) {
+            tcp = true;
+        } else if (!strcmp(argv[i], "--help")) {
+            usage(argv[0]);
+        }
+    }
+
+    if (hosts.empty() || !hosts[0]) {
+        std::cerr << "At least one node must be set\n"; return 1;
+    }
+
+    using TPoller = NNet::TDefaultPoller;
+    TTimeSource timeSource;
+    NNet::TLoop<TPoller> loop;
+    TBenchStats stats;
+    int running = connections;
+    auto t0 = timeSource.Now();
+    auto deadline = t0 + std::chrono::seconds(seconds);
+    std::string localPath;
+#ifdef __linux__
+    if (!tcp) {
+        localPath = FindLocalSocket(hosts[0].Address, hosts[0].Port);
+    }
+#endif
+    for (int i = 0; i < connections; i++) {
+#ifdef __linux__
+        if (!localPath.empty()) {
+            BenchConnection(loop.Poller(), TLocalSocket(localPath, &loop.Poller()), size, inflight, deadline, stats, running);
+            continue;
+        }
+#endif
+        TSocket socket(NNet::TAddress{hosts[0].Address, hosts[0].Port}, loop.Poller());
+        BenchConnection(loop.Poller(), std::move(socket), size, inflight, deadline, stats, running);
+    }
+    std::cout << "transport: " << (localPath.empty() ? "tcp" : "local") << "\n";
+    while (running > 0) {
+        loop.Step();
+    }
+    auto dt = std::chrono::duration_cast<std::chrono::duration<double>>(timeSource.Now() - t0);
+
+    std::sort(stats.Latencies.begin(), stats.Latencies.end());
+    auto percentile = [&](int p) -> uint64_t {
+        if (stats.Latencies.empty()) {
+            return 0;
+        }
+        return stats.Latencies[std::min(stats.Latencies.size() - 1, stats.Latencies.size() * p / 100)];
+    };
+    std::cout << "ops: " << stats.Ops << ", "
+              << "ops/s: " << (uint64_t)(stats.Ops / dt.count()) << ", "
+              << "p50: " << percentile(50) << "us, "
+              << "p90: " << percentile(90) << "us, "
+              << "p99: " << percentile(99) << "us\n";
+    return 0;
+}
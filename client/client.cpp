@@ -3,6 +3,7 @@
 
 #include <messages.h>
 #include <server.h>
+#include <local.h>
 
 #include <vector>
 #include <queue>
@@ -21,12 +22,17 @@ TVoidSuspendedTask ClientReader(TPoller& poller, TSocket& socket) {
             auto response = co_await TMessageReader(socket).Read();
             auto t = times.front(); times.pop();
             auto dt = timeSource.Now() - t;
+            inflight --;
+            if (auto maybeHint = response.template Maybe<TLeaderHint>()) {
+                // the command may or may not have been applied
+                std::cout << "Retry, leader: " << maybeHint.Cast()->LeaderId << " " << dt.count() << "\n";
+                continue;
+            }
             auto commandResponse = response.template Cast<TCommandResponse>();
             auto len = commandResponse->Len - sizeof(TCommandResponse);
             std::string_view data(commandResponse->Data, len);
             std::cout << "Ok, commitIndex: " << commandResponse->Index << " "
                       << data << " " << dt.count() << "\n";
-            inflight --;
         }
     } catch (const std::exception& ex) {
         std::cout << "ClientReader Exception: " << ex.what() << "\n";
@@ -155,6 +161,14 @@ int main(int argc, char** argv) {
     using TPoller = NNet::TDefaultPoller;
     std::shared_ptr<ITimeSource> timeSource = std::make_shared<TTimeSource>();
     NNet::TLoop<TPoller> loop;
+#ifdef __linux__
+    // a replica on this host is reached through shared memory
+    if (auto path = FindLocalSocket(hosts[0].Address, hosts[0].Port); !ssl && !path.empty()) {
+        Client(loop.Poller(), TLocalSocket(path, &loop.Poller()));
+        loop.Loop();
+        return 0;
+    }
+#endif
     NNet::TAddress addr{hosts[0].Address, hosts[0].Port};
     TSocket socket(std::move(addr), loop.Poller());
     if (ssl) {
@@ -0,0 +1,96 @@
+#include <cluster.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <queue>
+#include <vector>
+
+#include <string.h>
+
+void usage(const char* prog) {
+    std::cerr << prog << " [--replicas 3] [--latency-us 100] [--bandwidth-mbps 0] [--inflight 128] [--size 64] [--seconds 10]\n";
+    exit(0);
+}
+
+int main(int argc, char** argv) {
+    int replicas = 3;
+    TLinkOptions link;
+    uint64_t inflight = 128;
+    int size = 64;
+    int seconds = 10;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--replicas") && i < argc - 1) {
+            replicas = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--latency-us") && i < argc - 1) {
+            link.Latency = std::chrono::microseconds(atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--bandwidth-mbps") && i < argc - 1) {
+            link.BandwidthBytesPerSec = atoll(argv[++i]) * 1000000 / 8;
+        } else if (!strcmp(argv[i], "--inflight") && i < argc - 1) {
+            inflight = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--size") && i < argc - 1) {
+            size = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--seconds") && i < argc - 1) {
+            seconds = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--help")) {
+            usage(argv[0]);
+        }
+    }
+
+    auto ts = std::make_shared<TVirtualTimeSource>();
+    TCluster cluster(replicas, link, ts);
+
+    std::queue<ITimeSource::Time> times;
+    std::vector<uint64_t> latencies; // us of virtual time
+    auto submit = [&]() {
+        auto request = NewHoldedMessage<TCommandRequest>(sizeof(TCommandRequest) + size);
+        request->Flags = TCommandRequest::EWrite;
+        memset(request->Data, 'x', size);
+        if (cluster.Submit(std::move(request))) {
+            times.push(ts->Now());
+        }
+    };
+    cluster.SetOnResponse([&](TMessageHolder<TMessage>) {
+        // one client and a stable leader: responses come back in request order
+        auto dt = std::chrono::duration_cast<std::chrono::microseconds>(ts->Now() - times.front());
+        times.pop();
+        latencies.push_back(dt.count());
+        submit();
+    });
+
+    cluster.RunUntil(ts->Now() + std::chrono::seconds(60), [&]() { return !!cluster.Leader(); });
+    if (!cluster.Leader()) {
+        std::cerr << "No leader elected\n"; return 1;
+    }
+    for (uint64_t i = 0; i < inflight; i++) {
+        submit();
+    }
+
+    auto entries0 = cluster.Leader()->GetState()->LogSize();
+    auto wall0 = std::chrono::steady_clock::now();
+    auto t0 = ts->Now();
+    cluster.RunUntil(t0 + std::chrono::seconds(seconds));
+    auto wall = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - wall0);
+    auto virt = std::chrono::duration_cast<std::chrono::duration<double>>(ts->Now() - t0);
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](int p) -> uint64_t {
+        if (latencies.empty()) {
+            return 0;
+        }
+        return latencies[std::min(latencies.size() - 1, latencies.size() * p / 100)];
+    };
+    std::cout << "replicas: " << replicas << ", "
+              << "ops: " << latencies.size() << ", "
+              << "ops/s: " << (uint64_t)(latencies.size() / virt.count()) << ", "
+              << "p50: " << percentile(50) << "us, "
+              << "p90: " << percentile(90) << "us, "
+              << "p99: " << percentile(99) << "us, "
+              << "log entries/s: " << (uint64_t)((cluster.Leader()->GetState()->LogSize() - entries0) / virt.count()) << "\n";
+    // how fast the core itself runs, free of the simulated network
+    std::cout << "wall: " << wall.count() << "s, "
+              << "wall ops/s: " << (uint64_t)(latencies.size() / wall.count()) << ", "
+              << "messages: " << cluster.Delivered() << ", "
+              << "bytes: " << cluster.DeliveredBytes() << "\n";
+    return 0;
+}
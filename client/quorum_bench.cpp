@@ -0,0 +1,112 @@
+#include <raft.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include <string.h>
+
+// Commit index updates as the leader sees them: one peer's match index moves
+// up per append response. Compares TVolatileState::CommitAdvance with
+// sorting all match indices per response, as it used to.
+
+void usage(const char* prog) {
+    std::cerr << prog << " [--acks 2000000] [--max-step 4]\n";
+    exit(0);
+}
+
+namespace {
+
+uint32_t Next(uint32_t* seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+// same acks for both variants: (peer, entries it acknowledges)
+std::vector<std::pair<uint32_t, uint32_t>> MakeAcks(int peers, uint64_t acks, uint32_t maxStep) {
+    std::vector<std::pair<uint32_t, uint32_t>> result(acks);
+    uint32_t seed = 31337;
+    for (auto& [peer, step] : result) {
+        peer = Next(&seed) % peers;
+        step = 1 + Next(&seed) % maxStep;
+    }
+    return result;
+}
+
+// a leader log long enough for every ack, all entries of the current term
+TState MakeState(const std::vector<std::pair<uint32_t, uint32_t>>& acks, int peers) {
+    std::vector<uint64_t> match(peers);
+    for (auto [peer, step] : acks) {
+        match[peer] += step;
+    }
+    TState state;
+    auto entry = NewHoldedMessage<TCmdReq>();
+    entry->Term = state.CurrentTerm;
+    state.Log.assign(*std::max_element(match.begin(), match.end()), entry);
+    return state;
+}
+
+template<typename F>
+double Measure(F&& f) {
+    auto t0 = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - t0).count();
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    uint64_t acks = 2000000;
+    uint32_t maxStep = 4;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--acks") && i < argc - 1) {
+            acks = atoll(argv[++i]);
+        } else if (!strcmp(argv[i], "--max-step") && i < argc - 1) {
+            maxStep = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--help")) {
+            usage(argv[0]);
+        }
+    }
+
+    for (int nservers : {3, 5, 7, 9}) {
+        auto peers = nservers - 1;
+        auto input = MakeAcks(peers, acks, maxStep);
+        auto state = MakeState(input, peers);
+
+        uint64_t trackerCommit = 0;
+        auto tracker = Measure([&]() {
+            TVolatileState s;
+            s.Peers.resize(peers);
+            for (auto [peer, step] : input) {
+                s.SetMatchIndex(peer, s.Peers[peer].MatchIndex + step)
+                    .CommitAdvance(nservers, state);
+            }
+            trackerCommit = s.CommitIndex;
+        });
+
+        uint64_t sortCommit = 0;
+        auto sort = Measure([&]() {
+            std::vector<uint64_t> match(peers);
+            std::vector<uint64_t> indices;
+            for (auto [peer, step] : input) {
+                match[peer] += step;
+                indices.assign(match.begin(), match.end());
+                indices.push_back(state.LogSize());
+                std::sort(indices.begin(), indices.end());
+                auto commit = std::max(sortCommit, indices[nservers / 2]);
+                if (state.LogTerm(commit) == state.CurrentTerm) {
+                    sortCommit = commit;
+                }
+            }
+        });
+
+        std::cout << "replicas: " << nservers << ", "
+                  << "tracker: " << (uint64_t)(tracker * 1e9 / acks) << "ns/ack, "
+                  << "sort: " << (uint64_t)(sort * 1e9 / acks) << "ns/ack"
+                  << (trackerCommit == sortCommit ? "" : ", commit index mismatch") << "\n";
+    }
+    return 0;
+}
@@ -52,19 +52,49 @@ TMessageHolder<TMessage> TKv::Read(TMessageHolder<TCommandRequest> message, uint
 
 void TKv::Write(TMessageHolder<TCmdReq> message, uint64_t index) {
     if (LastAppliedIndex < index) {
-        auto entry = message.Cast<TKvLogEntry>();
-        std::string_view k(entry->TKvEntry::Data, entry->KeySize);
-        if (entry->ValSize) {
-            std::string_view v(entry->TKvEntry::Data + entry->KeySize, entry->ValSize);
-            H[std::string(k)] = std::string(v);
-        } else {
-            H.erase(std::string(k));
-        }
+        ForEachCommand(message, [&](TMessageHolder<TCmdReq> command) {
+            auto entry = command.Cast<TKvLogEntry>();
+            std::string_view k(entry->TKvEntry::Data, entry->KeySize);
+            if (entry->ValSize) {
+                std::string_view v(entry->TKvEntry::Data + entry->KeySize, entry->ValSize);
+                H[std::string(k)] = std::string(v);
+            } else {
+                H.erase(std::string(k));
+            }
+        });
         LastAppliedIndex = index;
     }
 }
 
-TMessageHolder<TCmdReq> TKv::Prepare(TMessageHolder<TCommandRequest> command, uint64_t term) {
+// key size, value size, key, value for every pair
+std::vector<char> TKv::Snapshot() {
+    std::vector<char> data;
+    for (const auto& [k, v] : H) {
+        TKvEntry entry{.KeySize = static_cast<uint16_t>(k.size()), .ValSize = static_cast<uint16_t>(v.size())};
+        auto* p = reinterpret_cast<const char*>(&entry);
+        data.insert(data.end(), p, p + sizeof(entry));
+        data.insert(data.end(), k.begin(), k.end());
+        data.insert(data.end(), v.begin(), v.end());
+    }
+    return data;
+}
+
+void TKv::Restore(const std::vector<char>& snapshot, uint64_t index) {
+    H.clear();
+    size_t offset = 0;
+    while (offset + sizeof(TKvEntry) <= snapshot.size()) {
+        TKvEntry entry;
+        memcpy(&entry, snapshot.data() + offset, sizeof(entry));
+        offset += sizeof(entry);
+        std::string k(snapshot.data() + offset, entry.KeySize);
+        offset += entry.KeySize;
+        H[std::move(k)] = std::string(snapshot.data() + offset, entry.ValSize);
+        offset += entry.ValSize;
+    }
+    LastAppliedIndex = index;
+}
+
+TMessageHolder<TCmdReq> TKv::Prepare(TMessageHolder<TCommandRequest> command, uint64_t term) const {
     auto dataSize = command->Len - sizeof(TCommandRequest);
     auto entry = NewHoldedMessage<TCmdReq>(sizeof(TCmdReq)+dataSize);
     memcpy(entry->Data, command->Data, dataSize);
@@ -184,7 +214,8 @@ int main(int argc, char** argv) {
                     [&](const NNet::TAddress& addr) { return TPoller::TSocket(addr, loop.Poller()); },
                     std::to_string(host.Id),
                     NNet::TAddress{host.Address, host.Port},
-                    timeSource);
+                    timeSource,
+                    &loop.Poller());
             }
         }
 
@@ -9,7 +9,9 @@ class TKv: public IRsm {
 public:
     TMessageHolder<TMessage> Read(TMessageHolder<TCommandRequest> message, uint64_t index) override;
     void Write(TMessageHolder<TCmdReq> message, uint64_t index) override;
-    TMessageHolder<TCmdReq> Prepare(TMessageHolder<TCommandRequest> message, uint64_t term) override;
+    TMessageHolder<TCmdReq> Prepare(TMessageHolder<TCommandRequest> message, uint64_t term) const override;
+    std::vector<char> Snapshot() override;
+    void Restore(const std::vector<char>& snapshot, uint64_t index) override;
 
 private:
     uint64_t LastAppliedIndex = 0;
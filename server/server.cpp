@@ -2,34 +2,43 @@
 #include <csignal>
 #include <timesource.h>
 #include <raft.h>
+#include <applier.h>
 #include <server.h>
+#include <reactor.h>
+#include <local.h>
+#include <metrics.h>
+#include <log.h>
 
 void usage(const char* prog) {
-    std::cerr << prog << " --id myid --node ip:port:id [--node ip:port:id ...]" << "\n";
+    std::cerr << prog << " --id myid --node ip:port:id [--node ip:port:id ...] [--ssl] [--poller uring|epoll|poll|select] [--reactors N --client-port port] [--no-local] [--metrics-port port] [--log-dir dir] [--lease-reads] [--inline-apply] [--learner ip:port:id ...] [--stale-reads ms]" << "\n";
     exit(0);
 }
 
-int main(int argc, char** argv) {
-    signal(SIGPIPE, SIG_IGN);
-    std::vector<THost> hosts;
+// command line settings
+struct TServerOptions {
+    std::vector<THost> Hosts;
+    std::unordered_set<uint32_t> Learners;
+    uint32_t Id = 0;
+    bool Ssl = false;
+    int Reactors = 0;
+    int ClientPort = 0;
+    bool Local = true;
+    int MetricsPort = 0;
+    std::string LogDir;
+    bool LeaseReads = false;
+    bool ApplyThread = true;
+    int StaleReads = 0;
+#ifdef __linux__
+    std::string Poller = "uring";
+#else
+    std::string Poller = "default";
+#endif
+};
+
+template<typename TPoller>
+int Run(const TServerOptions& options) {
     THost myHost;
     TNodeDict nodes;
-    uint32_t id = 0;
-    bool ssl = false;
-    for (int i = 1; i < argc; i++) {
-        if (!strcmp(argv[i], "--node") && i < argc - 1) {
-            // address:port:id
-            hosts.push_back(THost{argv[++i]});
-        } else if (!strcmp(argv[i], "--id") && i < argc - 1) {
-            id = atoi(argv[++i]);
-        } else if (!strcmp(argv[i], "--ssl")) {
-            ssl = true;
-        } else if (!strcmp(argv[i], "--help")) {
-            usage(argv[0]);
-        }
-    }
-
-    using TPoller = NNet::TDefaultPoller;
 
     std::shared_ptr<ITimeSource> timeSource = std::make_shared<TTimeSource>();
     NNet::TLoop<TPoller> loop;
@@ -37,32 +46,38 @@ int main(int argc, char** argv) {
     std::shared_ptr<NNet::TSslContext> serverContext;
     std::function<void(const char*)> sslDebugLogFunc = [](const char* s) { std::cerr << s << "\n"; };
 
-    if (ssl) {
+    if (options.Ssl) {
         clientContext = std::shared_ptr<NNet::TSslContext>(new NNet::TSslContext(NNet::TSslContext::Client(sslDebugLogFunc)));
         serverContext = std::shared_ptr<NNet::TSslContext>(new NNet::TSslContext(NNet::TSslContext::Server("server.crt", "server.key", sslDebugLogFunc)));
     }
 
-    for (auto& host : hosts) {
+    for (auto& host : options.Hosts) {
         if (!host) {
             std::cerr << "Empty host\n"; return 1;
         }
-        if (host.Id == id) {
+        if (host.Id == options.Id) {
             myHost = host;
         } else {
-            if (ssl) {
-                nodes[host.Id] = std::make_shared<TNode<NNet::TSslSocket<TPoller::TSocket>>>(
+            if (options.Ssl) {
+                auto node = std::make_shared<TNode<NNet::TSslSocket<typename TPoller::TSocket>>>(
                     [&](const NNet::TAddress& addr) {
-                        return std::move(NNet::TSslSocket(std::move(TPoller::TSocket(addr, loop.Poller())), *clientContext.get()));
+                        return std::move(NNet::TSslSocket(std::move(typename TPoller::TSocket(addr, loop.Poller())), *clientContext.get()));
                     },
                     std::to_string(host.Id),
                     NNet::TAddress{host.Address, host.Port},
-                    timeSource);
+                    timeSource,
+                    &loop.Poller());
+                node->Pair(options.Id, host.Id);
+                nodes[host.Id] = node;
             } else {
-                nodes[host.Id] = std::make_shared<TNode<TPoller::TSocket>>(
-                    [&](const NNet::TAddress& addr) { return TPoller::TSocket(addr, loop.Poller()); },
+                auto node = std::make_shared<TNode<typename TPoller::TSocket>>(
+                    [&](const NNet::TAddress& addr) { return typename TPoller::TSocket(addr, loop.Poller()); },
                     std::to_string(host.Id),
                     NNet::TAddress{host.Address, host.Port},
-                    timeSource);
+                    timeSource,
+                    &loop.Poller());
+                node->Pair(options.Id, host.Id);
+                nodes[host.Id] = node;
             }
         }
     }
@@ -72,19 +87,138 @@ int main(int argc, char** argv) {
     }
 
     std::shared_ptr<IRsm> rsm = std::make_shared<TDummyRsm>();
-    auto raft = std::make_shared<TRaft>(rsm, myHost.Id, nodes);
-    TPoller::TSocket socket(NNet::TAddress{myHost.Address, myHost.Port}, loop.Poller());
+    auto raft = std::make_shared<TRaft>(rsm, myHost.Id, nodes, options.Learners);
+    raft->SetLeaseReads(options.LeaseReads);
+    raft->SetStaleReads(std::chrono::milliseconds(options.StaleReads));
+    if (!options.LogDir.empty()) {
+        TState state;
+        state.Store = std::make_shared<TSegmentedLog>(options.LogDir + "/" + std::to_string(myHost.Id));
+        if (auto snapshot = state.Store->LoadSnapshot()) {
+            rsm->Restore(snapshot->Data, snapshot->Index);
+            state.Compact(snapshot->Index, snapshot->Term);
+        }
+        const auto& meta = state.Store->Meta();
+        // the term is at least that of the last entry, even if the meta was never written
+        state.CurrentTerm = std::max<uint64_t>({1, meta.Term, state.LogTerm()});
+        state.VotedFor = meta.Term == state.CurrentTerm ? meta.VotedFor : 0;
+        raft->SetState(state);
+    }
+    std::shared_ptr<TApplier> applier;
+    if (options.ApplyThread) {
+        // after the restore above, the applier owns the state machine from here
+        applier = std::make_shared<TApplier>(rsm);
+        raft->SetApplier(applier);
+    }
+    typename TPoller::TSocket socket(NNet::TAddress{myHost.Address, myHost.Port}, loop.Poller());
     socket.Bind();
     socket.Listen();
-    if (ssl) {
-        auto sslSocket = NNet::TSslSocket(std::move(socket), *serverContext.get());
-        TRabiaServer server(loop.Poller(), std::move(sslSocket), raft, nodes, timeSource);
+
+    std::vector<std::shared_ptr<TReactor<NNet::TDefaultPoller>>> clientReactors;
+    for (int i = 0; i < options.Reactors; i++) {
+        clientReactors.emplace_back(std::make_shared<TReactor<NNet::TDefaultPoller>>(
+            i, NNet::TAddress{myHost.Address, options.ClientPort}, timeSource));
+    }
+
+    std::shared_ptr<TMetrics> metrics;
+    std::unique_ptr<TMetricsServer<typename TPoller::TSocket>> metricsServer;
+    if (options.MetricsPort) {
+        metrics = std::make_shared<TMetrics>();
+        typename TPoller::TSocket metricsSocket(NNet::TAddress{myHost.Address, options.MetricsPort}, loop.Poller());
+        metricsSocket.Bind();
+        metricsSocket.Listen();
+        metricsServer = std::make_unique<TMetricsServer<typename TPoller::TSocket>>(std::move(metricsSocket), metrics);
+    }
+
+    auto serve = [&](auto& server) {
+        if (metrics) {
+            server.SetMetrics(metrics);
+            metricsServer->Serve();
+        }
+#ifdef __linux__
+        if (options.Local) {
+            if (auto path = LocalSocketPath(myHost.Port); !path.empty()) {
+                server.AddLocal(path);
+            } else {
+                std::cerr << "No private directory for the local socket, see RABIA_LOCAL_DIR\n";
+            }
+        }
+#endif
+        for (auto& reactor : clientReactors) {
+            server.AddReactor(reactor);
+            reactor->Start();
+        }
+        if (applier) {
+            server.SetApplier(applier);
+            applier->Start();
+        }
         server.Serve();
         loop.Loop();
+    };
+
+    if (options.Ssl) {
+        auto sslSocket = NNet::TSslSocket(std::move(socket), *serverContext.get());
+        TRabiaServer server(loop.Poller(), std::move(sslSocket), raft, nodes, timeSource);
+        serve(server);
     } else {
         TRabiaServer server(loop.Poller(), std::move(socket), raft, nodes, timeSource);
-        server.Serve();
-        loop.Loop();
+        serve(server);
     }
     return 0;
 }
+
+int main(int argc, char** argv) {
+    signal(SIGPIPE, SIG_IGN);
+    TServerOptions options;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--node") && i < argc - 1) {
+            // address:port:id
+            options.Hosts.push_back(THost{argv[++i]});
+        } else if (!strcmp(argv[i], "--learner") && i < argc - 1) {
+            // address:port:id of a non-voting replica
+            options.Hosts.push_back(THost{argv[++i]});
+            options.Learners.insert(options.Hosts.back().Id);
+        } else if (!strcmp(argv[i], "--stale-reads") && i < argc - 1) {
+            options.StaleReads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--id") && i < argc - 1) {
+            options.Id = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--ssl")) {
+            options.Ssl = true;
+        } else if (!strcmp(argv[i], "--poller") && i < argc - 1) {
+            options.Poller = argv[++i];
+        } else if (!strcmp(argv[i], "--reactors") && i < argc - 1) {
+            options.Reactors = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--client-port") && i < argc - 1) {
+            options.ClientPort = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--metrics-port") && i < argc - 1) {
+            options.MetricsPort = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--log-dir") && i < argc - 1) {
+            options.LogDir = argv[++i];
+        } else if (!strcmp(argv[i], "--no-local")) {
+            options.Local = false;
+        } else if (!strcmp(argv[i], "--lease-reads")) {
+            options.LeaseReads = true;
+        } else if (!strcmp(argv[i], "--inline-apply")) {
+            options.ApplyThread = false;
+        } else if (!strcmp(argv[i], "--help")) {
+            usage(argv[0]);
+        }
+    }
+
+    if (options.Reactors > 0 && !options.ClientPort) {
+        std::cerr << "--reactors requires --client-port\n"; return 1;
+    }
+
+#ifdef __linux__
+    if (options.Poller == "uring") {
+        return Run<NNet::TUring>(options);
+    } else if (options.Poller == "epoll") {
+        return Run<NNet::TEPoll>(options);
+    }
+#endif
+    if (options.Poller == "poll") {
+        return Run<NNet::TPoll>(options);
+    } else if (options.Poller == "select") {
+        return Run<NNet::TSelect>(options);
+    }
+    return Run<NNet::TDefaultPoller>(options);
+}
@@ -0,0 +1,104 @@
+#include "applier.h"
+
+TApplier::TApplier(std::shared_ptr<IRsm> rsm, size_t queueSize)
+    : Rsm(std::move(rsm))
+    , Tasks(queueSize)
+    , Done(queueSize)
+{ }
+
+TApplier::~TApplier() {
+    Stop();
+}
+
+void TApplier::Start() {
+    Running = true;
+    Thread = std::thread([this]() { Run(); });
+}
+
+void TApplier::Stop() {
+    if (Running.exchange(false)) {
+        {
+            std::lock_guard lock(Mutex);
+            Wakeup.notify_one();
+        }
+        Thread.join();
+    }
+}
+
+void TApplier::Push(TTask task) {
+    if (!Overflow.empty() || !Tasks.Push(task)) {
+        Overflow.emplace_back(std::move(task));
+    }
+    Pending = true;
+}
+
+void TApplier::Flush() {
+    while (!Overflow.empty() && Tasks.Push(Overflow.front())) {
+        Overflow.pop_front();
+        Pending = true;
+    }
+    if (Pending) {
+        Pending = false;
+        // checked under the lock, so a thread about to sleep sees the push
+        std::lock_guard lock(Mutex);
+        if (Sleeping) {
+            Wakeup.notify_one();
+        }
+    }
+}
+
+void TApplier::Run() {
+    TTask task;
+    while (true) {
+        bool progress = false;
+        while (Tasks.Pop(task)) {
+            Apply(task);
+            progress = true;
+        }
+        while (!DoneOverflow.empty() && Done.Push(DoneOverflow.front())) {
+            DoneOverflow.pop_front();
+            progress = true;
+        }
+        if (progress) {
+            // one wakeup per drained batch, not per entry
+            DoneEvent.Signal();
+        }
+
+        std::unique_lock lock(Mutex);
+        if (!Running) {
+            break;
+        }
+        if (!DoneOverflow.empty()) {
+            // the raft loop is behind on collecting results
+            Wakeup.wait_for(lock, std::chrono::milliseconds(1));
+        } else if (Tasks.Empty()) {
+            Sleeping = true;
+            Wakeup.wait(lock, [&]() { return !Running || !Tasks.Empty(); });
+            Sleeping = false;
+        }
+    }
+}
+
+void TApplier::Apply(TTask& task) {
+    switch (task.Kind) {
+    case TTask::EWrite:
+        Rsm->Write(std::move(task.Entry), task.Index);
+        AppliedIndex.store(task.Index, std::memory_order_release);
+        return;
+    case TTask::ERestore:
+        Rsm->Restore(*task.Data, task.Index);
+        task.Data.reset();
+        AppliedIndex.store(task.Index, std::memory_order_release);
+        return;
+    case TTask::ERead:
+        task.Response = Rsm->Read(std::move(task.Command), task.Index);
+        break;
+    case TTask::ESnapshot:
+        task.Data = std::make_shared<const std::vector<char>>(Rsm->Snapshot());
+        break;
+    }
+    if (!DoneOverflow.empty() || !Done.Push(task)) {
+        DoneOverflow.emplace_back(std::move(task));
+    }
+    task = TTask{};
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "eventfd.h"
+#include "raft.h"
+#include "spsc.h"
+
+// Runs the state machine on a thread of its own, so a slow IRsm::Write does
+// not hold back heartbeats and replication. TRaft hands it committed
+// entries, reads, snapshot and restore requests in log order through one
+// SPSC ring; applied indices come back through Applied(), read responses
+// and snapshots through a second ring. Event() is signalled whenever there
+// is something to collect.
+class TApplier {
+public:
+    struct TTask {
+        enum EKind {
+            EWrite,
+            ERead,
+            ESnapshot,
+            ERestore,
+        };
+        EKind Kind = EWrite;
+        // log index the task writes or, for reads and snapshots, observes
+        uint64_t Index = 0;
+        TMessageHolder<TCmdReq> Entry;
+        TMessageHolder<TCommandRequest> Command;
+        std::shared_ptr<INode> ReplyTo;
+        // ERead response, filled by the applier
+        TMessageHolder<TMessage> Response;
+        // ERestore input, ESnapshot output
+        std::shared_ptr<const std::vector<char>> Data;
+    };
+
+    explicit TApplier(std::shared_ptr<IRsm> rsm, size_t queueSize = 64*1024);
+    ~TApplier();
+
+    TApplier(const TApplier&) = delete;
+    TApplier& operator=(const TApplier&) = delete;
+
+    void Start();
+    void Stop();
+
+    // raft loop side. Tasks that do not fit into the ring wait in a backlog
+    // until Flush, which also wakes the thread
+    void Push(TTask task);
+    void Flush();
+    // the backlog is not empty, the raft loop stops queueing entries
+    bool Busy() const {
+        return !Overflow.empty();
+    }
+    // finished reads and snapshots, false if there are none
+    bool Pop(TTask& task) {
+        return Done.Pop(task);
+    }
+    // last entry written to the state machine
+    uint64_t Applied() const {
+        return AppliedIndex.load(std::memory_order_acquire);
+    }
+
+    TEventFd& Event() {
+        return DoneEvent;
+    }
+
+private:
+    void Run();
+    void Apply(TTask& task);
+
+    std::shared_ptr<IRsm> Rsm;
+    TSpscQueue<TTask> Tasks;
+    TSpscQueue<TTask> Done;
+    TEventFd DoneEvent;
+    std::atomic<uint64_t> AppliedIndex = 0;
+
+    // raft loop only
+    std::deque<TTask> Overflow;
+    bool Pending = false;
+
+    // applier thread only: results that did not fit into Done
+    std::deque<TTask> DoneOverflow;
+
+    std::mutex Mutex;
+    std::condition_variable Wakeup;
+    bool Sleeping = false;
+    std::atomic<bool> Running = false;
+    std::thread Thread;
+};
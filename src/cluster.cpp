@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <tuple>
+
+#include "cluster.h"
+
+namespace {
+
+uint64_t WireSize(const TMessageHolder<TMessage>& message) {
+    uint64_t size = message->Len;
+    for (uint32_t i = 0; i < message.PayloadSize; i++) {
+        size += message.Payload[i]->Len;
+    }
+    return size;
+}
+
+} // namespace
+
+void TLoopbackNode::Send(TMessageHolder<TMessage> message) {
+    Cluster->Enqueue(Src, Dst, std::move(message));
+}
+
+TCluster::TCluster(int replicas, TLinkOptions link, std::shared_ptr<TVirtualTimeSource> ts)
+    : Link(link)
+    , TimeSource(std::move(ts))
+    , Touched(replicas, false)
+{
+    for (uint32_t id = 1; id <= static_cast<uint32_t>(replicas); id++) {
+        TNodeDict nodes;
+        for (uint32_t peer = 1; peer <= static_cast<uint32_t>(replicas); peer++) {
+            if (peer != id) {
+                nodes[peer] = std::make_shared<TLoopbackNode>(this, id, peer);
+            }
+        }
+        Rafts.emplace_back(std::make_shared<TRaft>(std::make_shared<TDummyRsm>(), id, nodes));
+    }
+    // responses are sent by whichever replica led when the request came in,
+    // the source is only used for link accounting
+    Client = std::make_shared<TLoopbackNode>(this, 1, ClientId);
+}
+
+void TCluster::Enqueue(uint32_t src, uint32_t dst, TMessageHolder<TMessage> message) {
+    auto now = TimeSource->Now();
+    auto at = now;
+    if (Link.BandwidthBytesPerSec) {
+        // messages on a link are serialized one after another
+        auto& busy = BusyUntil[{src, dst}];
+        auto transmit = std::chrono::nanoseconds(WireSize(message) * 1000000000 / Link.BandwidthBytesPerSec);
+        busy = std::max(busy, now) + transmit;
+        at = busy;
+    }
+    Events.push(TEvent{
+        .At = at + Link.Latency,
+        .Seq = Seq++,
+        .Src = src,
+        .Dst = dst,
+        .Message = std::move(message)
+    });
+}
+
+bool TCluster::Submit(TMessageHolder<TCommandRequest> request) {
+    auto leader = Leader();
+    if (!leader) {
+        return false;
+    }
+    Enqueue(ClientId, leader->GetId(), std::move(request));
+    return true;
+}
+
+std::shared_ptr<TRaft> TCluster::Leader() const {
+    for (const auto& raft : Rafts) {
+        if (raft->CurrentStateName() == EState::LEADER) {
+            return raft;
+        }
+    }
+    return nullptr;
+}
+
+void TCluster::Deliver(TEvent& event) {
+    DeliveredMessages++;
+    Bytes += WireSize(event.Message);
+    if (event.Dst == ClientId) {
+        if (OnResponse) {
+            OnResponse(std::move(event.Message));
+        }
+        return;
+    }
+    auto& raft = Rafts[event.Dst - 1];
+    auto replyTo = event.Src == ClientId ? Client : nullptr;
+    raft->Process(TimeSource->Now(), std::move(event.Message), replyTo);
+    Touched[event.Dst - 1] = true;
+}
+
+void TCluster::RunUntil(ITimeSource::Time deadline, const std::function<bool()>& stop) {
+    while (TimeSource->Now() < deadline && !(stop && stop())) {
+        auto next = deadline;
+        if (!Events.empty()) {
+            next = std::min(next, Events.top().At);
+        }
+        for (const auto& raft : Rafts) {
+            next = std::min(next, raft->NextTimeout());
+        }
+        TimeSource->Set(std::max(next, TimeSource->Now()));
+        auto now = TimeSource->Now();
+
+        // everything due at this instant is delivered before timeouts run,
+        // like a server handling all ready sockets before its flush pass
+        while (!Events.empty() && Events.top().At <= now) {
+            auto event = Events.top();
+            Events.pop();
+            Deliver(event);
+        }
+        for (size_t i = 0; i < Rafts.size(); i++) {
+            if (Touched[i] || Rafts[i]->NextTimeout() <= now) {
+                Rafts[i]->ProcessTimeout(now);
+                Touched[i] = false;
+            }
+        }
+    }
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <queue>
+#include <tuple>
+#include <vector>
+
+#include "messages.h"
+#include "raft.h"
+#include "timesource.h"
+
+// In-process cluster of TRaft replicas on a simulated network, for measuring
+// the consensus core without sockets or the kernel. Time is virtual: the
+// cluster jumps straight to the next delivery or raft timeout.
+
+class TVirtualTimeSource: public ITimeSource {
+public:
+    TVirtualTimeSource()
+        : T(std::chrono::steady_clock::now())
+    { }
+
+    Time Now() override {
+        return T;
+    }
+
+    void Set(Time t) {
+        T = t;
+    }
+
+private:
+    Time T;
+};
+
+struct TLinkOptions {
+    // one way propagation delay
+    std::chrono::microseconds Latency{100};
+    // per direction, 0 for unlimited
+    uint64_t BandwidthBytesPerSec = 0;
+};
+
+class TCluster;
+
+// INode delivering into the cluster's event queue
+class TLoopbackNode: public INode {
+public:
+    TLoopbackNode(TCluster* cluster, uint32_t src, uint32_t dst)
+        : Cluster(cluster)
+        , Src(src)
+        , Dst(dst)
+    { }
+
+    void Send(TMessageHolder<TMessage> message) override;
+    void Drain() override { }
+
+private:
+    TCluster* Cluster;
+    uint32_t Src;
+    uint32_t Dst;
+};
+
+class TCluster {
+public:
+    // replicas get ids 1..replicas, id 0 is the client side
+    static constexpr uint32_t ClientId = 0;
+    using TOnResponse = std::function<void(TMessageHolder<TMessage>)>;
+
+    TCluster(int replicas, TLinkOptions link, std::shared_ptr<TVirtualTimeSource> ts);
+
+    // sends a client request to the current leader, false if there is none
+    bool Submit(TMessageHolder<TCommandRequest> request);
+    void SetOnResponse(TOnResponse onResponse) {
+        OnResponse = std::move(onResponse);
+    }
+
+    // runs deliveries and timeouts up to deadline, or until stop returns true
+    void RunUntil(ITimeSource::Time deadline, const std::function<bool()>& stop = {});
+
+    std::shared_ptr<TRaft> Leader() const;
+    const std::vector<std::shared_ptr<TRaft>>& Replicas() const {
+        return Rafts;
+    }
+
+    ITimeSource::Time Now() const {
+        return TimeSource->Now();
+    }
+
+    uint64_t Delivered() const {
+        return DeliveredMessages;
+    }
+
+    uint64_t DeliveredBytes() const {
+        return Bytes;
+    }
+
+private:
+    friend class TLoopbackNode;
+
+    struct TEvent {
+        ITimeSource::Time At;
+        uint64_t Seq;
+        uint32_t Src;
+        uint32_t Dst;
+        TMessageHolder<TMessage> Message;
+
+        bool operator< (const TEvent& other) const {
+            return std::tie(At, Seq) > std::tie(other.At, other.Seq);
+        }
+    };
+
+    void Enqueue(uint32_t src, uint32_t dst, TMessageHolder<TMessage> message);
+    void Deliver(TEvent& event);
+
+    TLinkOptions Link;
+    std::shared_ptr<TVirtualTimeSource> TimeSource;
+    std::vector<std::shared_ptr<TRaft>> Rafts; // Rafts[id - 1]
+    // replyTo handed to the leader with client requests
+    std::shared_ptr<INode> Client;
+    TOnResponse OnResponse;
+
+    std::priority_queue<TEvent> Events;
+    uint64_t Seq = 0;
+    // (src, dst) -> time the link finishes sending what it already has
+    std::map<std::pair<uint32_t, uint32_t>, ITimeSource::Time> BusyUntil;
+    std::vector<bool> Touched;
+
+    uint64_t DeliveredMessages = 0;
+    uint64_t Bytes = 0;
+};
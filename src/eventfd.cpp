@@ -0,0 +1,56 @@
+#include <system_error>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "eventfd.h"
+
+TEventFd::TEventFd() {
+#ifdef __linux__
+    ReadHandle = WriteHandle = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ReadHandle < 0) {
+        throw std::system_error(errno, std::generic_category(), "eventfd");
+    }
+#else
+    int fds[2];
+    if (pipe(fds) < 0) {
+        throw std::system_error(errno, std::generic_category(), "pipe");
+    }
+    for (auto fd : fds) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    ReadHandle = fds[0];
+    WriteHandle = fds[1];
+#endif
+}
+
+TEventFd::~TEventFd() {
+    close(ReadHandle);
+    if (WriteHandle != ReadHandle) {
+        close(WriteHandle);
+    }
+}
+
+void TEventFd::Signal() {
+    uint64_t one = 1;
+    while (write(WriteHandle, &one, sizeof(one)) < 0 && errno == EINTR) { }
+}
+
+void TEventFd::Reset() {
+    char buf[64];
+    // eventfd is reset by a single read, a pipe is drained until EAGAIN
+    while (true) {
+        auto r = read(ReadHandle, buf, sizeof(buf));
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r < (ssize_t)sizeof(buf) || ReadHandle == WriteHandle) {
+            break;
+        }
+    }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+// eventfd (a pipe outside Linux) used to wake the other side of a queue
+class TEventFd {
+public:
+    TEventFd();
+    ~TEventFd();
+
+    TEventFd(const TEventFd&) = delete;
+    TEventFd& operator=(const TEventFd&) = delete;
+
+    void Signal();
+    void Reset();
+    int Fd() const {
+        return ReadHandle;
+    }
+
+private:
+    int ReadHandle;
+    int WriteHandle;
+};
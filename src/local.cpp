@@ -0,0 +1,453 @@
+#ifdef __linux__
+
+#include <algorithm>
+#include <stdexcept>
+#include <system_error>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "local.h"
+#include "server.h"
+
+namespace {
+
+[[noreturn]] void ThrowErrno(const char* what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+// the region is only shared with processes of the same user
+bool SameUser(int conn) {
+    ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == geteuid();
+}
+
+sockaddr_un UnixAddress(const std::string& path) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("Unix socket path too long: " + path);
+    }
+    memcpy(addr.sun_path, path.data(), path.size());
+    return addr;
+}
+
+// what the server passes along with the fds
+struct THandshake {
+    uint64_t Capacity;
+};
+
+constexpr int HandshakeFds = 5; // region, then the channel's events
+
+} // namespace
+
+std::string LocalSocketDir() {
+    std::string dir;
+    if (auto* env = getenv("RABIA_LOCAL_DIR"); env && *env) {
+        dir = env;
+    } else if (auto* runtime = getenv("XDG_RUNTIME_DIR"); runtime && *runtime) {
+        dir = std::string(runtime) + "/rabia";
+    } else {
+        dir = "/tmp/rabia-" + std::to_string(geteuid());
+    }
+    mkdir(dir.c_str(), 0700);
+    // other users must not be able to plant or replace sockets in it
+    struct stat st;
+    if (lstat(dir.c_str(), &st) < 0 || !S_ISDIR(st.st_mode)
+        || st.st_uid != geteuid() || (st.st_mode & 077))
+    {
+        return {};
+    }
+    return dir;
+}
+
+std::string LocalSocketPath(int port) {
+    auto dir = LocalSocketDir();
+    if (dir.empty()) {
+        return {};
+    }
+    return dir + "/" + std::to_string(port) + ".sock";
+}
+
+std::string FindLocalSocket(const std::string& address, int port) {
+    if (address != "127.0.0.1" && address != "localhost" && address != "::1") {
+        return {};
+    }
+    auto path = LocalSocketPath(port);
+    struct stat st;
+    if (path.empty() || lstat(path.c_str(), &st) < 0 || !S_ISSOCK(st.st_mode) || st.st_uid != geteuid()) {
+        return {};
+    }
+    return path;
+}
+
+TShmRing::TShmRing(void* base, size_t capacity)
+    : Header(static_cast<THeader*>(base))
+    , Data(static_cast<char*>(base) + sizeof(THeader))
+    , Mask(capacity - 1)
+{ }
+
+bool TShmRing::Valid(uint64_t head, uint64_t tail) {
+    // the indices live in memory the peer can write
+    if (tail - head > Mask + 1) {
+        Broken = true;
+    }
+    return !Broken;
+}
+
+size_t TShmRing::Write(const void* data, size_t size) {
+    auto tail = Header->Tail.load(std::memory_order_relaxed);
+    auto head = Header->Head.load(std::memory_order_acquire);
+    if (!Valid(head, tail)) {
+        return 0;
+    }
+    size = std::min(size, Mask + 1 - (tail - head));
+    auto offset = tail & Mask;
+    auto first = std::min(size, Mask + 1 - offset);
+    memcpy(Data + offset, data, first);
+    memcpy(Data, static_cast<const char*>(data) + first, size - first);
+    Header->Tail.store(tail + size, std::memory_order_release);
+    return size;
+}
+
+size_t TShmRing::Read(void* data, size_t size) {
+    auto head = Header->Head.load(std::memory_order_relaxed);
+    auto tail = Header->Tail.load(std::memory_order_acquire);
+    if (!Valid(head, tail)) {
+        return 0;
+    }
+    size = std::min<size_t>(size, tail - head);
+    auto offset = head & Mask;
+    auto first = std::min(size, Mask + 1 - offset);
+    memcpy(data, Data + offset, first);
+    memcpy(static_cast<char*>(data) + first, Data, size - first);
+    Header->Head.store(head + size, std::memory_order_release);
+    return size;
+}
+
+void TShmRing::SetWaiting(bool waiting) {
+    // seq_cst: the reader's recheck after this store must not be reordered before it
+    Header->Waiting.store(waiting);
+}
+
+bool TShmRing::TakeWaiting() {
+    // orders the preceding Tail store before the load, pairs with SetWaiting
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return Header->Waiting.load() && Header->Waiting.exchange(false);
+}
+
+void TShmRing::SetWriterWaiting(bool waiting) {
+    Header->WriterWaiting.store(waiting);
+}
+
+bool TShmRing::TakeWriterWaiting() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return Header->WriterWaiting.load() && Header->WriterWaiting.exchange(false);
+}
+
+void TShmRing::Close() {
+    Header->Closed.store(true, std::memory_order_release);
+}
+
+bool TShmRing::Closed() const {
+    return Broken || Header->Closed.load(std::memory_order_acquire);
+}
+
+TLocalChannel::TLocalChannel(int conn, void* region, size_t capacity, std::array<int, 4> events, bool server)
+    : Conn(conn)
+    , Region(region)
+    , Capacity(capacity)
+    , Events(events)
+    , Server(server)
+{
+    auto* base = static_cast<char*>(region);
+    Rings[0] = TShmRing(base, capacity);
+    Rings[1] = TShmRing(base + TShmRing::RegionSize(capacity), capacity);
+}
+
+TLocalChannel::~TLocalChannel() {
+    Close();
+    munmap(Region, 2 * TShmRing::RegionSize(Capacity));
+    for (auto fd : Events) {
+        close(fd);
+    }
+    close(Conn);
+}
+
+std::shared_ptr<TLocalChannel> TLocalChannel::Create(int connection, size_t capacity) {
+    // takes ownership of connection, it is closed on any failure
+    auto fail = [&](const char* what, int memfd) {
+        auto err = errno;
+        close(memfd);
+        close(connection);
+        throw std::system_error(err, std::generic_category(), what);
+    };
+    auto size = 2 * TShmRing::RegionSize(capacity);
+    int memfd = memfd_create("rabia-local", MFD_CLOEXEC);
+    if (memfd < 0) {
+        fail("memfd_create", memfd);
+    }
+    if (ftruncate(memfd, size) < 0) {
+        fail("ftruncate", memfd);
+    }
+    // a fresh memfd is zero filled: both rings start empty and open
+    void* region = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (region == MAP_FAILED) {
+        fail("mmap", memfd);
+    }
+    std::array<int, 4> events;
+    for (auto& fd : events) {
+        fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    if (std::any_of(events.begin(), events.end(), [](int fd) { return fd < 0; })) {
+        auto err = errno;
+        munmap(region, size);
+        for (auto fd : events) {
+            close(fd);
+        }
+        errno = err;
+        fail("eventfd", memfd);
+    }
+    std::shared_ptr<TLocalChannel> channel(new TLocalChannel(connection, region, capacity, events, true));
+
+    THandshake handshake{.Capacity = capacity};
+    iovec iov{.iov_base = &handshake, .iov_len = sizeof(handshake)};
+    char control[CMSG_SPACE(sizeof(int) * HandshakeFds)] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    auto* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * HandshakeFds);
+    int fds[HandshakeFds] = {memfd, events[0], events[1], events[2], events[3]};
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    // a few bytes into a fresh socket buffer, never blocks
+    auto r = sendmsg(connection, &msg, MSG_NOSIGNAL);
+    close(memfd);
+    if (r != sizeof(handshake)) {
+        ThrowErrno("sendmsg");
+    }
+    return channel;
+}
+
+std::shared_ptr<TLocalChannel> TLocalChannel::Open(const std::string& path) {
+    int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn < 0) {
+        ThrowErrno("socket");
+    }
+    auto addr = UnixAddress(path);
+    if (connect(conn, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        close(conn);
+        ThrowErrno("connect");
+    }
+    if (!SameUser(conn)) {
+        close(conn);
+        throw std::runtime_error("Local server runs as another user");
+    }
+
+    THandshake handshake;
+    iovec iov{.iov_base = &handshake, .iov_len = sizeof(handshake)};
+    char control[CMSG_SPACE(sizeof(int) * HandshakeFds)] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t r;
+    while ((r = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) { }
+    auto* cmsg = CMSG_FIRSTHDR(&msg);
+    if (r != sizeof(handshake) || !cmsg || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * HandshakeFds))
+    {
+        close(conn);
+        throw std::runtime_error("Bad local handshake");
+    }
+    int fds[HandshakeFds];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    auto capacity = handshake.Capacity;
+    if (!capacity || (capacity & (capacity - 1))) {
+        for (auto fd : fds) {
+            close(fd);
+        }
+        close(conn);
+        throw std::runtime_error("Bad local ring capacity");
+    }
+
+    auto size = 2 * TShmRing::RegionSize(capacity);
+    void* region = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (region == MAP_FAILED) {
+        auto err = errno;
+        for (int i = 1; i < HandshakeFds; i++) {
+            close(fds[i]);
+        }
+        close(conn);
+        errno = err;
+        ThrowErrno("mmap");
+    }
+    return std::shared_ptr<TLocalChannel>(new TLocalChannel(conn, region, capacity, {fds[1], fds[2], fds[3], fds[4]}, false));
+}
+
+void TLocalChannel::SignalOutbound() {
+    uint64_t one = 1;
+    while (write(Events[Server ? 1 : 0], &one, sizeof(one)) < 0 && errno == EINTR) { }
+}
+
+void TLocalChannel::ResetInbound() {
+    uint64_t value;
+    while (read(InboundFd(), &value, sizeof(value)) < 0 && errno == EINTR) { }
+}
+
+void TLocalChannel::SignalSpace() {
+    uint64_t one = 1;
+    while (write(Events[Server ? 2 : 3], &one, sizeof(one)) < 0 && errno == EINTR) { }
+}
+
+void TLocalChannel::ResetSpace() {
+    uint64_t value;
+    while (read(SpaceFd(), &value, sizeof(value)) < 0 && errno == EINTR) { }
+}
+
+void TLocalChannel::Close() {
+    if (!Rings[0].Closed() || !Rings[1].Closed()) {
+        Rings[0].Close();
+        Rings[1].Close();
+        uint64_t one = 1;
+        for (auto fd : Events) {
+            write(fd, &one, sizeof(one));
+        }
+    }
+}
+
+TLocalListener::TLocalListener(const std::string& path)
+    : Path(path)
+{
+    Listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (Listener < 0) {
+        ThrowErrno("socket");
+    }
+    auto addr = UnixAddress(path);
+    unlink(path.c_str());
+    if (bind(Listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        close(Listener);
+        ThrowErrno("bind");
+    }
+    if (chmod(path.c_str(), 0600) < 0) {
+        close(Listener);
+        ThrowErrno("chmod");
+    }
+    if (listen(Listener, 128) < 0) {
+        close(Listener);
+        ThrowErrno("listen");
+    }
+}
+
+TLocalListener::~TLocalListener() {
+    close(Listener);
+    unlink(Path.c_str());
+}
+
+std::shared_ptr<TLocalChannel> TLocalListener::Accept() {
+    while (true) {
+        int conn;
+        while ((conn = accept4(Listener, nullptr, nullptr, SOCK_CLOEXEC)) < 0 && errno == EINTR) { }
+        if (conn < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return nullptr;
+            }
+            ThrowErrno("accept");
+        }
+        if (!SameUser(conn)) {
+            // no memfd for other users
+            close(conn);
+            continue;
+        }
+        return TLocalChannel::Create(conn);
+    }
+}
+
+TLocalSocket::TLocalSocket(std::shared_ptr<TLocalChannel> channel, NNet::TPollerBase* poller)
+    : Chan(std::move(channel))
+    , PollerPtr(poller)
+{ }
+
+TLocalSocket::TLocalSocket(std::string path, NNet::TPollerBase* poller)
+    : Path(std::move(path))
+    , PollerPtr(poller)
+{ }
+
+NNet::TValueTask<void> TLocalSocket::Connect(NNet::TClock::time_point) {
+    // the server answers from its accept handler, the handshake is one round trip
+    Chan = TLocalChannel::Open(Path);
+    co_return;
+}
+
+NNet::TValueTask<ssize_t> TLocalSocket::ReadSome(void* buf, size_t size) {
+    auto& ring = Chan->Inbound();
+    // a writer blocked on the full ring is woken once space was freed
+    auto freed = [&](size_t n) {
+        if (ring.TakeWriterWaiting()) {
+            Chan->SignalSpace();
+        }
+        return n;
+    };
+    while (true) {
+        if (auto n = ring.Read(buf, size)) {
+            co_return freed(n);
+        }
+        if (ring.Closed()) {
+            co_return 0;
+        }
+        // only a sleeping reader costs the writer an eventfd write
+        ring.SetWaiting(true);
+        if (auto n = ring.Read(buf, size)) {
+            ring.SetWaiting(false);
+            co_return freed(n);
+        }
+        co_await TFdReady{PollerPtr, Chan->InboundFd()};
+        Chan->ResetInbound();
+    }
+}
+
+NNet::TValueTask<ssize_t> TLocalSocket::WriteSome(const void* buf, size_t size) {
+    auto& ring = Chan->Outbound();
+    auto written = [&](size_t n) {
+        if (ring.TakeWaiting()) {
+            Chan->SignalOutbound();
+        }
+        return n;
+    };
+    while (true) {
+        if (ring.Closed()) {
+            throw std::runtime_error("Local channel closed");
+        }
+        if (auto n = ring.Write(buf, size)) {
+            co_return written(n);
+        }
+        if (ring.Closed()) {
+            continue;
+        }
+        // ring full: sleep until the reader frees space
+        ring.SetWriterWaiting(true);
+        if (auto n = ring.Write(buf, size)) {
+            ring.SetWriterWaiting(false);
+            co_return written(n);
+        }
+        co_await TFdReady{PollerPtr, Chan->SpaceFd()};
+        Chan->ResetSpace();
+    }
+}
+
+#endif
@@ -0,0 +1,175 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <coroio/all.hpp>
+
+// Same-host transport: a Unix domain socket is used once to pass a shared
+// memory region and four eventfds, requests and responses then go through
+// a pair of byte rings in that region. Per ring one eventfd wakes the
+// reader when data arrives, the other the writer when space frees up.
+
+// Private directory of the sockets: $RABIA_LOCAL_DIR, $XDG_RUNTIME_DIR/rabia
+// or /tmp/rabia-<uid>, created 0700. Empty if it is not owned by this user
+// or open to others
+std::string LocalSocketDir();
+// Where a server listening on port accepts local clients, empty if there is no private directory
+std::string LocalSocketPath(int port);
+// LocalSocketPath(port) if address is this host and a server listens there, else empty
+std::string FindLocalSocket(const std::string& address, int port);
+
+// Lock-free single-producer/single-consumer byte ring living in shared memory
+class TShmRing {
+public:
+    struct THeader {
+        alignas(64) std::atomic<uint64_t> Head;
+        alignas(64) std::atomic<uint64_t> Tail;
+        // set by the reader before it sleeps on its eventfd
+        alignas(64) std::atomic<bool> Waiting;
+        // set by the writer before it sleeps on a full ring
+        std::atomic<bool> WriterWaiting;
+        std::atomic<bool> Closed;
+    };
+
+    TShmRing() = default;
+    TShmRing(void* base, size_t capacity);
+
+    // both copy as much as fits (or is available), 0 if nothing or the
+    // indices are corrupt, which closes the ring for this side
+    size_t Write(const void* data, size_t size);
+    size_t Read(void* data, size_t size);
+
+    // reader side: announce sleeping, writer side: whether to signal
+    void SetWaiting(bool waiting);
+    bool TakeWaiting();
+    // the same for a writer waiting for space, the reader signals it
+    void SetWriterWaiting(bool waiting);
+    bool TakeWriterWaiting();
+
+    void Close();
+    bool Closed() const;
+
+    static size_t RegionSize(size_t capacity) {
+        return sizeof(THeader) + capacity;
+    }
+
+private:
+    bool Valid(uint64_t head, uint64_t tail);
+
+    THeader* Header = nullptr;
+    char* Data = nullptr;
+    size_t Mask = 0;
+    // process-private, the peer cannot reopen the ring
+    bool Broken = false;
+};
+
+// Shared region plus the eventfds of both directions, owned by one side
+class TLocalChannel {
+public:
+    static constexpr size_t DefaultCapacity = 1024 * 1024;
+
+    ~TLocalChannel();
+
+    // server side: creates the region and passes it over the accepted connection
+    static std::shared_ptr<TLocalChannel> Create(int connection, size_t capacity = DefaultCapacity);
+    // client side: connects to path and maps the region received
+    static std::shared_ptr<TLocalChannel> Open(const std::string& path);
+
+    TShmRing& Inbound() {
+        return Rings[Server ? 0 : 1];
+    }
+
+    TShmRing& Outbound() {
+        return Rings[Server ? 1 : 0];
+    }
+
+    int InboundFd() const {
+        return Events[Server ? 0 : 1];
+    }
+
+    // signalled when the peer frees space in Outbound()
+    int SpaceFd() const {
+        return Events[Server ? 3 : 2];
+    }
+
+    void SignalOutbound();
+    void ResetInbound();
+    // after reading from a ring the peer waits to write to
+    void SignalSpace();
+    void ResetSpace();
+
+    int Connection() const {
+        return Conn;
+    }
+
+    // marks both rings closed and wakes both sides
+    void Close();
+
+private:
+    TLocalChannel(int conn, void* region, size_t capacity, std::array<int, 4> events, bool server);
+
+    int Conn;
+    void* Region;
+    size_t Capacity;
+    // [0] client -> server, [1] server -> client
+    TShmRing Rings[2];
+    // data in Rings[0], data in Rings[1], space in Rings[0], space in Rings[1]
+    std::array<int, 4> Events;
+    bool Server;
+};
+
+// Nonblocking Unix domain socket listener for TLocalChannel handshakes
+class TLocalListener {
+public:
+    explicit TLocalListener(const std::string& path);
+    ~TLocalListener();
+
+    int Fd() const {
+        return Listener;
+    }
+
+    // nullptr when no connection is pending
+    std::shared_ptr<TLocalChannel> Accept();
+
+private:
+    std::string Path;
+    int Listener;
+};
+
+// Byte stream over a TLocalChannel, usable where a coroio socket is
+// (TByteWriter, TStructReader, TMessageReader, TNode)
+class TLocalSocket {
+public:
+    TLocalSocket() = default;
+    TLocalSocket(std::shared_ptr<TLocalChannel> channel, NNet::TPollerBase* poller);
+    // client side, the handshake happens on Connect
+    TLocalSocket(std::string path, NNet::TPollerBase* poller);
+
+    NNet::TValueTask<void> Connect(NNet::TClock::time_point deadline = NNet::TClock::time_point::max());
+    NNet::TValueTask<ssize_t> ReadSome(void* buf, size_t size);
+    NNet::TValueTask<ssize_t> WriteSome(const void* buf, size_t size);
+
+    NNet::TPollerBase* Poller() {
+        return PollerPtr;
+    }
+
+    const std::shared_ptr<TLocalChannel>& Channel() const {
+        return Chan;
+    }
+
+private:
+    std::string Path;
+    std::shared_ptr<TLocalChannel> Chan;
+    NNet::TPollerBase* PollerPtr = nullptr;
+};
+
+#endif
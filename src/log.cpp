@@ -0,0 +1,497 @@
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <filesystem>
+#include <stdexcept>
+#include <system_error>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "log.h"
+
+namespace {
+
+[[noreturn]] void ThrowErrno(const std::string& what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+// entries start 8-byte aligned, so their headers can be read in place
+uint64_t Align(uint64_t size) {
+    return (size + 7) & ~uint64_t(7);
+}
+
+// precedes every entry: a record whose entry does not match its checksum,
+// as after a torn append, ends the log on recovery
+struct TRecord {
+    uint32_t Len;
+    uint32_t Crc;
+};
+
+// an all-zero record ends a segment: a fresh file is zero filled and every
+// append writes one after its entry, so recovery stops at the right place
+// even over bytes left behind by a truncation
+constexpr uint64_t Terminator = sizeof(TRecord);
+
+// CRC-32C, bytewise with a table built at compile time
+constexpr auto CrcTable = [] {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78 : 0);
+        }
+        table[i] = crc;
+    }
+    return table;
+}();
+
+uint32_t Crc32c(const void* data, size_t size) {
+    auto* p = static_cast<const unsigned char*>(data);
+    uint32_t crc = ~0U;
+    for (size_t i = 0; i < size; i++) {
+        crc = CrcTable[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+constexpr uint64_t MetaMagic = 0x31617465'6d746672ULL;
+
+struct TMetaRecord {
+    uint64_t Magic;
+    uint64_t Term;
+    uint32_t VotedFor;
+    uint32_t Reserved = 0;
+};
+
+constexpr uint64_t SnapshotMagic = 0x31746e73'70616e73ULL;
+
+struct TSnapshotHeader {
+    uint64_t Magic;
+    uint64_t Index;
+    uint64_t Term;
+    uint64_t Size;
+};
+
+std::string SegmentName(uint64_t firstIndex) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "log-%020llu.seg", (unsigned long long)firstIndex);
+    return buf;
+}
+
+void PWrite(int fd, const iovec* iov, int iovcnt, uint64_t offset, const std::string& path) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    // regular files don't return short writes short of ENOSPC, which is an error here
+    auto r = pwritev(fd, iov, iovcnt, offset);
+    if (r < 0) {
+        ThrowErrno("pwritev " + path);
+    }
+    if (static_cast<size_t>(r) != total) {
+        throw std::runtime_error("Short write to " + path);
+    }
+}
+
+// path is either the old or the new contents after a crash
+void ReplaceFile(const std::string& path, const iovec* iov, int iovcnt) {
+    auto tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ThrowErrno("open " + tmp);
+    }
+    try {
+        PWrite(fd, iov, iovcnt, 0, tmp);
+        if (fdatasync(fd) < 0) {
+            ThrowErrno("fdatasync " + tmp);
+        }
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    if (rename(tmp.c_str(), path.c_str()) < 0) {
+        ThrowErrno("rename " + tmp);
+    }
+}
+
+} // namespace
+
+TSegmentedLog::TSegmentedLog(std::string dir, uint64_t segmentSize, size_t mappedSegments)
+    : Dir(std::move(dir))
+    , SegmentSize(segmentSize)
+    , MappedSegments(std::max<size_t>(1, mappedSegments))
+{
+    std::filesystem::create_directories(Dir);
+    LoadMeta();
+    Recover();
+}
+
+TSegmentedLog::~TSegmentedLog() {
+    for (auto& segment : Segments) {
+        Close(segment);
+    }
+}
+
+void TSegmentedLog::Open(TSegment& segment, bool create) {
+    segment.Fd = open(segment.Path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (segment.Fd < 0) {
+        ThrowErrno("open " + segment.Path);
+    }
+    if (create) {
+        if (ftruncate(segment.Fd, segment.Capacity) < 0) {
+            ThrowErrno("ftruncate " + segment.Path);
+        }
+    } else {
+        struct stat st;
+        if (fstat(segment.Fd, &st) < 0) {
+            ThrowErrno("fstat " + segment.Path);
+        }
+        segment.Capacity = st.st_size;
+    }
+}
+
+void TSegmentedLog::Close(TSegment& segment) {
+    if (segment.Map) {
+        munmap(const_cast<char*>(segment.Map), segment.Capacity);
+        segment.Map = nullptr;
+        Mapped--;
+    }
+    if (segment.Fd >= 0) {
+        close(segment.Fd);
+        segment.Fd = -1;
+    }
+}
+
+const char* TSegmentedLog::Map(TSegment& segment) {
+    segment.LastUse = ++Clock;
+    if (segment.Map) {
+        return segment.Map;
+    }
+    if (Mapped >= MappedSegments) {
+        // unmap the least recently read segment
+        TSegment* victim = nullptr;
+        for (auto& s : Segments) {
+            if (s.Map && (!victim || s.LastUse < victim->LastUse)) {
+                victim = &s;
+            }
+        }
+        munmap(const_cast<char*>(victim->Map), victim->Capacity);
+        victim->Map = nullptr;
+        Mapped--;
+    }
+    void* map = mmap(nullptr, segment.Capacity, PROT_READ, MAP_SHARED, segment.Fd, 0);
+    if (map == MAP_FAILED) {
+        ThrowErrno("mmap " + segment.Path);
+    }
+    segment.Map = static_cast<const char*>(map);
+    Mapped++;
+    return segment.Map;
+}
+
+void TSegmentedLog::Recover() {
+    std::vector<uint64_t> firstIndices;
+    for (const auto& file : std::filesystem::directory_iterator(Dir)) {
+        auto name = file.path().filename().string();
+        if (name.size() != SegmentName(0).size() || !name.starts_with("log-") || !name.ends_with(".seg")) {
+            continue;
+        }
+        uint64_t firstIndex = 0;
+        auto digits = std::string_view(name).substr(4, 20);
+        std::from_chars(digits.data(), digits.data() + digits.size(), firstIndex);
+        firstIndices.push_back(firstIndex);
+    }
+    std::sort(firstIndices.begin(), firstIndices.end());
+
+    bool torn = false;
+    for (auto firstIndex : firstIndices) {
+        auto path = Dir + "/" + SegmentName(firstIndex);
+        if (torn) {
+            // past the damaged record
+            unlink(path.c_str());
+            continue;
+        }
+        if (Segments.empty()) {
+            // compaction may have dropped the segments before it
+            LastIndex = firstIndex - 1;
+        } else if (firstIndex != LastIndex + 1) {
+            // left behind by an interrupted truncation
+            unlink(path.c_str());
+            continue;
+        }
+        auto& segment = Segments.emplace_back(TSegment{.FirstIndex = firstIndex, .Path = path});
+        Open(segment, false);
+        auto* data = Map(segment);
+        uint64_t offset = 0;
+        while (offset + sizeof(TRecord) + sizeof(TMessage) <= segment.Capacity) {
+            auto* record = reinterpret_cast<const TRecord*>(data + offset);
+            auto* entry = data + offset + sizeof(TRecord);
+            if (record->Len == 0) {
+                break;
+            }
+            if (record->Len < sizeof(TMessage) || offset + sizeof(TRecord) + record->Len > segment.Capacity
+                || reinterpret_cast<const TMessage*>(entry)->Len != record->Len
+                || Crc32c(entry, record->Len) != record->Crc)
+            {
+                // the log ends before the first damaged record, whatever follows it
+                torn = true;
+                break;
+            }
+            segment.Offsets.push_back(offset + sizeof(TRecord));
+            offset += sizeof(TRecord) + Align(record->Len);
+        }
+        segment.Used = offset;
+        if (torn) {
+            static const char zeros[Terminator] = {};
+            iovec iov = {.iov_base = const_cast<char*>(zeros), .iov_len = Terminator};
+            PWrite(segment.Fd, &iov, 1, segment.Used, segment.Path);
+            if (fdatasync(segment.Fd) < 0) {
+                ThrowErrno("fdatasync " + segment.Path);
+            }
+        }
+        if (segment.Offsets.empty()) {
+            Close(segment);
+            unlink(path.c_str());
+            Segments.pop_back();
+            continue;
+        }
+        LastIndex = firstIndex + segment.Offsets.size() - 1;
+    }
+    if (torn) {
+        SyncDir();
+    }
+    LastTerm = Term(LastIndex);
+    SyncedIndex = LastIndex;
+}
+
+TSegmentedLog::TSegment& TSegmentedLog::Locate(uint64_t index) {
+    auto it = std::upper_bound(Segments.begin(), Segments.end(), index, [](uint64_t index, const TSegment& s) {
+        return index < s.FirstIndex;
+    });
+    return *std::prev(it);
+}
+
+const char* TSegmentedLog::Entry(uint64_t index) {
+    auto& segment = Locate(index);
+    return Map(segment) + segment.Offsets[index - segment.FirstIndex];
+}
+
+uint64_t TSegmentedLog::Term(uint64_t index) {
+    if (index < 1 || index > LastIndex || Segments.empty() || index < Segments.front().FirstIndex) {
+        return 0;
+    }
+    if (index == LastIndex && LastTerm) {
+        return LastTerm;
+    }
+    return reinterpret_cast<const TCmdReq*>(Entry(index))->Term;
+}
+
+TMessageHolder<TCmdReq> TSegmentedLog::Get(uint64_t index) {
+    auto* data = Entry(index);
+    auto len = reinterpret_cast<const TMessage*>(data)->Len;
+    auto entry = NewHoldedMessage<TCmdReq>(len);
+    memcpy(entry.RawData.get(), data, len);
+    return entry;
+}
+
+void TSegmentedLog::Roll(uint64_t need) {
+    if (!Segments.empty()) {
+        auto& last = Segments.back();
+        if (last.Used + need <= last.Capacity) {
+            return;
+        }
+    }
+    auto firstIndex = LastIndex + 1;
+    auto& segment = Segments.emplace_back(TSegment{
+        .FirstIndex = firstIndex,
+        .Path = Dir + "/" + SegmentName(firstIndex),
+        .Capacity = std::max(SegmentSize, need),
+    });
+    Open(segment, true);
+    NewSegment = true;
+}
+
+void TSegmentedLog::Append(const TMessageHolder<TCmdReq>& entry) {
+    uint64_t len = entry->Len;
+    Roll(sizeof(TRecord) + Align(len) + Terminator);
+    auto& segment = Segments.back();
+    static const char zeros[Terminator + 8] = {};
+    TRecord record{.Len = static_cast<uint32_t>(len), .Crc = Crc32c(entry.RawData.get(), len)};
+    iovec iov[3] = {
+        {.iov_base = &record, .iov_len = sizeof(record)},
+        {.iov_base = entry.RawData.get(), .iov_len = len},
+        {.iov_base = const_cast<char*>(zeros), .iov_len = Align(len) - len + Terminator},
+    };
+    PWrite(segment.Fd, iov, 3, segment.Used, segment.Path);
+    segment.Offsets.push_back(segment.Used + sizeof(TRecord));
+    segment.Used += sizeof(TRecord) + Align(len);
+    LastIndex++;
+    LastTerm = entry->Term;
+    segment.Dirty = true;
+}
+
+void TSegmentedLog::Truncate(uint64_t size) {
+    if (size >= LastIndex) {
+        return;
+    }
+    bool dropped = false;
+    while (!Segments.empty() && Segments.back().FirstIndex > size) {
+        auto& segment = Segments.back();
+        Close(segment);
+        unlink(segment.Path.c_str());
+        Segments.pop_back();
+        dropped = true;
+    }
+    if (dropped) {
+        // a dropped segment must not come back after a crash and extend the
+        // rewritten log with stale entries
+        SyncDir();
+    }
+    if (!Segments.empty()) {
+        auto& segment = Segments.back();
+        auto keep = size - segment.FirstIndex + 1;
+        segment.Used = segment.Offsets[keep] - sizeof(TRecord);
+        segment.Offsets.resize(keep);
+        static const char zeros[Terminator] = {};
+        iovec iov = {.iov_base = const_cast<char*>(zeros), .iov_len = Terminator};
+        PWrite(segment.Fd, &iov, 1, segment.Used, segment.Path);
+        segment.Dirty = true;
+    }
+    LastIndex = size;
+    LastTerm = 0;
+    LastTerm = Term(LastIndex);
+    SyncedIndex = std::min(SyncedIndex, size);
+}
+
+void TSegmentedLog::Compact(uint64_t index) {
+    size_t drop = 0;
+    if (index >= LastIndex) {
+        drop = Segments.size();
+    } else {
+        while (drop + 1 < Segments.size() && Segments[drop + 1].FirstIndex <= index + 1) {
+            drop++;
+        }
+    }
+    for (size_t i = 0; i < drop; i++) {
+        Close(Segments[i]);
+        unlink(Segments[i].Path.c_str());
+    }
+    Segments.erase(Segments.begin(), Segments.begin() + drop);
+    if (drop) {
+        // recovery must not see a gap between a stale segment and the next one
+        SyncDir();
+    }
+    if (index >= LastIndex) {
+        LastIndex = index;
+        LastTerm = 0;
+        // covered by the snapshot
+        SyncedIndex = index;
+    }
+}
+
+void TSegmentedLog::SaveSnapshot(uint64_t index, uint64_t term, const std::vector<char>& data) {
+    TSnapshotHeader header{.Magic = SnapshotMagic, .Index = index, .Term = term, .Size = data.size()};
+    iovec iov[2] = {
+        {.iov_base = &header, .iov_len = sizeof(header)},
+        {.iov_base = const_cast<char*>(data.data()), .iov_len = data.size()},
+    };
+    ReplaceFile(Dir + "/snapshot", iov, 2);
+    SyncDir();
+}
+
+std::optional<TSegmentedLog::TSnapshot> TSegmentedLog::LoadSnapshot() const {
+    auto path = Dir + "/snapshot";
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return std::nullopt;
+        }
+        ThrowErrno("open " + path);
+    }
+    TSnapshotHeader header;
+    TSnapshot snapshot;
+    bool ok = pread(fd, &header, sizeof(header), 0) == sizeof(header) && header.Magic == SnapshotMagic;
+    if (ok) {
+        snapshot.Index = header.Index;
+        snapshot.Term = header.Term;
+        snapshot.Data.resize(header.Size);
+        ok = pread(fd, snapshot.Data.data(), header.Size, sizeof(header)) == static_cast<ssize_t>(header.Size);
+    }
+    close(fd);
+    if (!ok) {
+        throw std::runtime_error("Corrupted " + path);
+    }
+    return snapshot;
+}
+
+void TSegmentedLog::SyncDir() {
+    int fd = open(Dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        ThrowErrno("open " + Dir);
+    }
+    fsync(fd);
+    close(fd);
+}
+
+bool TSegmentedLog::Sync() {
+    bool synced = false;
+    // at most the last two segments, when an append rolled over
+    for (auto it = Segments.rbegin(); it != Segments.rend() && it->Dirty; ++it) {
+        if (fdatasync(it->Fd) < 0) {
+            ThrowErrno("fdatasync " + it->Path);
+        }
+        it->Dirty = false;
+        synced = true;
+    }
+    if (NewSegment) {
+        SyncDir();
+        NewSegment = false;
+        synced = true;
+    }
+    if (MetaDirty) {
+        WriteMeta();
+        MetaDirty = false;
+        synced = true;
+    }
+    SyncedIndex = LastIndex;
+    return synced;
+}
+
+void TSegmentedLog::SetMeta(TMeta meta) {
+    if (meta.Term != CurrentMeta.Term || meta.VotedFor != CurrentMeta.VotedFor) {
+        CurrentMeta = meta;
+        MetaDirty = true;
+    }
+}
+
+void TSegmentedLog::LoadMeta() {
+    auto path = Dir + "/meta";
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return;
+        }
+        ThrowErrno("open " + path);
+    }
+    TMetaRecord record;
+    auto r = read(fd, &record, sizeof(record));
+    close(fd);
+    // written whole and renamed into place, a partial record is corruption
+    if (r != sizeof(record) || record.Magic != MetaMagic) {
+        throw std::runtime_error("Corrupted " + path);
+    }
+    CurrentMeta = TMeta{.Term = record.Term, .VotedFor = record.VotedFor};
+}
+
+void TSegmentedLog::WriteMeta() {
+    TMetaRecord record{.Magic = MetaMagic, .Term = CurrentMeta.Term, .VotedFor = CurrentMeta.VotedFor};
+    iovec iov = {.iov_base = &record, .iov_len = sizeof(record)};
+    ReplaceFile(Dir + "/meta", &iov, 1);
+    SyncDir();
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "messages.h"
+
+// Raft log kept in fixed-size segment files <dir>/log-<first index>.seg.
+// Entries are appended with pwrite, each after its length and CRC-32C, and
+// read back through read-only mmaps of the segments; only a few segments are
+// mapped at a time, so memory use is the page cache plus 4 bytes of index
+// per entry. Truncating drops whole
+// segments and cuts the last one in O(1).
+// Term and vote live next to it in <dir>/meta, the latest state machine
+// snapshot in <dir>/snapshot; both are replaced atomically. Compacting drops
+// the segments the snapshot covers, so the log may start past index 1.
+// Nothing is durable before Sync(), callers batch it per loop turn. Recovery
+// keeps the entries before the first record that fails its checksum.
+class TSegmentedLog {
+public:
+    struct TMeta {
+        uint64_t Term = 0;
+        uint32_t VotedFor = 0;
+    };
+
+    struct TSnapshot {
+        uint64_t Index = 0;
+        uint64_t Term = 0;
+        std::vector<char> Data;
+    };
+
+    static constexpr uint64_t DefaultSegmentSize = 64 * 1024 * 1024;
+    static constexpr size_t DefaultMappedSegments = 4;
+
+    // opens dir (created if missing) and recovers the entries found there
+    explicit TSegmentedLog(std::string dir,
+        uint64_t segmentSize = DefaultSegmentSize,
+        size_t mappedSegments = DefaultMappedSegments);
+    ~TSegmentedLog();
+
+    TSegmentedLog(const TSegmentedLog&) = delete;
+    TSegmentedLog& operator=(const TSegmentedLog&) = delete;
+
+    // index of the last entry, 0 if empty
+    uint64_t Size() const {
+        return LastIndex;
+    }
+
+    // entries up to it survive a crash: recovered, synced or compacted
+    uint64_t Synced() const {
+        return SyncedIndex;
+    }
+
+    // 1-based, 0 for an index outside the log or compacted away
+    uint64_t Term(uint64_t index);
+    // copy of the entry at index (1-based, must exist)
+    TMessageHolder<TCmdReq> Get(uint64_t index);
+
+    void Append(const TMessageHolder<TCmdReq>& entry);
+    // keeps the first size entries
+    void Truncate(uint64_t size);
+    // drops the segments holding only entries up to index; past the end it
+    // empties the log and the next append gets index + 1
+    void Compact(uint64_t index);
+    const TMeta& Meta() const {
+        return CurrentMeta;
+    }
+
+    void SetMeta(TMeta meta);
+
+    // durable on return, call before compacting the entries it covers
+    void SaveSnapshot(uint64_t index, uint64_t term, const std::vector<char>& data);
+    std::optional<TSnapshot> LoadSnapshot() const;
+
+    // makes appends, truncations and the meta durable, false if there was
+    // nothing to write
+    bool Sync();
+
+private:
+    struct TSegment {
+        uint64_t FirstIndex = 0;
+        std::string Path;
+        int Fd = -1;
+        uint64_t Capacity = 0;
+        uint64_t Used = 0;
+        const char* Map = nullptr;
+        uint64_t LastUse = 0;
+        // written since the last Sync
+        bool Dirty = false;
+        // entry offsets within the segment
+        std::vector<uint32_t> Offsets;
+    };
+
+    void Recover();
+    void Open(TSegment& segment, bool create);
+    void Close(TSegment& segment);
+    TSegment& Locate(uint64_t index);
+    const char* Entry(uint64_t index);
+    const char* Map(TSegment& segment);
+    void Roll(uint64_t need);
+    void SyncDir();
+    void LoadMeta();
+    void WriteMeta();
+
+    std::string Dir;
+    uint64_t SegmentSize;
+    size_t MappedSegments;
+    std::vector<TSegment> Segments;
+    size_t Mapped = 0;
+    uint64_t Clock = 0;
+    uint64_t LastIndex = 0;
+    uint64_t LastTerm = 0;
+    uint64_t SyncedIndex = 0;
+    // a segment file was created since the last Sync
+    bool NewSegment = false;
+    TMeta CurrentMeta;
+    bool MetaDirty = false;
+};
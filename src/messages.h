@@ -23,8 +23,26 @@ enum class EMessageType : uint32_t {
     STATE = 4,
     VOTE = 5,
     DECIDED = 6,
-    RESPONSE = 7
+    RESPONSE = 7,
+    HELLO = 8,
+    INSTALL_SNAPSHOT_REQUEST = 9,
+    INSTALL_SNAPSHOT_RESPONSE = 10,
+    READ_INDEX_REQUEST = 11,
+    READ_INDEX_RESPONSE = 12,
+    APPEND_ENTRIES_CONFLICT = 13,
+    LOG_BATCH = 14,
+    FORWARD_REQUEST = 15,
+    FORWARD_RESPONSE = 16,
+    LEADER_HINT = 17,
+    LEARNER_READ_REQUEST = 18,
+    LEARNER_READ_RESPONSE = 19,
+    REQUEST_VOTE_REQUEST = 20,
+    REQUEST_VOTE_RESPONSE = 21,
+    APPEND_ENTRIES_REQUEST = 22,   // heartbeats too
+    APPEND_ENTRIES_RESPONSE = 23
 };  // equiv to _valid_types in lab4, #1 is from client
+// one past the last EMessageType, move along when adding one
+static constexpr size_t MessageTypeCount = static_cast<size_t>(EMessageType::APPEND_ENTRIES_RESPONSE) + 1;
 
 // used in state messages
 enum class EStateType : uint16_t {
@@ -233,4 +251,149 @@ struct TResponse : public TMessage{
     static constexpr EMessageType MessageType = EMessageType::RESPONSE;
     uint64_t client_seq;
     uint64_t value;
-};
\ No newline at end of file
+};
+
+// Send lanes of a peer connection, drained with weighted priority
+enum class ELane : uint32_t {
+    CONTROL = 0,    // consensus rounds, votes, read index, acks
+    CLIENT = 1,     // client requests and responses
+    BULK = 2,       // log replication and snapshots
+};
+static constexpr size_t LaneCount = 3;
+
+// by type, never by size: a lane keeps its order, so AppendEntries of any
+// size, heartbeats included, reach the follower in the order they were sent
+inline ELane SendLane(const TMessage& message) {
+    switch (static_cast<EMessageType>(message.Type)) {
+    case EMessageType::CMD_REQ:
+    case EMessageType::RESPONSE:
+    case EMessageType::FORWARD_REQUEST:
+    case EMessageType::FORWARD_RESPONSE:
+    case EMessageType::LEADER_HINT:
+        return ELane::CLIENT;
+    case EMessageType::APPEND_ENTRIES_REQUEST:
+    case EMessageType::INSTALL_SNAPSHOT_REQUEST:
+        return ELane::BULK;
+    default:
+        return ELane::CONTROL;
+    }
+}
+
+// First message on a peer connection, identifies the dialing replica
+// size 16
+struct THello : public TMessage {
+    static constexpr EMessageType MessageType = EMessageType::HELLO;
+};
+static_assert(sizeof(THello) == 16);
+
+// Raft: one chunk of the leader's snapshot, Data holds Len - sizeof bytes
+// starting at Offset
+struct TInstallSnapshotRequest : public TMessageEx {
+    static constexpr EMessageType MessageType = EMessageType::INSTALL_SNAPSHOT_REQUEST;
+    uint64_t LastIncludedIndex;
+    uint64_t LastIncludedTerm;
+    uint64_t Offset;
+    uint32_t LeaderId;
+    uint32_t Done;
+    char Data[0];
+};
+
+// Raft: Offset is how much of the snapshot the follower holds, the leader
+// continues from there
+struct TInstallSnapshotResponse : public TMessageEx {
+    static constexpr EMessageType MessageType = EMessageType::INSTALL_SNAPSHOT_RESPONSE;
+    uint64_t LastIncludedIndex;
+    uint64_t Offset;
+    uint32_t Done;
+    uint32_t Padding = 0;
+};
+
+// Raft: heartbeat round confirming leadership for reads, Seq is echoed back
+struct TReadIndexRequest : public TMessageEx {
+    static constexpr EMessageType MessageType = EMessageType::READ_INDEX_REQUEST;
+    uint64_t Seq;
+};
+
+struct TReadIndexResponse : public TMessageEx {
+    static constexpr EMessageType MessageType = EMessageType::READ_INDEX_RESPONSE;
+    uint64_t Seq;
+};
+
+// Raft: a learner asks the leader for a read index. The leader answers once
+// a ReadIndex round confirmed it, the learner serves its reads when it has
+// applied Index
+struct TLearnerReadRequest : public TMessageEx {
+    static constexpr EMessageType MessageType = EMessageType::LEARNER_READ_REQUEST;
+    uint64_t Seq;
+};
+
+struct TLearnerReadResponse : public TMessageEx {
+    static constexpr EMessageType MessageType = EMessageType::LEARNER_READ_RESPONSE;
+    uint64_t Seq;
+    uint64_t Index;
+};
+
+// Raft: AppendEntries rejected on a log mismatch. ConflictTerm is the term
+// of the follower's entry at PrevLogIndex, 0 if its log ends before it, and
+// ConflictIndex the first index of that term or the follower's log size + 1
+struct TAppendEntriesConflict : public TMessageEx {
+    static constexpr EMessageType MessageType = EMessageType::APPEND_ENTRIES_CONFLICT;
+    uint64_t ConflictTerm;
+    uint64_t ConflictIndex;
+};
+
+// Raft: log entry packing the writes a leader received in one loop turn.
+// Data holds Count prepared log entries, each padded to Align bytes
+struct TCmdBatch : public TMessageEx {
+    static constexpr EMessageType MessageType = EMessageType::LOG_BATCH;
+    static constexpr uint32_t Align = 8;
+    uint32_t Count;
+    uint32_t Padding = 0;
+    char Data[0];
+};
+
+// Raft: client command a follower relays to the leader, Data holds the
+// TCommandRequest. The leader answers with the same Seq
+struct TForwardRequest : public TMessageEx {
+    static constexpr EMessageType MessageType = EMessageType::FORWARD_REQUEST;
+    uint64_t Seq;
+    char Data[0];
+};
+
+// Raft: Data holds the leader's response for the client
+struct TForwardResponse : public TMessageEx {
+    static constexpr EMessageType MessageType = EMessageType::FORWARD_RESPONSE;
+    uint64_t Seq;
+    char Data[0];
+};
+
+// Raft: sent to a client instead of a response when the node could not get
+// its command to a leader, or the leader changed while it was relayed and
+// the outcome is unknown. LeaderId is the current leader, 0 if none is known
+struct TLeaderHint : public TMessage {
+    static constexpr EMessageType MessageType = EMessageType::LEADER_HINT;
+    uint32_t LeaderId = 0;
+    uint32_t Padding = 0;
+};
+
+// What an overflowing outbox may do with a queued message
+enum class EDropPolicy {
+    KEEP = 0,       // client traffic and decisions must be delivered
+    DROP_STALE = 1  // superseded by later rounds, or resent by the Raft leader
+};
+
+inline EDropPolicy DropPolicy(const TMessage& message) {
+    switch (static_cast<EMessageType>(message.Type)) {
+    case EMessageType::PROPOSAL:
+    case EMessageType::STATE:
+    case EMessageType::VOTE:
+        return EDropPolicy::DROP_STALE;
+    // the leader resends from NextIndex once the follower answers with a
+    // conflict or the rpc timeout passes
+    case EMessageType::APPEND_ENTRIES_REQUEST:
+    case EMessageType::INSTALL_SNAPSHOT_REQUEST:
+        return EDropPolicy::DROP_STALE;
+    default:
+        return EDropPolicy::KEEP;
+    }
+}
\ No newline at end of file
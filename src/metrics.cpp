@@ -0,0 +1,171 @@
+#include <algorithm>
+#include <iostream>
+#include <string_view>
+
+#include "metrics.h"
+
+void THistogram::Observe(std::chrono::nanoseconds value) {
+    auto us = static_cast<uint64_t>(std::max<int64_t>(0, value.count() / 1000));
+    size_t bucket = 0;
+    while (bucket < Bounds.size() && us > Bounds[bucket]) {
+        bucket++;
+    }
+    Buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    Sum.fetch_add(value.count(), std::memory_order_relaxed);
+}
+
+TMetrics::TSeries& TMetrics::Find(const std::string& name, const std::string& help, const std::string& labels, EKind kind) {
+    std::lock_guard guard(Mutex);
+    TFamily* family = nullptr;
+    for (auto& f : Families) {
+        if (f.Name == name) {
+            family = &f;
+            break;
+        }
+    }
+    if (!family) {
+        family = &Families.emplace_back(TFamily{.Name = name, .Help = help, .Kind = kind});
+    }
+    for (auto& series : family->Series) {
+        if (series.Labels == labels) {
+            return series;
+        }
+    }
+    auto& series = family->Series.emplace_back(TSeries{.Labels = labels});
+    switch (kind) {
+    case EKind::COUNTER:
+        series.Counter = std::make_unique<TCounter>();
+        break;
+    case EKind::GAUGE:
+        series.Gauge = std::make_unique<TGauge>();
+        break;
+    case EKind::HISTOGRAM:
+        series.Histogram = std::make_unique<THistogram>();
+        break;
+    }
+    return series;
+}
+
+TCounter& TMetrics::Counter(const std::string& name, const std::string& help, const std::string& labels) {
+    return *Find(name, help, labels, EKind::COUNTER).Counter;
+}
+
+TGauge& TMetrics::Gauge(const std::string& name, const std::string& help, const std::string& labels) {
+    return *Find(name, help, labels, EKind::GAUGE).Gauge;
+}
+
+THistogram& TMetrics::Histogram(const std::string& name, const std::string& help, const std::string& labels) {
+    return *Find(name, help, labels, EKind::HISTOGRAM).Histogram;
+}
+
+void TMetrics::OnScrape(std::function<void()> collector) {
+    std::lock_guard guard(Mutex);
+    Collectors.emplace_back(std::move(collector));
+}
+
+std::string TMetrics::Render() {
+    std::vector<std::function<void()>> collectors;
+    {
+        std::lock_guard guard(Mutex);
+        collectors = Collectors;
+    }
+    // collectors may register new series, so they run unlocked
+    for (const auto& collect : collectors) {
+        collect();
+    }
+
+    std::lock_guard guard(Mutex);
+    std::string out;
+    auto series = [&](std::string_view name, std::string_view suffix, const std::string& labels, std::string_view extra, const std::string& value) {
+        out.append(name).append(suffix);
+        if (!labels.empty() || !extra.empty()) {
+            out += '{';
+            out += labels;
+            if (!labels.empty() && !extra.empty()) {
+                out += ',';
+            }
+            out.append(extra);
+            out += '}';
+        }
+        out.append(" ").append(value).append("\n");
+    };
+    for (const auto& family : Families) {
+        static constexpr std::string_view kinds[] = {"counter", "gauge", "histogram"};
+        out.append("# HELP ").append(family.Name).append(" ").append(family.Help).append("\n");
+        out.append("# TYPE ").append(family.Name).append(" ").append(kinds[static_cast<int>(family.Kind)]).append("\n");
+        for (const auto& s : family.Series) {
+            switch (family.Kind) {
+            case EKind::COUNTER:
+                series(family.Name, "", s.Labels, "", std::to_string(s.Counter->Get()));
+                break;
+            case EKind::GAUGE:
+                series(family.Name, "", s.Labels, "", std::to_string(s.Gauge->Get()));
+                break;
+            case EKind::HISTOGRAM: {
+                uint64_t total = 0;
+                for (size_t i = 0; i <= THistogram::Bounds.size(); i++) {
+                    total += s.Histogram->Count(i);
+                    auto le = i < THistogram::Bounds.size()
+                        ? std::to_string(THistogram::Bounds[i] / 1e6)
+                        : std::string("+Inf");
+                    series(family.Name, "_bucket", s.Labels, "le=\"" + le + "\"", std::to_string(total));
+                }
+                series(family.Name, "_sum", s.Labels, "", std::to_string(s.Histogram->SumNs() / 1e9));
+                series(family.Name, "_count", s.Labels, "", std::to_string(total));
+                break;
+            }
+            }
+        }
+    }
+    return out;
+}
+
+template<typename TSocket>
+void TMetricsServer<TSocket>::Serve() {
+    Accept();
+}
+
+template<typename TSocket>
+NNet::TVoidTask TMetricsServer<TSocket>::Accept() {
+    while (true) {
+        auto client = co_await Socket.Accept();
+        Connection(std::move(client));
+    }
+    co_return;
+}
+
+template<typename TSocket>
+NNet::TVoidTask TMetricsServer<TSocket>::Connection(TSocket socket) {
+    try {
+        // one request per connection: read the head, answer, close
+        std::string request;
+        char buf[1024];
+        while (request.find("\r\n\r\n") == std::string::npos) {
+            auto size = co_await socket.ReadSome(buf, sizeof(buf));
+            if (size <= 0 || request.size() + size > 8192) {
+                co_return;
+            }
+            request.append(buf, size);
+        }
+        std::string status = "200 OK";
+        std::string body;
+        if (request.starts_with("GET /metrics ") || request.starts_with("GET / ")) {
+            body = Metrics->Render();
+        } else {
+            status = "404 Not Found";
+        }
+        auto response = "HTTP/1.1 " + status + "\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: " + std::to_string(body.size()) + "\r\n"
+            "Connection: close\r\n\r\n" + body;
+        co_await NNet::TByteWriter(socket).Write(response.data(), response.size());
+    } catch (const std::exception& ex) {
+        std::cerr << "Metrics connection: " << ex.what() << "\n";
+    }
+    co_return;
+}
+
+template class TMetricsServer<NNet::TSocket>;
+#ifdef __linux__
+template class TMetricsServer<NNet::TUringSocket>;
+#endif
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include <coroio/all.hpp>
+
+// Prometheus style metrics. Updates are relaxed atomics and can come from any
+// thread; registration and rendering take a lock and stay off the hot path.
+
+class TCounter {
+public:
+    void Inc(uint64_t n = 1) {
+        Value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    // for totals kept elsewhere (node stats) and copied in on scrape
+    void Set(uint64_t value) {
+        Value.store(value, std::memory_order_relaxed);
+    }
+
+    uint64_t Get() const {
+        return Value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> Value = 0;
+};
+
+class TGauge {
+public:
+    void Set(int64_t value) {
+        Value.store(value, std::memory_order_relaxed);
+    }
+
+    int64_t Get() const {
+        return Value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<int64_t> Value = 0;
+};
+
+// Latency histogram with fixed buckets from 10us to 1s
+class THistogram {
+public:
+    static constexpr std::array<uint64_t, 12> Bounds = { // us
+        10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 100000, 1000000
+    };
+
+    void Observe(std::chrono::nanoseconds value);
+
+    uint64_t Count(size_t bucket) const {
+        return Buckets[bucket].load(std::memory_order_relaxed);
+    }
+
+    uint64_t SumNs() const {
+        return Sum.load(std::memory_order_relaxed);
+    }
+
+private:
+    // one more for +Inf
+    std::array<std::atomic<uint64_t>, Bounds.size() + 1> Buckets = {};
+    std::atomic<uint64_t> Sum = 0;
+};
+
+class TMetrics {
+public:
+    // labels are in exposition syntax without braces: type="vote",peer="2"
+    TCounter& Counter(const std::string& name, const std::string& help, const std::string& labels = {});
+    TGauge& Gauge(const std::string& name, const std::string& help, const std::string& labels = {});
+    THistogram& Histogram(const std::string& name, const std::string& help, const std::string& labels = {});
+
+    // runs right before each render, on the rendering thread, to sample
+    // values that are cheaper to read than to track (queue depths, indices)
+    void OnScrape(std::function<void()> collector);
+
+    std::string Render();
+
+private:
+    enum class EKind {
+        COUNTER,
+        GAUGE,
+        HISTOGRAM,
+    };
+
+    struct TSeries {
+        std::string Labels;
+        std::unique_ptr<TCounter> Counter;
+        std::unique_ptr<TGauge> Gauge;
+        std::unique_ptr<THistogram> Histogram;
+    };
+
+    struct TFamily {
+        std::string Name;
+        std::string Help;
+        EKind Kind;
+        std::deque<TSeries> Series;
+    };
+
+    TSeries& Find(const std::string& name, const std::string& help, const std::string& labels, EKind kind);
+
+    std::mutex Mutex;
+    std::deque<TFamily> Families;
+    std::vector<std::function<void()>> Collectors;
+};
+
+// Minimal HTTP/1.1 endpoint serving GET /metrics on the caller's loop.
+// Rendering is a pass over a few hundred atomics, the response is written
+// asynchronously, so a slow scraper does not hold up consensus.
+template<typename TSocket>
+class TMetricsServer {
+public:
+    TMetricsServer(TSocket socket, std::shared_ptr<TMetrics> metrics)
+        : Socket(std::move(socket))
+        , Metrics(std::move(metrics))
+    { }
+
+    void Serve();
+
+private:
+    NNet::TVoidTask Accept();
+    NNet::TVoidTask Connection(TSocket socket);
+
+    TSocket Socket;
+    std::shared_ptr<TMetrics> Metrics;
+};
@@ -2,6 +2,7 @@
 #include <climits>
 #include <cstdint>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <iostream>
 #include <algorithm>
@@ -9,7 +10,9 @@
 #include <string.h>
 #include <assert.h>
 
+#include "log.h"
 #include "raft.h"
+#include "applier.h"
 #include "messages.h"
 #include "timesource.h"
 
@@ -22,6 +25,41 @@ static uint32_t rand_(uint32_t* seed) {
     return *seed;
 }
 
+int CountVoters(uint32_t node, const TNodeDict& nodes, const std::unordered_set<uint32_t>& learners) {
+    int voters = !learners.contains(node);
+    for (const auto& [id, _] : nodes) {
+        voters += !learners.contains(id);
+    }
+    return voters;
+}
+
+// replyTo for a relayed command, wraps the response back to the follower
+class TForwardNode: public INode {
+public:
+    TForwardNode(std::shared_ptr<INode> follower, TMessage header, uint64_t seq)
+        : Follower(std::move(follower))
+        , Header(header)
+        , Seq(seq)
+    { }
+
+    void Send(TMessageHolder<TMessage> message) override {
+        auto mes = NewHoldedMessage<TForwardResponse>(sizeof(TForwardResponse) + message->Len);
+        mes->Src = Header.Src;
+        mes->Dst = Header.Dst;
+        mes->Term = Header.Term;
+        mes->Seq = Seq;
+        memcpy(mes->Data, message.Mes, message->Len);
+        Follower->Send(std::move(mes));
+    }
+
+    void Drain() override { }
+
+private:
+    std::shared_ptr<INode> Follower;
+    TMessage Header;
+    uint64_t Seq;
+};
+
 } // namespace
 
 TMessageHolder<TMessage> TDummyRsm::Read(TMessageHolder<TCommandRequest> message, uint64_t index)
@@ -29,11 +67,14 @@ TMessageHolder<TMessage> TDummyRsm::Read(TMessageHolder<TCommandRequest> message
     int64_t readIndex;
     memcpy(&readIndex, message->Data, sizeof(readIndex));
     if (readIndex > 0 && readIndex <= Log.size()) {
-        auto log = Log[readIndex-1];
-        auto size = log->Len - sizeof(TMessage);
-        auto mes = NewHoldedMessage<TCommandResponse>(sizeof(TCommandResponse) + size);
+        // the data of the commands of that entry, in order
+        std::vector<char> data;
+        ForEachCommand(Log[readIndex-1], [&](TMessageHolder<TCmdReq> command) {
+            data.insert(data.end(), command->Data, command->Data + command->Len - sizeof(TMessage));
+        });
+        auto mes = NewHoldedMessage<TCommandResponse>(sizeof(TCommandResponse) + data.size());
         mes->Index = index;
-        memcpy(mes->Data, log->Data, size);
+        memcpy(mes->Data, data.data(), data.size());
         return mes;
     } else {
         return NewHoldedMessage<TCommandResponse>(TCommandResponse {.Index = index});
@@ -43,13 +84,41 @@ TMessageHolder<TMessage> TDummyRsm::Read(TMessageHolder<TCommandRequest> message
 void TDummyRsm::Write(TMessageHolder<TCmdReq> message, uint64_t index)
 {
     if (LastAppliedIndex < index) {
+        // one slot per raft index, batches and no-ops included
         Log.emplace_back(std::move(message));
         LastAppliedIndex = index;
     }
 }
 
+// LastAppliedIndex followed by the written entries
+std::vector<char> TDummyRsm::Snapshot()
+{
+    std::vector<char> data(sizeof(LastAppliedIndex));
+    memcpy(data.data(), &LastAppliedIndex, sizeof(LastAppliedIndex));
+    for (const auto& entry : Log) {
+        auto* raw = reinterpret_cast<const char*>(entry.Mes);
+        data.insert(data.end(), raw, raw + entry->Len);
+    }
+    return data;
+}
+
+void TDummyRsm::Restore(const std::vector<char>& snapshot, uint64_t index)
+{
+    Log.clear();
+    size_t offset = sizeof(LastAppliedIndex);
+    while (offset + sizeof(TMessage) <= snapshot.size()) {
+        TMessage header;
+        memcpy(&header, snapshot.data() + offset, sizeof(header));
+        auto entry = NewHoldedMessage<TCmdReq>(header.Len);
+        memcpy(entry.RawData.get(), snapshot.data() + offset, header.Len);
+        Log.emplace_back(std::move(entry));
+        offset += header.Len;
+    }
+    LastAppliedIndex = index;
+}
+
 // input client command, output log entry (for appending)
-TMessageHolder<TCmdReq> TDummyRsm::Prepare(TMessageHolder<TCommandRequest> command, uint64_t term)
+TMessageHolder<TCmdReq> TDummyRsm::Prepare(TMessageHolder<TCommandRequest> command, uint64_t term) const
 {
     auto dataSize = command->Len - sizeof(TCommandRequest);
     auto entry = NewHoldedMessage<TCmdReq>(sizeof(TCmdReq)+dataSize);
@@ -58,6 +127,101 @@ TMessageHolder<TCmdReq> TDummyRsm::Prepare(TMessageHolder<TCommandRequest> comma
     return entry;
 }
 
+uint64_t TState::LogSize() const {
+    return Store ? Store->Size() : SnapshotIndex + Log.size();
+}
+
+uint64_t TState::DurableSize() const {
+    if (!Store) {
+        return LogSize();
+    }
+    // the snapshot is durable once saved
+    return std::max(SnapshotIndex, std::min(Store->Synced(), LogSize()));
+}
+
+TMessageHolder<TCmdReq> TState::LogEntry(uint64_t index) const {
+    return Store ? Store->Get(index) : Log[index-SnapshotIndex-1];
+}
+
+void TState::Append(TMessageHolder<TCmdReq> entry) {
+    if (Store) {
+        Store->Append(entry);
+    } else {
+        Log.emplace_back(std::move(entry));
+    }
+}
+
+void TState::Truncate(uint64_t size) {
+    if (Store) {
+        Store->Truncate(size);
+    } else if (LogSize() > size) {
+        // entries covered by the snapshot are committed and never truncated
+        Log.resize(std::max(size, SnapshotIndex) - SnapshotIndex);
+    }
+}
+
+void TState::Compact(uint64_t index, uint64_t term) {
+    if (index <= SnapshotIndex) {
+        return;
+    }
+    if (Store) {
+        Store->Compact(index);
+    } else if (index >= LogSize()) {
+        Log.clear();
+    } else {
+        Log.erase(Log.begin(), Log.begin() + (index - SnapshotIndex));
+    }
+    SnapshotIndex = index;
+    SnapshotTerm = term;
+}
+
+uint64_t TState::LogTerm(int64_t index) const {
+    auto size = LogSize();
+    if (index < 0) {
+        index = size;
+    }
+    if (index == SnapshotIndex) {
+        return SnapshotTerm;
+    } else if (index < SnapshotIndex || index > size) {
+        return 0;
+    } else if (Store) {
+        return Store->Term(index);
+    } else {
+        return Log[index-SnapshotIndex-1]->Term;
+    }
+}
+
+uint64_t TState::TermStart(uint64_t index) const {
+    auto term = LogTerm(index);
+    // the snapshot keeps no entries before it
+    auto lo = std::max<uint64_t>(SnapshotIndex, 1);
+    auto hi = index;
+    while (lo < hi) {
+        auto mid = lo + (hi - lo) / 2;
+        if (LogTerm(mid) < term) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+uint64_t TState::TermEnd(uint64_t term) const {
+    // first index past the entries of term
+    auto lo = SnapshotIndex;
+    auto hi = LogSize() + 1;
+    while (lo < hi) {
+        auto mid = lo + (hi - lo) / 2;
+        if (LogTerm(mid) <= term) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo > 0 && LogTerm(lo - 1) == term ? lo - 1 : 0;
+}
+
 TVolatileState& TVolatileState::SetElectionDue(ITimeSource::Time due) {
     ElectionDue = due;
     return *this;
@@ -71,55 +235,108 @@ TVolatileState& TVolatileState::Vote(uint32_t nodeId)
 
 TVolatileState& TVolatileState::CommitAdvance(int nservers, const TState& state)
 {
-    auto lastIndex = state.Log.size();
-    Indices.clear(); Indices.reserve(nservers);
-    for (auto [_, index] : MatchIndex) {
-        Indices.push_back(index);
+    if (Ranked != Peers.size()) {
+        RankPeers();
+    }
+    // a majority is the leader, for what it has on disk, and nservers/2
+    // peers, or nservers/2+1 peers without it; its fsync runs while the
+    // peers replicate, either may finish first
+    size_t need = nservers / 2;
+    auto logSize = state.LogSize();
+    uint64_t quorumIndex = 0;
+    if (need == 0) {
+        quorumIndex = state.DurableSize();
+    } else if (need <= ByMatch.size()) {
+        quorumIndex = std::min(state.DurableSize(), Peers[ByMatch[need - 1]].MatchIndex);
     }
-    Indices.push_back(lastIndex);
-    while (Indices.size() < nservers) {
-        Indices.push_back(0);
+    if (need < ByMatch.size()) {
+        quorumIndex = std::max(quorumIndex, std::min(logSize, Peers[ByMatch[need]].MatchIndex));
     }
-    std::sort(Indices.begin(), Indices.end());
-    auto commitIndex = std::max(CommitIndex, Indices[nservers / 2]);
-    if (state.LogTerm(commitIndex) == state.CurrentTerm) {
-        CommitIndex = commitIndex;
+    // most acks leave it where it was, skip the term lookup then
+    if (quorumIndex > CommitIndex && state.LogTerm(quorumIndex) == state.CurrentTerm) {
+        CommitIndex = quorumIndex;
     }
     return *this;
 }
 
-TVolatileState& TVolatileState::SetNextIndex(uint32_t id, uint64_t nextIndex)
+void TVolatileState::RankPeers()
+{
+    ByMatch.clear();
+    for (size_t i = 0; i < Peers.size(); i++) {
+        if (!Peers[i].Learner) {
+            ByMatch.push_back(i);
+        }
+    }
+    Ranked = Peers.size();
+    std::stable_sort(ByMatch.begin(), ByMatch.end(), [&](uint32_t a, uint32_t b) {
+        return Peers[a].MatchIndex > Peers[b].MatchIndex;
+    });
+    for (size_t i = 0; i < ByMatch.size(); i++) {
+        Peers[ByMatch[i]].Rank = i;
+    }
+}
+
+TVolatileState& TVolatileState::SetNextIndex(size_t peer, uint64_t nextIndex)
 {
-    NextIndex[id] = nextIndex;
+    Peers[peer].NextIndex = nextIndex;
     return *this;
 }
 
-TVolatileState& TVolatileState::SetMatchIndex(uint32_t id, uint64_t matchIndex)
+TVolatileState& TVolatileState::SetMatchIndex(size_t peer, uint64_t matchIndex)
 {
-    MatchIndex[id] = matchIndex;
+    Peers[peer].MatchIndex = matchIndex;
+    if (Ranked != Peers.size()) {
+        RankPeers();
+        return *this;
+    }
+    if (Peers[peer].Learner) {
+        return *this;
+    }
+    auto step = [&](uint32_t rank) {
+        std::swap(ByMatch[rank], ByMatch[rank + 1]);
+        Peers[ByMatch[rank]].Rank = rank;
+        Peers[ByMatch[rank + 1]].Rank = rank + 1;
+    };
+    auto rank = Peers[peer].Rank;
+    while (rank > 0 && Peers[ByMatch[rank - 1]].MatchIndex < matchIndex) {
+        step(--rank);
+    }
+    while (rank + 1 < ByMatch.size() && Peers[ByMatch[rank + 1]].MatchIndex > matchIndex) {
+        step(rank++);
+    }
     return *this;
 }
 
-TVolatileState& TVolatileState::SetHearbeatDue(uint32_t id, ITimeSource::Time heartbeatDue)
+TVolatileState& TVolatileState::SetHearbeatDue(size_t peer, ITimeSource::Time heartbeatDue)
 {
-    HeartbeatDue[id] = heartbeatDue;
+    Peers[peer].HeartbeatDue = heartbeatDue;
     return *this;
 }
 
-TVolatileState& TVolatileState::SetRpcDue(uint32_t id, ITimeSource::Time rpcDue)
+TVolatileState& TVolatileState::SetRpcDue(size_t peer, ITimeSource::Time rpcDue)
 {
-    RpcDue[id] = rpcDue;
+    Peers[peer].RpcDue = rpcDue;
     return *this;
 }
 
-TVolatileState& TVolatileState::SetBatchSize(uint32_t id, int size)
+TVolatileState& TVolatileState::SetBatchSize(size_t peer, int size)
 {
-    BatchSize[id] = size;
+    Peers[peer].BatchSize = size;
+    return *this;
+}
+
+TVolatileState& TVolatileState::SetBackOff(size_t peer, int size) {
+    Peers[peer].BackOff = size;
     return *this;
 }
 
-TVolatileState& TVolatileState::SetBackOff(uint32_t id, int size) {
-    BackOff[id] = size;
+TVolatileState& TVolatileState::SetSnapshotOffset(size_t peer, uint64_t offset) {
+    Peers[peer].SnapshotOffset = offset;
+    return *this;
+}
+
+TVolatileState& TVolatileState::SetPipelined(size_t peer, bool pipelined) {
+    Peers[peer].Pipelined = pipelined;
     return *this;
 }
 
@@ -129,34 +346,68 @@ TVolatileState& TVolatileState::SetCommitIndex(int index)
     return *this;
 }
 
-TRaft::TRaft(std::shared_ptr<IRsm> rsm, int node, const TNodeDict& nodes)
+TRaft::TRaft(std::shared_ptr<IRsm> rsm, int node, const TNodeDict& nodes, const std::unordered_set<uint32_t>& learners)
     : Rsm(rsm)
     , Id(node)
     , Nodes(nodes)
-    , MinVotes((nodes.size()+2+nodes.size()%2)/2)
+    , Learners(learners)
+    , Learner(learners.contains(node))
+    , MinVotes(CountVoters(node, nodes, learners)/2+1)
     , Npeers(nodes.size())
-    , Nservers(nodes.size()+1)
+    , Nservers(CountVoters(node, nodes, learners))
     , State(std::make_unique<TState>())
     , VolatileState(std::make_unique<TVolatileState>())
     , StateName(EState::FOLLOWER)
+    , Seed(31337 + node) // replicas must not share election jitter
 {
-    for (auto [id, _] : Nodes) {
-        VolatileState->NextIndex[id] = 1;
+    for (const auto& [id, _] : Nodes) {
+        PeerIds.push_back(id);
+    }
+    // ids may be sparse, a binary search over them gives the ordinal
+    std::sort(PeerIds.begin(), PeerIds.end());
+    for (auto id : PeerIds) {
+        PeerNodes.push_back(Nodes.at(id));
+    }
+    VolatileState->Peers = MakePeers(1);
+}
+
+std::vector<TPeerState> TRaft::MakePeers(uint64_t nextIndex) const {
+    std::vector<TPeerState> peers(PeerNodes.size());
+    for (const auto& [id, _] : Nodes) {
+        peers[Ordinal(id)].Id = id;
+        peers[Ordinal(id)].Learner = Learners.contains(id);
+        peers[Ordinal(id)].NextIndex = nextIndex;
+        peers[Ordinal(id)].BatchBytes = std::min(MinBatchBytes, MaxBatchBytes);
+    }
+    return peers;
+}
+
+void TRaft::SetState(const TState& state) {
+    *State = state;
+    // the snapshot is already applied to the state machine
+    if (VolatileState->LastApplied < State->SnapshotIndex) {
+        VolatileState->CommitIndex = std::max(VolatileState->CommitIndex, State->SnapshotIndex);
+        VolatileState->LastApplied = State->SnapshotIndex;
+        ApplyQueued = std::max(ApplyQueued, State->SnapshotIndex);
     }
 }
 
 void TRaft::OnRequestVote(ITimeSource::Time now, TMessageHolder<TRequestVoteRequest> message) {
+    if (Learner) {
+        // candidates do not ask learners, this one is misconfigured
+        return;
+    }
     if (message->Term < State->CurrentTerm) {
         auto reply = NewHoldedMessage(
             TMessage {.Src = Id, .Dst = message->Src, .Term = State->CurrentTerm},
             TRequestVoteResponse {.VoteGranted = false});
-        Nodes[reply->Dst]->Send(std::move(reply));
+        SendDurable(reply->Dst, std::move(reply));
     } else if (message->Term == State->CurrentTerm) {
         bool accept = false;
         if (State->VotedFor == 0 || State->VotedFor == message->CandidateId) {
             if (message->LastLogTerm > State->LogTerm()) {
                 accept = true;
-            } else if (message->LastLogTerm == State->LogTerm() && message->LastLogIndex >= State->Log.size()) {
+            } else if (message->LastLogTerm == State->LogTerm() && message->LastLogIndex >= State->LogSize()) {
                 accept = true;
             }
         }
@@ -170,15 +421,16 @@ void TRaft::OnRequestVote(ITimeSource::Time now, TMessageHolder<TRequestVoteRequ
             State->VotedFor = message->CandidateId;
         }
 
-        Nodes[reply->Dst]->Send(std::move(reply));
+        SendDurable(reply->Dst, std::move(reply));
     }
 }
 
 void TRaft::OnRequestVote(TMessageHolder<TRequestVoteResponse> message) {
-    if (message->VoteGranted && message->Term == State->CurrentTerm) {
+    auto peer = Ordinal(message->Src);
+    if (peer >= 0 && message->VoteGranted && message->Term == State->CurrentTerm) {
         (*VolatileState)
             .Vote(message->Src)
-            .SetRpcDue(message->Src, ITimeSource::Max);
+            .SetRpcDue(peer, ITimeSource::Max);
     }
 }
 
@@ -196,7 +448,7 @@ void TRaft::OnAppendEntries(ITimeSource::Time now, TMessageHolder<TAppendEntries
                 .MatchIndex = 0,
                 .Success = false,
             });
-        Nodes[reply->Dst]->Send(std::move(reply));
+        SendDurable(reply->Dst, std::move(reply));
         return;
     }
 
@@ -206,22 +458,24 @@ void TRaft::OnAppendEntries(ITimeSource::Time now, TMessageHolder<TAppendEntries
     uint64_t commitIndex = VolatileState->CommitIndex;
     bool success = false;
     if (message->PrevLogIndex == 0 ||
-        (message->PrevLogIndex <= State->Log.size()
+        // entries up to the snapshot are committed, so they match
+        message->PrevLogIndex < State->SnapshotIndex ||
+        (message->PrevLogIndex <= State->LogSize()
             && State->LogTerm(message->PrevLogIndex) == message->PrevLogTerm))
     {
         success = true;
         auto index = message->PrevLogIndex;
-        auto& log = State->Log;
         for (uint32_t i = 0 ; i < message.PayloadSize; i++) {
             auto& data = message.Payload[i];
             auto entry = data.Cast<TCmdReq>();
             index++;
+            if (index <= State->SnapshotIndex) {
+                continue;
+            }
             // replace or append log entries
             if (State->LogTerm(index) != entry->Term) {
-                while (log.size() > index-1) {
-                    log.pop_back();
-                }
-                log.push_back(entry);
+                State->Truncate(index-1);
+                State->Append(std::move(entry));
             }
         }
 
@@ -229,119 +483,583 @@ void TRaft::OnAppendEntries(ITimeSource::Time now, TMessageHolder<TAppendEntries
         commitIndex = std::max(commitIndex, message->LeaderCommit);
     }
 
-    auto reply = NewHoldedMessage(
-        TMessage {.Src = Id, .Dst = message->Src, .Term = State->CurrentTerm},
-        TAppendEntriesResponse {.MatchIndex = matchIndex, .Success = success});
+    TMessageHolder<TMessage> reply;
+    if (success) {
+        reply = NewHoldedMessage(
+            TMessage {.Src = Id, .Dst = message->Src, .Term = State->CurrentTerm},
+            TAppendEntriesResponse {.MatchIndex = matchIndex, .Success = true});
+    } else {
+        // lets the leader skip the whole conflicting term at once
+        auto conflictTerm = State->LogTerm(message->PrevLogIndex);
+        auto conflictIndex = conflictTerm
+            ? State->TermStart(message->PrevLogIndex)
+            : State->LogSize() + 1;
+        reply = NewHoldedMessage(
+            TMessage {.Src = Id, .Dst = message->Src, .Term = State->CurrentTerm},
+            TAppendEntriesConflict {.ConflictTerm = conflictTerm, .ConflictIndex = conflictIndex});
+    }
 
     (*VolatileState)
         .SetCommitIndex(commitIndex)
         .SetElectionDue(MakeElection(now));
+    LeaderContact = now;
     Become(EState::FOLLOWER);
-    Nodes[reply->Dst]->Send(std::move(reply));
+    SetLeader(message->Src);
+    SendDurable(message->Src, std::move(reply));
 }
 
-void TRaft::OnAppendEntries(TMessageHolder<TAppendEntriesResponse> message) {
+void TRaft::OnAppendEntries(ITimeSource::Time now, TMessageHolder<TAppendEntriesResponse> message) {
     if (message->Term != State->CurrentTerm) {
         return;
     }
 
-    auto nodeId = message->Src;
+    auto ordinal = Ordinal(message->Src);
+    if (ordinal < 0) {
+        return;
+    }
+    auto& peer = VolatileState->Peers[ordinal];
     if (message->Success) {
-        auto matchIndex = std::max(VolatileState->MatchIndex[nodeId], message->MatchIndex);
+        auto matchIndex = std::max(peer.MatchIndex, message->MatchIndex);
+        // batches sent after this one may still be on their way
+        auto nextIndex = std::max(peer.NextIndex, matchIndex+1);
+        VolatileState->SetMatchIndex(ordinal, matchIndex);
+        peer.NextIndex = nextIndex;
+        peer.Pipelined = true;
+        peer.BatchSize = MaxBatchEntries;
+        peer.BackOff = 1;
+        std::optional<ITimeSource::Time> sent;
+        while (!peer.InFlight.empty() && peer.InFlight.front().first <= matchIndex) {
+            sent = peer.InFlight.front().second;
+            peer.InFlight.pop_front();
+        }
+        if (sent) {
+            // queueing behind earlier batches counts: a slow ack means the
+            // pipe is over full or the frames are too big
+            auto latency = now - *sent;
+            if (latency > BatchLatency) {
+                peer.BatchBytes = std::max(MinBatchBytes, peer.BatchBytes / 2);
+            } else if (latency < BatchLatency / 2) {
+                peer.BatchBytes = std::min(MaxBatchBytes, peer.BatchBytes * 2);
+            }
+        }
+        if (nextIndex == matchIndex+1) {
+            // nothing outstanding
+            peer.RpcDue = ITimeSource::Time{};
+        }
+        VolatileState->CommitAdvance(Nservers, *State);
+    } else {
+        auto backOff = std::max(peer.BackOff, 1);
+        auto next = peer.NextIndex;
+        if (peer.Pipelined) {
+            // the batches sent after the rejected one are void as well
+            next = std::min(next, peer.MatchIndex+1);
+        }
+        auto nextIndex = next > backOff ? next - backOff : 0;
+        peer.Pipelined = false;
+        peer.InFlight.clear();
+        peer.NextIndex = std::max((uint64_t)1, nextIndex);
+        peer.RpcDue = ITimeSource::Time{};
+        peer.BatchSize = 1;
+        peer.BackOff = std::min(32768, backOff << 1);
+    }
+}
+
+void TRaft::OnAppendEntries(TMessageHolder<TAppendEntriesConflict> message) {
+    auto ordinal = Ordinal(message->Src);
+    if (ordinal < 0 || message->Term != State->CurrentTerm) {
+        return;
+    }
+    auto& peer = VolatileState->Peers[ordinal];
+    auto nextIndex = message->ConflictIndex;
+    if (message->ConflictTerm) {
+        // both logs agree up to the last entry of that term the leader has
+        if (auto end = State->TermEnd(message->ConflictTerm)) {
+            nextIndex = end + 1;
+        }
+    }
+    // batches in flight after the rejected one are void as well
+    peer.Pipelined = false;
+    peer.InFlight.clear();
+    peer.NextIndex = std::clamp<uint64_t>(nextIndex, peer.MatchIndex + 1, State->LogSize() + 1);
+    peer.RpcDue = ITimeSource::Time{};
+    peer.BatchSize = 1;
+    peer.BackOff = 1;
+}
+
+void TRaft::OnInstallSnapshot(ITimeSource::Time now, TMessageHolder<TInstallSnapshotRequest> message) {
+    auto reply = [&](uint64_t offset, bool done) {
+        SendDurable(message->Src, NewHoldedMessage(
+            TMessage {.Src = Id, .Dst = message->Src, .Term = State->CurrentTerm},
+            TInstallSnapshotResponse {
+                .LastIncludedIndex = message->LastIncludedIndex,
+                .Offset = offset,
+                .Done = done,
+            }));
+    };
+    if (message->Term < State->CurrentTerm) {
+        reply(0, false);
+        return;
+    }
+
+    VolatileState->ElectionDue = MakeElection(now);
+    LeaderContact = now;
+    Become(EState::FOLLOWER);
+    SetLeader(message->Src);
+
+    auto index = message->LastIncludedIndex;
+    if (index <= VolatileState->CommitIndex) {
+        // everything it covers is here already
+        reply(0, true);
+        return;
+    }
+    if (message->Offset == 0 || IncomingIndex != index) {
+        IncomingIndex = index;
+        IncomingData.clear();
+    }
+    if (message->Offset != IncomingData.size()) {
+        // a chunk was lost, ask for the rest
+        reply(IncomingData.size(), false);
+        return;
+    }
+    auto size = message->Len - sizeof(TInstallSnapshotRequest);
+    IncomingData.insert(IncomingData.end(), message->Data, message->Data + size);
+    auto received = IncomingData.size();
+    if (message->Done) {
+        InstallSnapshot(index, message->LastIncludedTerm, std::move(IncomingData));
+        IncomingData = {};
+        IncomingIndex = 0;
+    }
+    reply(received, message->Done);
+}
+
+void TRaft::OnInstallSnapshot(TMessageHolder<TInstallSnapshotResponse> message) {
+    if (message->Term != State->CurrentTerm) {
+        return;
+    }
+
+    auto peer = Ordinal(message->Src);
+    if (peer < 0) {
+        return;
+    }
+    if (message->Done) {
+        auto matchIndex = std::max(VolatileState->Peers[peer].MatchIndex, message->LastIncludedIndex);
         (*VolatileState)
-            .SetMatchIndex(nodeId, matchIndex)
-            .SetNextIndex(nodeId, message->MatchIndex+1)
-            .SetRpcDue(nodeId, ITimeSource::Time{})
-            .SetBatchSize(nodeId, 1024)
-            .SetBackOff(nodeId, 1)
+            .SetSnapshotOffset(peer, 0)
+            .SetMatchIndex(peer, matchIndex)
+            .SetNextIndex(peer, matchIndex+1)
+            .SetRpcDue(peer, ITimeSource::Time{})
+            .SetBackOff(peer, 1)
             .CommitAdvance(Nservers, *State);
     } else {
-        auto backOff = std::max(VolatileState->BackOff[nodeId], 1);
-        auto nextIndex = VolatileState->NextIndex[nodeId] > backOff
-            ? VolatileState->NextIndex[nodeId] - backOff
-            : 0;
+        // an answer about an older snapshot restarts the transfer
+        auto offset = message->LastIncludedIndex == Snapshot.Index ? message->Offset : 0;
         (*VolatileState)
-            .SetNextIndex(nodeId, std::max((uint64_t)1, nextIndex))
-            .SetRpcDue(nodeId, ITimeSource::Time{})
-            .SetBatchSize(nodeId, 1)
-            .SetBackOff(nodeId, std::min(32768, backOff << 1));
+            .SetSnapshotOffset(peer, offset)
+            .SetRpcDue(peer, ITimeSource::Time{});
     }
 }
 
-void TRaft::OnCommandRequest(TMessageHolder<TCommandRequest> command, const std::shared_ptr<INode>& replyTo) {
-    auto& log = State->Log;
+void TRaft::OnCommandRequest(ITimeSource::Time now, TMessageHolder<TCommandRequest> command, const std::shared_ptr<INode>& replyTo) {
     if (command->Flags & TCommandRequest::EWrite) {
-        auto entry = Rsm->Prepare(std::move(command), State->CurrentTerm);
-        log.emplace_back(std::move(entry));
+        PendingWrites.emplace_back(TPendingWrite{std::move(command), replyTo});
+        return;
+    }
+    if (!replyTo) {
+        return;
+    }
+    QueueRead(now, TPendingRead{.Command = std::move(command), .ReplyTo = replyTo});
+}
+
+void TRaft::QueueRead(ITimeSource::Time now, TPendingRead read) {
+    // the commit index is only known to be current once the leader
+    // committed an entry of its own term
+    read.Index = State->LogTerm(VolatileState->CommitIndex) == State->CurrentTerm
+        ? VolatileState->CommitIndex
+        : State->LogSize();
+    read.Seq = 0;
+    if (!LeaseReads || LeaseUntil <= now) {
+        read.Seq = ReadSeq + 1;
+        ReadRoundWanted = true;
+    } else if (LeaseUntil - now < TTimeout::Election / 4) {
+        // renew ahead of expiry
+        ReadRoundWanted = true;
+    }
+    PendingReads.emplace_back(std::move(read));
+}
+
+void TRaft::OnLearnerRead(ITimeSource::Time now, TMessageHolder<TLearnerReadRequest> message) {
+    auto peer = Ordinal(message->Src);
+    if (peer < 0 || message->Term != State->CurrentTerm) {
+        return;
+    }
+    QueueRead(now, TPendingRead{
+        .ReplyTo = PeerNodes[peer],
+        .LearnerId = message->Src,
+        .LearnerSeq = message->Seq});
+}
+
+void TRaft::OnLearnerRead(TMessageHolder<TLearnerReadResponse> message) {
+    if (message->Src != LeaderId || message->Term != State->CurrentTerm || message->Seq <= ReadConfirmed) {
+        return;
+    }
+    // every read asked for up to Seq is served at Index
+    for (auto& read : PendingReads) {
+        if (read.Seq > message->Seq) {
+            break;
+        }
+        if (read.Seq > ReadConfirmed) {
+            read.Index = message->Index;
+        }
+    }
+    ReadConfirmed = message->Seq;
+}
+
+void TRaft::LearnerRead(ITimeSource::Time now, TMessageHolder<TCommandRequest> command, const std::shared_ptr<INode>& replyTo) {
+    if (!replyTo) {
+        return;
+    }
+    if (LeaderId && now < LeaderContact + StaleReadBound) {
+        // heard from the leader recently enough, serve what is applied
+        PendingReads.emplace_back(TPendingRead{0, VolatileState->LastApplied, std::move(command), replyTo});
+    } else if (LeaderId) {
+        PendingReads.emplace_back(TPendingRead{ReadSeq + 1, 0, std::move(command), replyTo});
+        ReadRoundWanted = true;
+    } else {
+        replyTo->Send(NewHoldedMessage(TLeaderHint {.LeaderId = 0}));
+    }
+}
+
+void TRaft::OnReadIndex(ITimeSource::Time now, TMessageHolder<TReadIndexRequest> message) {
+    if (message->Term == State->CurrentTerm) {
+        VolatileState->ElectionDue = MakeElection(now);
+        LeaderContact = now;
+        Become(EState::FOLLOWER);
+        SetLeader(message->Src);
+    }
+    // a smaller term is answered too, the stale leader steps down on it
+    SendDurable(message->Src, NewHoldedMessage(
+        TMessage {.Src = Id, .Dst = message->Src, .Term = State->CurrentTerm},
+        TReadIndexResponse {.Seq = message->Seq}));
+}
+
+void TRaft::OnReadIndex(TMessageHolder<TReadIndexResponse> message) {
+    auto peer = Ordinal(message->Src);
+    if (peer < 0 || message->Term != State->CurrentTerm) {
+        return;
+    }
+    auto& ack = VolatileState->Peers[peer].ReadAck;
+    ack = std::max(ack, message->Seq);
+
+    // the round a majority, the leader included, has answered
+    std::vector<uint64_t> acks{ReadSeq};
+    for (const auto& p : VolatileState->Peers) {
+        if (!p.Learner) {
+            acks.push_back(p.ReadAck);
+        }
     }
-    auto index = log.size();
+    std::sort(acks.begin(), acks.end(), std::greater<>());
+    ReadConfirmed = std::max(ReadConfirmed, acks[Nservers / 2]);
+
+    // followers reset their election timers after the round was sent
+    while (!ReadRounds.empty() && ReadRounds.begin()->first <= ReadConfirmed) {
+        LeaseUntil = std::max(LeaseUntil, ReadRounds.begin()->second + TTimeout::Election * 9 / 10);
+        ReadRounds.erase(ReadRounds.begin());
+    }
+}
+
+void TRaft::StartReadRound(ITimeSource::Time now) {
+    ReadSeq++;
+    ReadRoundWanted = false;
+    ReadRoundDue = now + TTimeout::Rpc;
+    ReadRounds.emplace(ReadSeq, now);
+    const auto& peers = VolatileState->Peers;
+    for (size_t i = 0; i < peers.size(); i++) {
+        if (!peers[i].Learner) {
+            PeerNodes[i]->Send(NewHoldedMessage(
+                TMessage {.Src = Id, .Dst = peers[i].Id, .Term = State->CurrentTerm},
+                TReadIndexRequest {.Seq = ReadSeq}));
+        }
+    }
+    if (Nservers == 1) {
+        ReadConfirmed = ReadSeq;
+        LeaseUntil = now + TTimeout::Election * 9 / 10;
+        ReadRounds.clear();
+    }
+}
+
+void TRaft::ProcessReads() {
+    while (!PendingReads.empty()) {
+        auto& read = PendingReads.front();
+        if (read.Seq > ReadConfirmed) {
+            break;
+        }
+        if (!read.Command) {
+            // a learner's request, it waits until it applied the index itself
+            read.ReplyTo->Send(NewHoldedMessage(
+                TMessage {.Src = Id, .Dst = read.LearnerId, .Term = State->CurrentTerm},
+                TLearnerReadResponse {.Seq = read.LearnerSeq, .Index = read.Index}));
+        } else if (Applier && read.Index <= ApplyQueued) {
+            // runs after the writes queued before it, answered by CollectApplied
+            Applier->Push({
+                .Kind = TApplier::TTask::ERead,
+                .Index = read.Index,
+                .Command = std::move(read.Command),
+                .ReplyTo = std::move(read.ReplyTo)});
+        } else if (!Applier && read.Index <= VolatileState->LastApplied) {
+            read.ReplyTo->Send(Rsm->Read(std::move(read.Command), read.Index));
+        } else {
+            break;
+        }
+        PendingReads.pop_front();
+    }
+    if (Applier) {
+        Applier->Flush();
+    }
+}
+
+void TRaft::OnForward(ITimeSource::Time now, TMessageHolder<TForwardRequest> message) {
+    auto peer = Ordinal(message->Src);
+    if (peer < 0 || message->Len < sizeof(TForwardRequest) + sizeof(TCommandRequest)) {
+        return;
+    }
+    auto len = message->Len - sizeof(TForwardRequest);
+    auto command = NewHoldedMessage<TCommandRequest>(len);
+    memcpy(command.Mes, message->Data, len);
+    auto replyTo = std::make_shared<TForwardNode>(
+        PeerNodes[peer],
+        TMessage {.Src = Id, .Dst = message->Src, .Term = State->CurrentTerm},
+        message->Seq);
+    OnCommandRequest(now, std::move(command), replyTo);
+}
+
+void TRaft::OnForward(TMessageHolder<TForwardResponse> message) {
+    auto it = Forwarded.find(message->Seq);
+    if (it == Forwarded.end() || message->Len < sizeof(TForwardResponse) + sizeof(TMessage)) {
+        return;
+    }
+    auto len = message->Len - sizeof(TForwardResponse);
+    TMessage header;
+    memcpy(&header, message->Data, sizeof(header));
+    auto response = NewHoldedMessage<TMessage>(header.Type, len);
+    memcpy(response.Mes, message->Data, len);
+    it->second->Send(std::move(response));
+    Forwarded.erase(it);
+}
+
+void TRaft::Forward(TMessageHolder<TCommandRequest> command, const std::shared_ptr<INode>& replyTo) {
+    auto leader = Ordinal(LeaderId);
+    if (leader < 0) {
+        if (replyTo) {
+            replyTo->Send(NewHoldedMessage(TLeaderHint {.LeaderId = LeaderId}));
+        }
+        return;
+    }
+    auto seq = ++ForwardSeq;
+    auto mes = NewHoldedMessage<TForwardRequest>(sizeof(TForwardRequest) + command->Len);
+    mes->Src = Id;
+    mes->Dst = LeaderId;
+    mes->Term = State->CurrentTerm;
+    mes->Seq = seq;
+    memcpy(mes->Data, command.Mes, command->Len);
     if (replyTo) {
-        waiting.emplace(TWaiting{index, std::move(command), replyTo});
+        Forwarded.emplace(seq, replyTo);
+    }
+    PeerNodes[leader]->Send(std::move(mes));
+}
+
+void TRaft::SetLeader(uint32_t leaderId) {
+    if (LeaderId == leaderId) {
+        return;
+    }
+    LeaderId = leaderId;
+    if (Learner && ReadSeq > ReadConfirmed) {
+        // ask the new leader instead
+        ReadRoundWanted = true;
+    }
+    // the old leader may or may not have appended them
+    for (auto& [_, replyTo] : Forwarded) {
+        replyTo->Send(NewHoldedMessage(TLeaderHint {.LeaderId = leaderId}));
     }
+    Forwarded.clear();
 }
 
 TMessageHolder<TRequestVoteRequest> TRaft::CreateVote(uint32_t nodeId) {
     auto mes = NewHoldedMessage(
         TMessage {.Src = Id, .Dst = nodeId, .Term = State->CurrentTerm},
         TRequestVoteRequest {
-            .LastLogIndex = State->Log.size(),
-            .LastLogTerm = State->Log.empty() ? 0 : State->Log.back()->Term,
+            .LastLogIndex = State->LogSize(),
+            .LastLogTerm = State->LogTerm(),
             .CandidateId = Id,
         });
     return mes;
 }
 
-TMessageHolder<TAppendEntriesRequest> TRaft::CreateAppendEntries(uint32_t nodeId) {
-    int batchSize = std::max(1, VolatileState->BatchSize[nodeId]);
-    auto prevIndex = VolatileState->NextIndex[nodeId] - 1;
-    auto lastIndex = std::min(prevIndex+batchSize, (uint64_t)State->Log.size());
-    if (VolatileState->MatchIndex[nodeId]+1 < VolatileState->NextIndex[nodeId]) {
+TMessageHolder<TAppendEntriesRequest> TRaft::CreateAppendEntries(ITimeSource::Time now, TPeerState& peer) {
+    int batchSize = std::max(1, peer.BatchSize);
+    auto prevIndex = peer.NextIndex - 1;
+    auto lastIndex = std::min(prevIndex+batchSize, State->LogSize());
+    if (!peer.Pipelined && peer.MatchIndex+1 < peer.NextIndex) {
         lastIndex = prevIndex;
     }
 
+    // entries up to the byte budget, one even if it is larger
+    auto budget = std::min(peer.BatchBytes, MaxBatchBytes);
+    uint64_t bytes = 0;
+    Batch.clear();
+    for (auto i = prevIndex; i < lastIndex; i++) {
+        auto entry = State->LogEntry(i+1);
+        if (!Batch.empty() && bytes + entry->Len > budget) {
+            break;
+        }
+        bytes += entry->Len;
+        Batch.emplace_back(std::move(entry));
+    }
+    lastIndex = prevIndex + Batch.size();
+
     auto mes = NewHoldedMessage(
-        TMessage {.Src = Id, .Dst = nodeId, .Term = State->CurrentTerm},
+        TMessage {.Src = Id, .Dst = peer.Id, .Term = State->CurrentTerm},
         TAppendEntriesRequest {
             .PrevLogIndex = prevIndex,
             .PrevLogTerm = State->LogTerm(prevIndex),
             .LeaderCommit = std::min(VolatileState->CommitIndex, lastIndex),
             .LeaderId = Id,
-            .Nentries = static_cast<uint32_t>(lastIndex - prevIndex),
+            .Nentries = static_cast<uint32_t>(Batch.size()),
         });
 
-    if (lastIndex - prevIndex > 0) {
-        mes.InitPayload(lastIndex - prevIndex);
-        uint32_t j = 0;
-        for (auto i = prevIndex; i < lastIndex; i++) {
-            mes.Payload[j++] = State->Log[i];
+    if (!Batch.empty()) {
+        mes.InitPayload(Batch.size());
+        for (uint32_t j = 0; j < Batch.size(); j++) {
+            mes.Payload[j] = std::move(Batch[j]);
+        }
+        Batch.clear();
+        peer.InFlight.emplace_back(lastIndex, now);
+        if (peer.Pipelined) {
+            // optimistic, rolled back if the follower rejects
+            peer.NextIndex = lastIndex+1;
         }
     }
     return mes;
 }
 
-void TRaft::Follower(ITimeSource::Time now, TMessageHolder<TMessage> message) {
+TMessageHolder<TInstallSnapshotRequest> TRaft::CreateInstallSnapshot(const TPeerState& peer) {
+    const auto& data = *Snapshot.Data;
+    auto offset = std::min<uint64_t>(peer.SnapshotOffset, data.size());
+    auto size = std::min<uint64_t>(SnapshotChunk, data.size() - offset);
+
+    auto mes = NewHoldedMessage<TInstallSnapshotRequest>(sizeof(TInstallSnapshotRequest) + size);
+    mes->Src = Id;
+    mes->Dst = peer.Id;
+    mes->Term = State->CurrentTerm;
+    mes->LastIncludedIndex = Snapshot.Index;
+    mes->LastIncludedTerm = Snapshot.Term;
+    mes->Offset = offset;
+    mes->LeaderId = Id;
+    mes->Done = offset + size == data.size();
+    memcpy(mes->Data, data.data() + offset, size);
+    return mes;
+}
+
+void TRaft::TakeSnapshot() {
+    if (Applier) {
+        // picked up by CollectApplied
+        if (!SnapshotQueued) {
+            SnapshotQueued = true;
+            Applier->Push({.Kind = TApplier::TTask::ESnapshot, .Index = ApplyQueued});
+        }
+        return;
+    }
+    auto index = VolatileState->LastApplied;
+    auto term = State->LogTerm(index);
+    auto data = std::make_shared<std::vector<char>>(Rsm->Snapshot());
+    if (State->Store) {
+        // durable before the segments it replaces go away
+        State->Store->SaveSnapshot(index, term, *data);
+    }
+    State->Compact(index, term);
+    Snapshot = TSnapshot{.Index = index, .Term = term, .Data = std::move(data)};
+    AppliedBytes = 0;
+}
+
+void TRaft::InstallSnapshot(uint64_t index, uint64_t term, std::vector<char> data) {
+    if (!Applier) {
+        Rsm->Restore(data, index);
+    }
+    if (State->LogTerm(index) != term) {
+        // the log ends before the snapshot or conflicts with it, none of it is kept
+        State->Truncate(State->SnapshotIndex);
+    }
+    auto snapshot = std::make_shared<std::vector<char>>(std::move(data));
+    if (State->Store) {
+        State->Store->SaveSnapshot(index, term, *snapshot);
+    }
+    State->Compact(index, term);
+    Snapshot = TSnapshot{.Index = index, .Term = term, .Data = snapshot};
+    AppliedBytes = 0;
+    VolatileState->CommitIndex = std::max(VolatileState->CommitIndex, index);
+    if (Applier) {
+        // queued behind the entries it replaces, LastApplied follows the applier
+        Applier->Push({.Kind = TApplier::TTask::ERestore, .Index = index, .Data = std::move(snapshot)});
+        Applier->Flush();
+        ApplyQueued = index;
+    } else {
+        VolatileState->LastApplied = index;
+    }
+}
+
+void TRaft::Follower(ITimeSource::Time now, TMessageHolder<TMessage> message, const std::shared_ptr<INode>& replyTo) {
     if (auto maybeRequestVote = message.Maybe<TRequestVoteRequest>()) {
         OnRequestVote(now, std::move(maybeRequestVote.Cast()));
     } else if (auto maybeAppendEntries = message.Maybe<TAppendEntriesRequest>()) {
         OnAppendEntries(now, std::move(maybeAppendEntries.Cast()));
+    } else if (auto maybeInstallSnapshot = message.Maybe<TInstallSnapshotRequest>()) {
+        OnInstallSnapshot(now, std::move(maybeInstallSnapshot.Cast()));
+    } else if (auto maybeReadIndex = message.Maybe<TReadIndexRequest>()) {
+        OnReadIndex(now, std::move(maybeReadIndex.Cast()));
+    } else if (auto maybeForward = message.Maybe<TForwardResponse>()) {
+        OnForward(std::move(maybeForward.Cast()));
+    } else if (auto maybeLearnerRead = message.Maybe<TLearnerReadResponse>()) {
+        OnLearnerRead(std::move(maybeLearnerRead.Cast()));
+    } else if (auto maybeCommandRequest = message.Maybe<TCommandRequest>()) {
+        auto command = maybeCommandRequest.Cast();
+        if (Learner && !(command->Flags & TCommandRequest::EWrite)) {
+            LearnerRead(now, std::move(command), replyTo);
+        } else {
+            Forward(std::move(command), replyTo);
+        }
     }
 }
 
-void TRaft::Candidate(ITimeSource::Time now, TMessageHolder<TMessage> message) {
+void TRaft::Candidate(ITimeSource::Time now, TMessageHolder<TMessage> message, const std::shared_ptr<INode>& replyTo) {
     if (auto maybeResponseVote = message.Maybe<TRequestVoteResponse>()) {
         OnRequestVote(std::move(maybeResponseVote.Cast()));
     } else if (auto maybeRequestVote = message.Maybe<TRequestVoteRequest>()) {
         OnRequestVote(now, std::move(maybeRequestVote.Cast()));
     } else if (auto maybeAppendEntries = message.Maybe<TAppendEntriesRequest>()) {
         OnAppendEntries(now, std::move(maybeAppendEntries.Cast()));
+    } else if (auto maybeInstallSnapshot = message.Maybe<TInstallSnapshotRequest>()) {
+        OnInstallSnapshot(now, std::move(maybeInstallSnapshot.Cast()));
+    } else if (auto maybeReadIndex = message.Maybe<TReadIndexRequest>()) {
+        OnReadIndex(now, std::move(maybeReadIndex.Cast()));
+    } else if (auto maybeCommandRequest = message.Maybe<TCommandRequest>()) {
+        Forward(std::move(maybeCommandRequest.Cast()), replyTo);
     }
 }
 
 void TRaft::Leader(ITimeSource::Time now, TMessageHolder<TMessage> message, const std::shared_ptr<INode>& replyTo) {
     if (auto maybeAppendEntries = message.Maybe<TAppendEntriesResponse>()) {
-        OnAppendEntries(std::move(maybeAppendEntries.Cast()));
+        OnAppendEntries(now, std::move(maybeAppendEntries.Cast()));
+    } else if (auto maybeConflict = message.Maybe<TAppendEntriesConflict>()) {
+        OnAppendEntries(std::move(maybeConflict.Cast()));
+    } else if (auto maybeInstallSnapshot = message.Maybe<TInstallSnapshotResponse>()) {
+        OnInstallSnapshot(std::move(maybeInstallSnapshot.Cast()));
+    } else if (auto maybeReadIndex = message.Maybe<TReadIndexResponse>()) {
+        OnReadIndex(std::move(maybeReadIndex.Cast()));
     } else if (auto maybeCommandRequest = message.Maybe<TCommandRequest>()) {
-        OnCommandRequest(std::move(maybeCommandRequest.Cast()), replyTo);
+        OnCommandRequest(now, std::move(maybeCommandRequest.Cast()), replyTo);
+    } else if (auto maybeForward = message.Maybe<TForwardRequest>()) {
+        OnForward(now, std::move(maybeForward.Cast()));
+    } else if (auto maybeLearnerRead = message.Maybe<TLearnerReadRequest>()) {
+        OnLearnerRead(now, std::move(maybeLearnerRead.Cast()));
     } else if (auto maybeVoteRequest = message.Maybe<TRequestVoteRequest>()) {
         OnRequestVote(now, std::move(maybeVoteRequest.Cast()));
     } else if (auto maybeAppendEntries = message.Maybe<TAppendEntriesRequest>()) {
@@ -349,6 +1067,35 @@ void TRaft::Leader(ITimeSource::Time now, TMessageHolder<TMessage> message, cons
     }
 }
 
+void TRaft::SendDurable(uint32_t nodeId, TMessageHolder<TMessage> message) {
+    auto peer = Ordinal(nodeId);
+    if (peer < 0) {
+        return;
+    }
+    if (State->Store) {
+        Deferred.emplace_back(PeerNodes[peer], std::move(message));
+    } else {
+        PeerNodes[peer]->Send(std::move(message));
+    }
+}
+
+bool TRaft::Sync() {
+    bool synced = false;
+    if (State->Store) {
+        State->Store->SetMeta({.Term = State->CurrentTerm, .VotedFor = State->VotedFor});
+        synced = State->Store->Sync();
+        if (StateName == EState::LEADER) {
+            // its own appends count from now on, applied on the next turn
+            VolatileState->CommitAdvance(Nservers, *State);
+        }
+    }
+    for (auto& [node, message] : Deferred) {
+        node->Send(std::move(message));
+    }
+    Deferred.clear();
+    return synced;
+}
+
 void TRaft::Become(EState newStateName) {
     if (StateName != newStateName) {
         StateName = newStateName;
@@ -356,12 +1103,19 @@ void TRaft::Become(EState newStateName) {
 }
 
 void TRaft::Process(ITimeSource::Time now, TMessageHolder<TMessage> message, const std::shared_ptr<INode>& replyTo) {
+    if (LeaseReads && StateName == EState::FOLLOWER && now < LeaderContact + TTimeout::Election
+        && message.Maybe<TRequestVoteRequest>())
+    {
+        // the leader may still be serving reads from its lease
+        return;
+    }
     if (message.IsEx()) {
         auto messageEx = message.Cast<TMessage>();
         if (messageEx->Term > State->CurrentTerm) {
             State->CurrentTerm = messageEx->Term;
             State->VotedFor = 0;
             StateName = EState::FOLLOWER;
+            SetLeader(0);
             if (VolatileState->ElectionDue <= now || VolatileState->ElectionDue == ITimeSource::Max) {
                 VolatileState->ElectionDue = MakeElection(now);
             }
@@ -369,10 +1123,10 @@ void TRaft::Process(ITimeSource::Time now, TMessageHolder<TMessage> message, con
     }
     switch (StateName) {
     case EState::FOLLOWER:
-        Follower(now, std::move(message));
+        Follower(now, std::move(message), replyTo);
         break;
     case EState::CANDIDATE:
-        Candidate(now, std::move(message));
+        Candidate(now, std::move(message), replyTo);
         break;
     case EState::LEADER:
         Leader(now, std::move(message), replyTo);
@@ -382,26 +1136,165 @@ void TRaft::Process(ITimeSource::Time now, TMessageHolder<TMessage> message, con
     }
 }
 
+void TRaft::AppendWrites() {
+    if (PendingWrites.empty()) {
+        return;
+    }
+    if (PendingWrites.size() == 1) {
+        State->Append(Rsm->Prepare(PendingWrites[0].Command, State->CurrentTerm));
+    } else {
+        std::vector<TMessageHolder<TCmdReq>> entries;
+        entries.reserve(PendingWrites.size());
+        uint32_t size = 0;
+        for (const auto& write : PendingWrites) {
+            entries.emplace_back(Rsm->Prepare(write.Command, State->CurrentTerm));
+            size += (entries.back()->Len + TCmdBatch::Align - 1) / TCmdBatch::Align * TCmdBatch::Align;
+        }
+        auto batch = NewHoldedMessage<TCmdBatch>(sizeof(TCmdBatch) + size);
+        batch->Term = State->CurrentTerm;
+        batch->Count = entries.size();
+        uint32_t offset = 0;
+        for (const auto& entry : entries) {
+            memcpy(batch->Data + offset, entry.Mes, entry->Len);
+            offset += (entry->Len + TCmdBatch::Align - 1) / TCmdBatch::Align * TCmdBatch::Align;
+        }
+        State->Append(TMessageHolder<TMessage>(batch).Cast<TCmdReq>());
+    }
+    // all of them are acknowledged once the entry is applied
+    auto index = State->LogSize();
+    for (auto& write : PendingWrites) {
+        if (write.ReplyTo) {
+            waiting.emplace(TWaiting{index, std::move(write.Command), std::move(write.ReplyTo)});
+        }
+    }
+    PendingWrites.clear();
+}
+
 void TRaft::ProcessCommitted() {
+    auto applied = VolatileState->CommitIndex;
+    if (Applier) {
+        QueueCommitted();
+        applied = ApplyQueued;
+    } else {
+        for (auto i = VolatileState->LastApplied+1; i <= applied; i++) {
+            auto entry = State->LogEntry(i);
+            AppliedBytes += entry->Len;
+            Rsm->Write(std::move(entry), i);
+        }
+        VolatileState->LastApplied = applied;
+    }
+    // waiting until as many bytes were applied as the last snapshot took
+    // keeps the cost of snapshots linear in the applied bytes
+    auto snapshotBytes = Snapshot.Data ? Snapshot.Data->size() : 0;
+    if (applied - State->SnapshotIndex >= CompactThreshold && AppliedBytes >= snapshotBytes) {
+        TakeSnapshot();
+    }
+}
+
+void TRaft::QueueCommitted() {
     auto commitIndex = VolatileState->CommitIndex;
-    for (auto i = VolatileState->LastApplied+1; i <= commitIndex; i++) {
-        Rsm->Write(State->Log[i-1], i);
+    // a backlog means the applier is behind, the log keeps the rest
+    for (auto i = ApplyQueued+1; i <= commitIndex && !Applier->Busy(); i++) {
+        auto entry = State->LogEntry(i);
+        AppliedBytes += entry->Len;
+        Applier->Push({.Kind = TApplier::TTask::EWrite, .Index = i, .Entry = std::move(entry)});
+        ApplyQueued = i;
+    }
+}
+
+void TRaft::CollectApplied() {
+    VolatileState->LastApplied = std::max(VolatileState->LastApplied, Applier->Applied());
+    TApplier::TTask task;
+    while (Applier->Pop(task)) {
+        if (task.Kind == TApplier::TTask::ERead) {
+            task.ReplyTo->Send(std::move(task.Response));
+        } else if (task.Kind == TApplier::TTask::ESnapshot) {
+            SnapshotQueued = false;
+            if (task.Index > State->SnapshotIndex) {
+                auto term = State->LogTerm(task.Index);
+                if (State->Store) {
+                    // durable before the segments it replaces go away
+                    State->Store->SaveSnapshot(task.Index, term, *task.Data);
+                }
+                State->Compact(task.Index, term);
+                Snapshot = TSnapshot{.Index = task.Index, .Term = term, .Data = std::move(task.Data)};
+                AppliedBytes = 0;
+            } else if (!Snapshot.Data && task.Index == State->SnapshotIndex) {
+                // taken to stream the stored snapshot to a follower
+                Snapshot = TSnapshot{.Index = task.Index, .Term = State->SnapshotTerm, .Data = std::move(task.Data)};
+            }
+        }
     }
-    VolatileState->LastApplied = commitIndex;
 }
 
 void TRaft::ProcessWaiting() {
     auto lastApplied = VolatileState->LastApplied;
     while (!waiting.empty() && waiting.top().Index <= lastApplied) {
         auto w = waiting.top(); waiting.pop();
-        TMessageHolder<TMessage> reply;
-        if (w.Command->Flags & TCommandRequest::EWrite) {
-            reply = NewHoldedMessage(TCommandResponse {.Index = w.Index});
-        } else {
-            reply = Rsm->Read(std::move(w.Command), w.Index);
+        w.ReplyTo->Send(NewHoldedMessage(TCommandResponse {.Index = w.Index}));
+    }
+}
+
+void TRaft::HintPending() {
+    auto hint = [&](const std::shared_ptr<INode>& replyTo) {
+        if (replyTo) {
+            replyTo->Send(NewHoldedMessage(TLeaderHint {.LeaderId = LeaderId}));
+        }
+    };
+    // not appended yet, the clients retry with the new leader
+    for (auto& write : PendingWrites) {
+        hint(write.ReplyTo);
+    }
+    PendingWrites.clear();
+    // appended, but a new leader may overwrite them: the outcome is unknown
+    for (; !waiting.empty(); waiting.pop()) {
+        hint(waiting.top().ReplyTo);
+    }
+    if (Learner) {
+        // its reads wait for the leader, whoever it is
+        return;
+    }
+    for (auto& read : PendingReads) {
+        // a learner's request is asked again once it times out
+        if (read.Command) {
+            hint(read.ReplyTo);
         }
-        w.ReplyTo->Send(std::move(reply));
     }
+    PendingReads.clear();
+    ReadRounds.clear();
+    ReadRoundWanted = false;
+    LeaseUntil = {};
+}
+
+void TRaft::LearnerTimeout(ITimeSource::Time now) {
+    if (ReadSeq > ReadConfirmed && ReadRoundDue <= now) {
+        // no answer in time, ask again
+        ReadRoundWanted = true;
+    }
+    auto leader = Ordinal(LeaderId);
+    if (leader < 0 && (ReadRoundWanted || ReadSeq > ReadConfirmed)) {
+        // nobody to ask, refused as LearnerRead refuses new reads
+        std::erase_if(PendingReads, [&](const TPendingRead& read) {
+            if (read.Seq <= ReadConfirmed) {
+                return false;
+            }
+            read.ReplyTo->Send(NewHoldedMessage(TLeaderHint {.LeaderId = 0}));
+            return true;
+        });
+        ReadConfirmed = ReadSeq;
+        ReadRoundWanted = false;
+    }
+    if (ReadRoundWanted && leader >= 0) {
+        // one request for all the reads of this turn
+        ReadSeq++;
+        ReadRoundWanted = false;
+        ReadRoundDue = now + TTimeout::Rpc;
+        PeerNodes[leader]->Send(NewHoldedMessage(
+            TMessage {.Src = Id, .Dst = LeaderId, .Term = State->CurrentTerm},
+            TLearnerReadRequest {.Seq = ReadSeq}));
+    }
+    ProcessCommitted();
+    ProcessReads();
 }
 
 void TRaft::FollowerTimeout(ITimeSource::Time now) {
@@ -411,23 +1304,50 @@ void TRaft::FollowerTimeout(ITimeSource::Time now) {
 }
 
 void TRaft::CandidateTimeout(ITimeSource::Time now) {
-    for (auto& [id, node] : Nodes) {
-        if (VolatileState->RpcDue[id] <= now) {
-            VolatileState->RpcDue[id] = now + TTimeout::Rpc;
-            node->Send(CreateVote(id));
+    for (auto& peer : VolatileState->Peers) {
+        if (!peer.Learner && peer.RpcDue <= now) {
+            peer.RpcDue = now + TTimeout::Rpc;
+            SendDurable(peer.Id, CreateVote(peer.Id));
         }
     }
 }
 
 void TRaft::LeaderTimeout(ITimeSource::Time now) {
-    for (auto& [id, node] : Nodes) {
-        if (VolatileState->HeartbeatDue[id] <= now
-            || (VolatileState->NextIndex[id] <= State->Log.size() &&
-            VolatileState->RpcDue[id] <= now))
+    AppendWrites();
+    auto logSize = State->LogSize();
+    auto& peers = VolatileState->Peers;
+    for (size_t i = 0; i < peers.size(); i++) {
+        auto& peer = peers[i];
+        if (peer.RpcDue <= now) {
+            // nothing acknowledged for a whole rpc timeout, resend the window
+            peer.InFlight.clear();
+            if (peer.Pipelined) {
+                peer.NextIndex = peer.MatchIndex+1;
+            }
+        }
+        if (peer.HeartbeatDue <= now
+            || (peer.NextIndex <= logSize && peer.RpcDue <= now)
+            || WindowOpen(peer))
         {
-            VolatileState->HeartbeatDue[id] = now + TTimeout::Election / 2;
-            VolatileState->RpcDue[id] = now + TTimeout::Rpc;
-            node->Send(CreateAppendEntries(id));
+            auto& node = PeerNodes[i];
+            do {
+                peer.HeartbeatDue = now + TTimeout::Election / 2;
+                peer.RpcDue = now + TTimeout::Rpc;
+                if (peer.NextIndex <= State->SnapshotIndex) {
+                    // the entries it needs are compacted away
+                    if (!Snapshot.Data) {
+                        // restarted from a stored snapshot, or compacted nothing yet
+                        TakeSnapshot();
+                    }
+                    if (!Snapshot.Data) {
+                        // the applier is taking it, retried on RpcDue
+                        break;
+                    }
+                    node->Send(CreateInstallSnapshot(peer));
+                } else {
+                    node->Send(CreateAppendEntries(now, peer));
+                }
+            } while (WindowOpen(peer));
         }
     }
 
@@ -435,53 +1355,88 @@ void TRaft::LeaderTimeout(ITimeSource::Time now) {
         VolatileState->CommitAdvance(Nservers, *State);
     }
 
+    if (ReadSeq > ReadConfirmed && ReadRoundDue <= now) {
+        // the last round got no majority in time
+        ReadRoundWanted = true;
+    }
+    if (ReadRoundWanted) {
+        // one round for all the reads of this turn
+        StartReadRound(now);
+    }
+
     ProcessCommitted();
     ProcessWaiting();
+    ProcessReads();
 }
 
 void TRaft::ProcessTimeout(ITimeSource::Time now) {
-    if (StateName == EState::CANDIDATE || StateName == EState::FOLLOWER) {
+    if (Applier) {
+        CollectApplied();
+    }
+    if (!Learner && (StateName == EState::CANDIDATE || StateName == EState::FOLLOWER)) {
         if (VolatileState->ElectionDue <= now) {
             auto nextVolatileState = std::make_unique<TVolatileState>();
-            for (auto [id, _] : Nodes) {
-                nextVolatileState->NextIndex[id] = 1;
-            }
+            nextVolatileState->Peers = MakePeers(1);
             nextVolatileState->ElectionDue = MakeElection(now);
             nextVolatileState->CommitIndex = VolatileState->CommitIndex;
             VolatileState = std::move(nextVolatileState);
             State->VotedFor = Id;
             State->CurrentTerm ++;
             Become(EState::CANDIDATE);
+            SetLeader(0);
         }
     }
 
     if (StateName == EState::CANDIDATE) {
         int nvotes = VolatileState->Votes.size()+1;
         if (nvotes >= MinVotes) {
-            auto value = State->Log.size()+1;
-            decltype(VolatileState->NextIndex) nextIndex;
-            decltype(VolatileState->RpcDue) rpcDue;
-            for (auto [id, _] : Nodes) {
-                nextIndex.emplace(id, value);
-                rpcDue.emplace(id, ITimeSource::Max);
+            auto peers = MakePeers(State->LogSize()+1);
+            for (auto& peer : peers) {
+                peer.RpcDue = ITimeSource::Max;
             }
 
             auto nextVolatileState = std::make_unique<TVolatileState>(TVolatileState {
                 .CommitIndex = VolatileState->CommitIndex,
                 .LastApplied = VolatileState->LastApplied,
-                .NextIndex = nextIndex,
-                .RpcDue = rpcDue,
+                .Peers = std::move(peers),
                 .ElectionDue = ITimeSource::Max,
             });
 
             VolatileState = std::move(nextVolatileState);
             StateName = EState::LEADER;
+            SetLeader(Id);
+
+            // an entry of the new term, entries of earlier terms and reads
+            // commit with it instead of waiting for a client write
+            auto noop = NewHoldedMessage<TCmdBatch>(sizeof(TCmdBatch));
+            noop->Term = State->CurrentTerm;
+            noop->Count = 0;
+            State->Append(TMessageHolder<TMessage>(noop).Cast<TCmdReq>());
+
+            // nothing confirmed in an earlier term holds now
+            LeaseUntil = {};
+            ReadRounds.clear();
+            ReadConfirmed = ReadSeq;
+            for (auto& read : PendingReads) {
+                read.Seq = ReadSeq + 1;
+                read.Index = std::max(read.Index, State->LogSize());
+                ReadRoundWanted = true;
+            }
         }
     }
 
+    if (StateName != EState::LEADER) {
+        HintPending();
+    }
+
     switch (StateName) {
     case EState::FOLLOWER:
-        FollowerTimeout(now); break;
+        if (Learner) {
+            LearnerTimeout(now);
+        } else {
+            FollowerTimeout(now);
+        }
+        break;
     case EState::CANDIDATE:
         CandidateTimeout(now); break;
     case EState::LEADER:
@@ -491,6 +1446,72 @@ void TRaft::ProcessTimeout(ITimeSource::Time now) {
     }
 }
 
+ITimeSource::Time TRaft::NextTimeout() const {
+    auto due = ITimeSource::Max;
+    switch (StateName) {
+    case EState::FOLLOWER:
+        if (!Learner) {
+            due = VolatileState->ElectionDue;
+            break;
+        }
+        // never campaigns, wakes up for its reads and to apply; without a
+        // leader a read round waits for the next AppendEntries
+        if ((ReadRoundWanted && Ordinal(LeaderId) >= 0) || ApplyPending()) {
+            due = ITimeSource::Time{};
+        } else if (ReadSeq > ReadConfirmed) {
+            due = ReadRoundDue;
+        }
+        if (!PendingReads.empty() && PendingReads.front().Seq <= ReadConfirmed
+            && PendingReads.front().Index <= (Applier ? ApplyQueued : VolatileState->LastApplied))
+        {
+            due = ITimeSource::Time{};
+        }
+        break;
+    case EState::CANDIDATE:
+        due = VolatileState->ElectionDue;
+        for (const auto& peer : VolatileState->Peers) {
+            due = std::min(due, peer.RpcDue);
+        }
+        break;
+    case EState::LEADER:
+        for (const auto& peer : VolatileState->Peers) {
+            due = std::min(due, peer.HeartbeatDue);
+            if (peer.NextIndex <= State->LogSize()) {
+                due = std::min(due, peer.RpcDue);
+            }
+            if (WindowOpen(peer)) {
+                due = ITimeSource::Time{};
+            }
+        }
+        if (ReadRoundWanted || !PendingWrites.empty() || ApplyPending()) {
+            due = ITimeSource::Time{};
+        } else if (ReadSeq > ReadConfirmed) {
+            due = std::min(due, ReadRoundDue);
+        }
+        break;
+    default:
+        break;
+    }
+    return due;
+}
+
+bool TRaft::ApplyPending() const {
+    if (Applier) {
+        return VolatileState->CommitIndex > ApplyQueued && !Applier->Busy();
+    }
+    return VolatileState->CommitIndex > VolatileState->LastApplied;
+}
+
+// a matching follower takes up to MaxInFlight batches before acknowledging
+bool TRaft::WindowOpen(const TPeerState& peer) const {
+    if (!peer.Pipelined) {
+        return false;
+    }
+    return peer.NextIndex > State->SnapshotIndex
+        && peer.NextIndex <= State->LogSize()
+        && peer.InFlight.size() < static_cast<size_t>(MaxInFlight);
+}
+
 ITimeSource::Time TRaft::MakeElection(ITimeSource::Time now) {
     uint64_t delta = (uint64_t)((1.0 + (double)rand_(&Seed) / (double)UINT_MAX) * TTimeout::Election.count());
     return now + std::chrono::milliseconds(delta);
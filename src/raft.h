@@ -1,5 +1,8 @@
 #pragma once
 
+#include <algorithm>
+#include <deque>
+#include <map>
 #include <memory>
 #include <queue>
 #include <string>
@@ -16,69 +19,148 @@ struct INode {
     virtual void Drain() = 0;
 };
 
+class TApplier;
+
 // CommandRequest -> Write? -> LogEntry -> Append -> Committed As Index -> Applied As Index (Same) -> Index -> CommandResponse
 // CommandRequest -> Read? -> CurrentIndex (fixate) >= CommittedIndex -> CommandResponse
+// With a TApplier, Read, Write, Snapshot and Restore run on its thread while
+// Prepare stays on the raft loop, see Prepare
 struct IRsm {
     virtual ~IRsm() = default;
     virtual TMessageHolder<TMessage> Read(TMessageHolder<TCommandRequest> message, uint64_t index) = 0;
+    // the entry may be a batch of several commands, see ForEachCommand
     virtual void Write(TMessageHolder<TCmdReq> message, uint64_t index) = 0;
-    virtual TMessageHolder<TCmdReq> Prepare(TMessageHolder<TCommandRequest> message, uint64_t term) = 0;
+    // turns a client write into a log entry. With a TApplier it runs
+    // concurrently with the other calls, so it must be safe against them:
+    // const, and not reading what Write or Restore change
+    virtual TMessageHolder<TCmdReq> Prepare(TMessageHolder<TCommandRequest> message, uint64_t term) const = 0;
+    // state as of the last written index, lets the log before it be dropped
+    virtual std::vector<char> Snapshot() = 0;
+    // replaces the state with a snapshot taken at index
+    virtual void Restore(const std::vector<char>& snapshot, uint64_t index) = 0;
 };
 
 struct TDummyRsm: public IRsm {
     TMessageHolder<TMessage> Read(TMessageHolder<TCommandRequest> message, uint64_t index) override;
     void Write(TMessageHolder<TCmdReq> message, uint64_t index) override;
-    TMessageHolder<TCmdReq> Prepare(TMessageHolder<TCommandRequest> message, uint64_t term) override;
+    TMessageHolder<TCmdReq> Prepare(TMessageHolder<TCommandRequest> message, uint64_t term) const override;
+    std::vector<char> Snapshot() override;
+    void Restore(const std::vector<char>& snapshot, uint64_t index) override;
 
 private:
-    uint64_t LastAppliedIndex;
+    uint64_t LastAppliedIndex = 0;
     std::vector<TMessageHolder<TCmdReq>> Log;
 };
 
+// calls f for each command of a log entry: the entry itself, or the entries
+// packed into a TCmdBatch, which share its buffer
+template<typename F>
+void ForEachCommand(const TMessageHolder<TCmdReq>& entry, F&& f) {
+    if (entry->Type != static_cast<uint32_t>(EMessageType::LOG_BATCH)) {
+        f(entry);
+        return;
+    }
+    auto batch = TMessageHolder<TMessage>(entry).Cast<TCmdBatch>();
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < batch->Count; i++) {
+        auto* command = reinterpret_cast<TCmdReq*>(batch->Data + offset);
+        offset += (command->Len + TCmdBatch::Align - 1) / TCmdBatch::Align * TCmdBatch::Align;
+        f(TMessageHolder<TCmdReq>(command, batch.RawData));
+    }
+}
+
 using TNodeDict = std::unordered_map<uint32_t, std::shared_ptr<INode>>;
 
+class TSegmentedLog;
+
 struct TState {
     uint64_t CurrentTerm = 1;
     uint32_t VotedFor = 0;
+    // in-memory log, used while no Store is attached
     std::vector<TMessageHolder<TCmdReq>> Log;
+    // on-disk log, replaces Log when set
+    std::shared_ptr<TSegmentedLog> Store;
+    // last entry covered by the snapshot, Log holds the entries after it
+    uint64_t SnapshotIndex = 0;
+    uint64_t SnapshotTerm = 0;
 
-    uint64_t LogTerm(int64_t index = -1) const {
-        if (index < 0) {
-            index = Log.size();
-        }
-        if (index < 1 || index > Log.size()) {
-            return 0;
-        } else {
-            return Log[index-1]->Term;
-        }
-    }
+    uint64_t LogSize() const;
+    // entries that survive a crash, LogSize() without a Store
+    uint64_t DurableSize() const;
+    // 1-based
+    TMessageHolder<TCmdReq> LogEntry(uint64_t index) const;
+    void Append(TMessageHolder<TCmdReq> entry);
+    // keeps the first size entries
+    void Truncate(uint64_t size);
+    // drops the entries up to index, now covered by a snapshot
+    void Compact(uint64_t index, uint64_t term);
+
+    uint64_t LogTerm(int64_t index = -1) const;
+    // terms never decrease along the log, both are binary searches
+    // first index holding the term of the entry at index
+    uint64_t TermStart(uint64_t index) const;
+    // last index holding term, 0 if there is none
+    uint64_t TermEnd(uint64_t term) const;
+};
+
+// replication state of one peer, TVolatileState keeps them in one array
+// so the leader loop touches a single cache line per peer
+struct TPeerState {
+    uint32_t Id = 0;
+    uint64_t NextIndex = 1;
+    uint64_t MatchIndex = 0;
+    ITimeSource::Time HeartbeatDue;
+    ITimeSource::Time RpcDue;
+    // entries per batch, 1 while probing for the match
+    int BatchSize = 0;
+    // entry bytes per batch, adapted to how fast batches are acknowledged
+    uint64_t BatchBytes = 0;
+    int BackOff = 0;
+    // known to match, NextIndex runs ahead of MatchIndex
+    bool Pipelined = false;
+    // snapshot bytes it acknowledged
+    uint64_t SnapshotOffset = 0;
+    // latest read round it answered
+    uint64_t ReadAck = 0;
+    // replicated to, but not counted in elections, commits or read rounds
+    bool Learner = false;
+    // position in TVolatileState::ByMatch
+    uint32_t Rank = 0;
+    // unacknowledged batches: last index and send time
+    std::deque<std::pair<uint64_t, ITimeSource::Time>> InFlight;
 };
 
 struct TVolatileState {
     uint64_t CommitIndex = 0;
     uint64_t LastApplied = 0;
-    std::unordered_map<uint32_t, uint64_t> NextIndex;
-    std::unordered_map<uint32_t, uint64_t> MatchIndex;
+    // indexed by peer ordinal, see TRaft::Ordinal
+    std::vector<TPeerState> Peers;
     std::unordered_set<uint32_t> Votes;
-    std::unordered_map<uint32_t, ITimeSource::Time> HeartbeatDue;
-    std::unordered_map<uint32_t, ITimeSource::Time> RpcDue;
-    std::unordered_map<uint32_t, int> BatchSize;
-    std::unordered_map<uint32_t, int> BackOff;
     ITimeSource::Time ElectionDue;
 
-    std::vector<uint64_t> Indices;
+    // voting peer ordinals by MatchIndex, largest first. SetMatchIndex moves
+    // a peer only past the peers it overtakes, so the index a quorum holds
+    // is read off without sorting. Rebuilt when Peers changed size
+    std::vector<uint32_t> ByMatch;
+    size_t Ranked = 0; // Peers.size() when ByMatch was built
 
     TVolatileState& Vote(uint32_t id);
     TVolatileState& SetLastApplied(int index);
     TVolatileState& CommitAdvance(int nservers, const TState& state);
     TVolatileState& SetCommitIndex(int index);
     TVolatileState& SetElectionDue(ITimeSource::Time);
-    TVolatileState& SetNextIndex(uint32_t id, uint64_t nextIndex);
-    TVolatileState& SetMatchIndex(uint32_t id, uint64_t matchIndex);
-    TVolatileState& SetHearbeatDue(uint32_t id, ITimeSource::Time heartbeatDue);
-    TVolatileState& SetRpcDue(uint32_t id, ITimeSource::Time rpcDue);
-    TVolatileState& SetBatchSize(uint32_t id, int size);
-    TVolatileState& SetBackOff(uint32_t id, int size);
+    // the per-peer setters take the peer ordinal
+    TVolatileState& SetNextIndex(size_t peer, uint64_t nextIndex);
+    TVolatileState& SetMatchIndex(size_t peer, uint64_t matchIndex);
+    TVolatileState& SetHearbeatDue(size_t peer, ITimeSource::Time heartbeatDue);
+    TVolatileState& SetRpcDue(size_t peer, ITimeSource::Time rpcDue);
+    TVolatileState& SetBatchSize(size_t peer, int size);
+    TVolatileState& SetBackOff(size_t peer, int size);
+    TVolatileState& SetSnapshotOffset(size_t peer, uint64_t offset);
+    TVolatileState& SetPipelined(size_t peer, bool pipelined);
+
+private:
+    void RankPeers();
 };
 
 enum class EState: int {
@@ -90,10 +172,29 @@ enum class EState: int {
 
 class TRaft {
 public:
-    TRaft(std::shared_ptr<IRsm> rsm, int node, const TNodeDict& nodes);
+    static constexpr uint64_t DefaultCompactThreshold = 65536;
+    static constexpr uint64_t SnapshotChunk = 1024 * 1024;
+    static constexpr int DefaultMaxInFlight = 8;
+    static constexpr int DefaultMaxBatchEntries = 1024;
+    static constexpr uint64_t DefaultMaxBatchBytes = 8 * 1024 * 1024;
+    static constexpr uint64_t MinBatchBytes = 64 * 1024;
+    static constexpr std::chrono::milliseconds DefaultBatchLatency{50};
+
+    // learners, possibly node itself, get the log but do not vote; quorums
+    // are majorities of the other servers
+    TRaft(std::shared_ptr<IRsm> rsm, int node, const TNodeDict& nodes,
+        const std::unordered_set<uint32_t>& learners = {});
 
     void Process(ITimeSource::Time now, TMessageHolder<TMessage> message, const std::shared_ptr<INode>& replyTo = {});
     void ProcessTimeout(ITimeSource::Time now);
+    // earliest time ProcessTimeout has work to do
+    ITimeSource::Time NextTimeout() const;
+    // persists term, vote and log to the Store, then releases the replies
+    // that promised them and counts the leader's own entries toward commit.
+    // The server calls it once per loop turn after handing the appends to
+    // the peers, so the fsync overlaps replication. Returns true if an
+    // fsync was issued
+    bool Sync();
 
 // ut
     EState CurrentStateName() const {
@@ -106,8 +207,52 @@ public:
         return State.get();
     }
 
-    void SetState(const TState& state) {
-        *State = state;
+    // the state machine must already hold state.SnapshotIndex
+    void SetState(const TState& state);
+
+    // applied entries kept before the log is compacted into a snapshot
+    void SetCompactThreshold(uint64_t entries) {
+        CompactThreshold = entries;
+    }
+
+    // unacknowledged batches a matching follower may have
+    void SetMaxInFlight(int batches) {
+        MaxInFlight = std::max(1, batches);
+    }
+
+    // a batch takes at most this many entries and bytes, at least one entry
+    void SetMaxBatch(int entries, uint64_t bytes) {
+        MaxBatchEntries = std::max(1, entries);
+        MaxBatchBytes = std::max<uint64_t>(1, bytes);
+    }
+
+    // a follower's byte budget doubles while its batches are acknowledged
+    // within half of this and halves when they take longer
+    void SetBatchLatency(std::chrono::milliseconds latency) {
+        BatchLatency = latency;
+    }
+
+    // serve reads without a round while a majority recently confirmed the
+    // leader; relies on bounded clock drift and makes followers ignore vote
+    // requests while they hear from a leader. Must match across the cluster
+    void SetLeaseReads(bool leaseReads) {
+        LeaseReads = leaseReads;
+    }
+
+    // applies committed entries on the applier's thread instead of inline;
+    // the caller runs ProcessTimeout when applier->Event() fires
+    void SetApplier(std::shared_ptr<TApplier> applier) {
+        Applier = std::move(applier);
+    }
+
+    // a learner answers reads applied no longer than this after it last
+    // heard from the leader without asking the leader; 0 asks every time
+    void SetStaleReads(std::chrono::milliseconds bound) {
+        StaleReadBound = bound;
+    }
+
+    bool IsLearner() const {
+        return Learner;
     }
 
     const TVolatileState* GetVolatileState() const {
@@ -130,30 +275,85 @@ public:
         return Nservers;
     }
 
+    // 0 while no leader is known
+    uint32_t GetLeaderId() const {
+        return LeaderId;
+    }
+
+    // position of a peer in TVolatileState::Peers, -1 for unknown ids
+    int Ordinal(uint32_t id) const {
+        auto it = std::lower_bound(PeerIds.begin(), PeerIds.end(), id);
+        return it != PeerIds.end() && *it == id ? it - PeerIds.begin() : -1;
+    }
+
 private:
-    void Candidate(ITimeSource::Time now, TMessageHolder<TMessage> message);
-    void Follower(ITimeSource::Time now, TMessageHolder<TMessage> message);
+    void Candidate(ITimeSource::Time now, TMessageHolder<TMessage> message, const std::shared_ptr<INode>& replyTo);
+    void Follower(ITimeSource::Time now, TMessageHolder<TMessage> message, const std::shared_ptr<INode>& replyTo);
     void Leader(ITimeSource::Time now, TMessageHolder<TMessage> message, const std::shared_ptr<INode>& replyTo);
 
     void OnRequestVote(ITimeSource::Time now, TMessageHolder<TRequestVoteRequest> message);
     void OnRequestVote(TMessageHolder<TRequestVoteResponse> message);
     void OnAppendEntries(ITimeSource::Time now, TMessageHolder<TAppendEntriesRequest> message);
-    void OnAppendEntries(TMessageHolder<TAppendEntriesResponse> message);
-    void OnCommandRequest(TMessageHolder<TCommandRequest> message, const std::shared_ptr<INode>& replyTo);
+    void OnAppendEntries(ITimeSource::Time now, TMessageHolder<TAppendEntriesResponse> message);
+    void OnAppendEntries(TMessageHolder<TAppendEntriesConflict> message);
+    void OnCommandRequest(ITimeSource::Time now, TMessageHolder<TCommandRequest> message, const std::shared_ptr<INode>& replyTo);
+    void OnReadIndex(ITimeSource::Time now, TMessageHolder<TReadIndexRequest> message);
+    void OnReadIndex(TMessageHolder<TReadIndexResponse> message);
+    void OnInstallSnapshot(ITimeSource::Time now, TMessageHolder<TInstallSnapshotRequest> message);
+    void OnInstallSnapshot(TMessageHolder<TInstallSnapshotResponse> message);
+    void OnLearnerRead(ITimeSource::Time now, TMessageHolder<TLearnerReadRequest> message);
+    void OnLearnerRead(TMessageHolder<TLearnerReadResponse> message);
+    // serves a read on a learner, from its own state machine
+    void LearnerRead(ITimeSource::Time now, TMessageHolder<TCommandRequest> command, const std::shared_ptr<INode>& replyTo);
+    void LearnerTimeout(ITimeSource::Time now);
+    void OnForward(ITimeSource::Time now, TMessageHolder<TForwardRequest> message);
+    void OnForward(TMessageHolder<TForwardResponse> message);
+    // relays a client command to the leader, or answers with a TLeaderHint
+    void Forward(TMessageHolder<TCommandRequest> command, const std::shared_ptr<INode>& replyTo);
+    // hints the clients of commands still relayed to an older leader
+    void SetLeader(uint32_t leaderId);
 
     void LeaderTimeout(ITimeSource::Time now);
     void CandidateTimeout(ITimeSource::Time now);
     void FollowerTimeout(ITimeSource::Time now);
 
     TMessageHolder<TRequestVoteRequest> CreateVote(uint32_t nodeId);
-    TMessageHolder<TAppendEntriesRequest> CreateAppendEntries(uint32_t nodeId);
+    TMessageHolder<TAppendEntriesRequest> CreateAppendEntries(ITimeSource::Time now, TPeerState& peer);
+    TMessageHolder<TInstallSnapshotRequest> CreateInstallSnapshot(const TPeerState& peer);
+    void TakeSnapshot();
+    void InstallSnapshot(uint64_t index, uint64_t term, std::vector<char> data);
+    // appends the writes of this loop turn, several as one batch entry
+    void AppendWrites();
     void ProcessCommitted();
+    // committed entries are waiting for ProcessCommitted
+    bool ApplyPending() const;
+    // hands newly committed entries to the Applier
+    void QueueCommitted();
+    // applied index, read responses and snapshots back from the Applier
+    void CollectApplied();
     void ProcessWaiting();
+    void ProcessReads();
+    void StartReadRound(ITimeSource::Time now);
+    // not the leader (any more): hints the clients of unanswered writes and reads
+    void HintPending();
     ITimeSource::Time MakeElection(ITimeSource::Time now);
+    bool WindowOpen(const TPeerState& peer) const;
+    // sends once the state is durable, immediately when there is no Store
+    void SendDurable(uint32_t nodeId, TMessageHolder<TMessage> message);
+    std::vector<TPeerState> MakePeers(uint64_t nextIndex) const;
 
     std::shared_ptr<IRsm> Rsm;
+    std::shared_ptr<TApplier> Applier;
+    // last entry handed to the Applier
+    uint64_t ApplyQueued = 0;
+    bool SnapshotQueued = false;
     uint32_t Id;
     TNodeDict Nodes;
+    std::unordered_set<uint32_t> Learners;
+    bool Learner;
+    // peers by ordinal, ordered by id, and their sorted ids
+    std::vector<std::shared_ptr<INode>> PeerNodes;
+    std::vector<uint32_t> PeerIds;
     int MinVotes;
     int Npeers;
     int Nservers;
@@ -170,6 +370,65 @@ private:
     };
     std::priority_queue<TWaiting> waiting;
 
+    struct TPendingWrite {
+        TMessageHolder<TCommandRequest> Command;
+        std::shared_ptr<INode> ReplyTo;
+    };
+    std::vector<TPendingWrite> PendingWrites;
+
+    // ReadIndex: a read is served once the round numbered Seq confirmed the
+    // leadership and the commit index it saw is applied. A learner numbers
+    // its requests to the leader the same way
+    struct TPendingRead {
+        uint64_t Seq;
+        uint64_t Index;
+        TMessageHolder<TCommandRequest> Command;
+        std::shared_ptr<INode> ReplyTo;
+        // without a Command: a learner's request, answered with the index
+        uint32_t LearnerId = 0;
+        uint64_t LearnerSeq = 0;
+    };
+    std::deque<TPendingRead> PendingReads;
+    // takes the leader's read index, and a round unless the lease covers it
+    void QueueRead(ITimeSource::Time now, TPendingRead read);
+    uint64_t ReadSeq = 0;       // last round sent
+    uint64_t ReadConfirmed = 0; // last round a majority answered
+    bool ReadRoundWanted = false;
+    ITimeSource::Time ReadRoundDue;
+    // send times of unconfirmed rounds, a confirmed one extends the lease
+    std::map<uint64_t, ITimeSource::Time> ReadRounds;
+    bool LeaseReads = false;
+    std::chrono::milliseconds StaleReadBound{0};
+    ITimeSource::Time LeaseUntil;
+    // last message from the current leader
+    ITimeSource::Time LeaderContact;
+    uint32_t LeaderId = 0;
+    // clients of the commands relayed to the leader, by Seq
+    std::unordered_map<uint64_t, std::shared_ptr<INode>> Forwarded;
+    uint64_t ForwardSeq = 0;
+    // held back until the next Sync
+    std::vector<std::pair<std::shared_ptr<INode>, TMessageHolder<TMessage>>> Deferred;
+
+    struct TSnapshot {
+        uint64_t Index = 0;
+        uint64_t Term = 0;
+        std::shared_ptr<const std::vector<char>> Data;
+    };
+    // latest snapshot taken or installed, streamed to lagging followers
+    TSnapshot Snapshot;
+    // being received from the leader
+    uint64_t IncomingIndex = 0;
+    std::vector<char> IncomingData;
+    uint64_t CompactThreshold = DefaultCompactThreshold;
+    // entry bytes applied since the last snapshot
+    uint64_t AppliedBytes = 0;
+    int MaxInFlight = DefaultMaxInFlight;
+    int MaxBatchEntries = DefaultMaxBatchEntries;
+    uint64_t MaxBatchBytes = DefaultMaxBatchBytes;
+    std::chrono::milliseconds BatchLatency = DefaultBatchLatency;
+    // entries of the batch being built
+    std::vector<TMessageHolder<TCmdReq>> Batch;
+
     EState StateName;
     uint32_t Seed = 31337;
 };
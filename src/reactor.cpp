@@ -0,0 +1,134 @@
+#include <iostream>
+#include <stdexcept>
+#include <system_error>
+
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "reactor.h"
+
+void IReactor::Reply(uint64_t clientId, TMessage message) {
+    TReactorMessage m{.ClientId = clientId, .Message = std::move(message)};
+    if (!Overflow.empty() || !OutboundQueue.Push(m)) {
+        Overflow.emplace_back(std::move(m));
+        Backlogged.store(true, std::memory_order_release);
+    }
+    Pending = true;
+}
+
+void IReactor::Flush() {
+    while (!Overflow.empty() && OutboundQueue.Push(Overflow.front())) {
+        Overflow.pop_front();
+        Pending = true;
+    }
+    Backlogged.store(!Overflow.empty(), std::memory_order_release);
+    if (Pending) {
+        OutboundWakeup.Signal();
+        Pending = false;
+    }
+}
+
+template<typename TPoller>
+TReactor<TPoller>::~TReactor() {
+    Stop();
+}
+
+template<typename TPoller>
+void TReactor<TPoller>::Start() {
+    Running = true;
+    Thread = std::thread([this]() { Run(); });
+}
+
+template<typename TPoller>
+void TReactor<TPoller>::Stop() {
+    if (Running.exchange(false)) {
+        OutboundWakeup.Signal();
+        Thread.join();
+    }
+}
+
+template<typename TPoller>
+void TReactor<TPoller>::Run() {
+    Loop = std::make_unique<NNet::TLoop<TPoller>>();
+    TSocket listener(Address, Loop->Poller());
+    int one = 1;
+    if (setsockopt(listener.Fd(), SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        throw std::system_error(errno, std::generic_category(), "setsockopt(SO_REUSEPORT)");
+    }
+    listener.Bind();
+    listener.Listen();
+
+    Serve(listener);
+    Outbound();
+    while (Running) {
+        Loop->Step();
+    }
+}
+
+template<typename TPoller>
+NNet::TVoidTask TReactor<TPoller>::Serve(TSocket& listener) {
+    while (true) {
+        auto client = co_await listener.Accept();
+        // reactor index in the high bits keeps client ids unique across reactors
+        auto clientId = (static_cast<uint64_t>(Index) << 48) | NextClientId++;
+        Connection(clientId, std::move(client));
+    }
+    co_return;
+}
+
+template<typename TPoller>
+NNet::TVoidTask TReactor<TPoller>::Connection(uint64_t clientId, TSocket socket) {
+    try {
+        auto client = std::make_shared<TNode<TSocket>>(
+            "client", std::move(socket), TimeSource
+        );
+        Clients[clientId] = client;
+        while (true) {
+            auto mes = co_await TMessageReader(*client->Sock()).Read();
+            co_await Publish(TReactorMessage{.ClientId = clientId, .Message = std::move(mes)});
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << "Exception: " << ex.what() << "\n";
+    }
+    Clients.erase(clientId);
+    co_await Publish(TReactorMessage{.ClientId = clientId, .Closed = true});
+    co_return;
+}
+
+template<typename TPoller>
+NNet::TValueTask<void> TReactor<TPoller>::Publish(TReactorMessage message) {
+    // the consensus thread is behind: back off instead of growing without bound
+    while (!InboundQueue.Push(message)) {
+        co_await Loop->Poller().Yield();
+    }
+    InboundWakeup.Signal();
+    co_return;
+}
+
+template<typename TPoller>
+NNet::TVoidTask TReactor<TPoller>::Outbound() {
+    std::vector<std::shared_ptr<TNode<TSocket>>> touched;
+    while (Running) {
+        co_await TFdReady{&Loop->Poller(), OutboundWakeup.Fd()};
+        OutboundWakeup.Reset();
+        TReactorMessage m;
+        while (OutboundQueue.Pop(m)) {
+            auto it = Clients.find(m.ClientId);
+            if (it != Clients.end()) {
+                it->second->Send(std::move(m.Message));
+                touched.emplace_back(it->second);
+            }
+        }
+        for (auto& client : touched) {
+            client->Drain();
+        }
+        touched.clear();
+        if (Backlogged.load(std::memory_order_acquire)) {
+            // the ring has room again, ask for the overflowed replies
+            DrainedWakeup.Signal();
+        }
+    }
+    co_return;
+}
+
+template class TReactor<NNet::TDefaultPoller>;
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+
+#include <coroio/all.hpp>
+
+#include "eventfd.h"
+#include "messages.h"
+#include "server.h"
+#include "spsc.h"
+#include "timesource.h"
+
+// Request decoded by a reactor, or a close notification for its client
+struct TReactorMessage {
+    uint64_t ClientId = 0;
+    TMessage Message;
+    bool Closed = false;
+};
+
+// Consensus-thread view of a reactor
+class IReactor {
+public:
+    virtual ~IReactor() = default;
+
+    TSpscQueue<TReactorMessage>& Inbound() {
+        return InboundQueue;
+    }
+
+    TEventFd& InboundEvent() {
+        return InboundWakeup;
+    }
+
+    // signalled by the reactor when it emptied OutboundQueue while replies
+    // wait in the overflow, the consensus thread then calls Flush again
+    TEventFd& DrainedEvent() {
+        return DrainedWakeup;
+    }
+
+    // queues a response for one of the reactor's clients
+    void Reply(uint64_t clientId, TMessage message);
+    // moves overflowed replies into the queue, wakes the reactor if replies
+    // were queued since the last call
+    void Flush();
+
+protected:
+    IReactor(size_t queueSize)
+        : InboundQueue(queueSize)
+        , OutboundQueue(queueSize)
+    { }
+
+    TSpscQueue<TReactorMessage> InboundQueue;
+    TEventFd InboundWakeup;
+    TSpscQueue<TReactorMessage> OutboundQueue;
+    TEventFd OutboundWakeup;
+    TEventFd DrainedWakeup;
+    // Overflow is not empty
+    std::atomic<bool> Backlogged = false;
+
+private:
+    // replies that did not fit into OutboundQueue, consensus thread only
+    std::deque<TReactorMessage> Overflow;
+    bool Pending = false;
+};
+
+// Client I/O thread. Accepts client connections on a SO_REUSEPORT listener,
+// decodes requests and hands them to the consensus thread, writes back the
+// responses routed to its clients.
+template<typename TPoller>
+class TReactor: public IReactor {
+public:
+    using TSocket = typename TPoller::TSocket;
+
+    TReactor(uint32_t index, NNet::TAddress address, const std::shared_ptr<ITimeSource>& ts, size_t queueSize = 64*1024)
+        : IReactor(queueSize)
+        , Index(index)
+        , Address(std::move(address))
+        , TimeSource(ts)
+    { }
+
+    ~TReactor();
+
+    void Start();
+    void Stop();
+
+private:
+    void Run();
+    NNet::TVoidTask Serve(TSocket& listener);
+    NNet::TVoidTask Connection(uint64_t clientId, TSocket socket);
+    NNet::TVoidTask Outbound();
+    NNet::TValueTask<void> Publish(TReactorMessage message);
+
+    uint32_t Index;
+    NNet::TAddress Address;
+    std::shared_ptr<ITimeSource> TimeSource;
+    std::unique_ptr<NNet::TLoop<TPoller>> Loop;
+    std::thread Thread;
+    std::atomic<bool> Running = false;
+
+    uint64_t NextClientId = 1;
+    std::unordered_map<uint64_t, std::shared_ptr<TNode<TSocket>>> Clients;
+};
+
+// Consensus-thread stand-in for a client owned by a reactor
+class TReactorClient: public TFlushableNode {
+public:
+    TReactorClient(std::shared_ptr<IReactor> reactor, uint64_t id)
+        : Reactor(std::move(reactor))
+        , Id(id)
+    { }
+
+    void Send(TMessage message) override {
+        Reactor->Reply(Id, std::move(message));
+        MarkDirty();
+    }
+
+    void Drain() override {
+        ClearDirty();
+        Reactor->Flush();
+    }
+
+private:
+    std::shared_ptr<IReactor> Reactor;
+    uint64_t Id;
+};
@@ -1,10 +1,20 @@
+#include <algorithm>
 #include <chrono>
 #include <coroutine>
 #include <exception>
 #include <iostream>
 #include <stdexcept>
+#include <system_error>
 #include <vector>
+
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "applier.h"
+#include "local.h"
+#include "metrics.h"
 #include "rabia.h"
+#include "reactor.h"
 #include "server.h"
 #include "messages.h"
 
@@ -80,18 +90,96 @@ NNet::TValueTask<TMessage> TMessageReader<TSocket>::Read() {
             auto msg = co_await structReader.Read();
             co_return msg;
         }
+        case 8:
+        {
+            auto structReader = NNet::TStructReader<THello, TSocket>(Socket);
+            auto msg = co_await structReader.Read();
+            co_return msg;
+        }
         default:
             break;
     }
 }
 
+namespace {
+
+uint32_t rand_(uint32_t* seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+} // namespace
+
+std::chrono::milliseconds TBackoff::Next() {
+    auto half = Current.count() / 2;
+    auto delay = std::chrono::milliseconds(half + rand_(&Seed) % (Current.count() - half + 1));
+    Current = std::min(Current * 2, Max);
+    return delay;
+}
+
 template<typename TSocket>
 void TNode<TSocket>::Send(TMessage message) {
-    Messages.emplace_back(std::move(message));
+    Counters.OutboxBytes += message.Len;
+    auto lane = static_cast<size_t>(SendLane(message));
+    Lanes[lane].emplace_back(std::move(message));
+    if (Counters.OutboxBytes > OutboxLimit) {
+        Evict();
+    }
+    MarkDirty();
+}
+
+template<typename TSocket>
+void TNode<TSocket>::Evict() {
+    // oldest stale consensus messages go first, KEEP messages are never dropped
+    for (auto& lane : Lanes) {
+        auto it = std::remove_if(lane.begin(), lane.end(), [&](const TMessage& m) {
+            if (Counters.OutboxBytes <= OutboxLimit || DropPolicy(m) != EDropPolicy::DROP_STALE) {
+                return false;
+            }
+            Counters.OutboxBytes -= m.Len;
+            Counters.DroppedBytes += m.Len;
+            Counters.DroppedMessages++;
+            return true;
+        });
+        lane.erase(it, lane.end());
+    }
+}
+
+template<typename TSocket>
+bool TNode<TSocket>::HasPending() const {
+    for (const auto& lane : Lanes) {
+        if (!lane.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template<typename TSocket>
+void TNode<TSocket>::NextBatch() {
+    // weighted round robin across lanes: a bulk transfer gets a slot per
+    // round but can't hold queued votes and responses behind it
+    Sending.clear();
+    bool more = true;
+    while (more && Sending.size() < MaxIov) {
+        more = false;
+        for (size_t lane = 0; lane < LaneCount; lane++) {
+            auto& queue = Lanes[lane];
+            for (int i = 0; i < LaneWeights[lane] && !queue.empty() && Sending.size() < MaxIov; i++) {
+                Counters.OutboxBytes -= queue.front().Len;
+                Sending.emplace_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+            more = more || !queue.empty();
+        }
+    }
 }
 
 template<typename TSocket>
 void TNode<TSocket>::Drain() {
+    ClearDirty();
     if (!Connected) {
         Connect();
         return;
@@ -104,24 +192,119 @@ void TNode<TSocket>::Drain() {
     }
 }
 
+template<typename TSocket>
+NNet::TValueTask<void> TNode<TSocket>::Flush(TSocket& socket, std::vector<TMessage>& messages) {
+    if constexpr (IsVectored<TSocket>) {
+        size_t i = 0;
+        while (i < messages.size()) {
+            int iovcnt = std::min(MaxIov, messages.size() - i);
+            for (int k = 0; k < iovcnt; k++) {
+                auto& m = messages[i + k];
+                Iov[k] = iovec {.iov_base = &m, .iov_len = m.Len};
+            }
+            iovec* iov = Iov.data();
+            int left = iovcnt;
+            while (left > 0) {
+                auto r = ::writev(socket.Fd(), iov, left);
+                if (r < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        co_await TFdReady{socket.Poller(), socket.Fd(), true};
+                        continue;
+                    }
+                    throw std::system_error(errno, std::generic_category(), "writev");
+                }
+                Counters.Syscalls++;
+                Counters.Bytes += r;
+                // skip fully written buffers, then shift into the partially written one
+                while (left > 0 && static_cast<size_t>(r) >= iov->iov_len) {
+                    r -= iov->iov_len;
+                    iov++; left--;
+                }
+                if (left > 0) {
+                    iov->iov_base = static_cast<char*>(iov->iov_base) + r;
+                    iov->iov_len -= r;
+                }
+            }
+            Counters.Messages += iovcnt;
+            i += iovcnt;
+        }
+    } else {
+        // ssl and uring sockets have no raw fd to writev on: stage the batch
+        // into one reused buffer, so it is submitted as a single write
+        Staging.clear();
+        for (auto& m : messages) {
+            auto* p = reinterpret_cast<const char*>(&m);
+            Staging.insert(Staging.end(), p, p + m.Len);
+        }
+        co_await NNet::TByteWriter(socket).Write(Staging.data(), Staging.size());
+        Counters.Syscalls++;
+        Counters.Messages += messages.size();
+        Counters.Bytes += Staging.size();
+    }
+    co_return;
+}
+
 template<typename TSocket>
 NNet::TVoidSuspendedTask TNode<TSocket>::DoDrain() {
-    try {
-        while (!Messages.empty()) {
-            auto tosend = std::move(Messages); Messages.clear();
-            for (auto&& m : tosend) {
-                co_await TMessageWriter(Socket).Write(std::move(m));
+    while (Connected && HasPending()) {
+        // re-pick after every batch, so messages queued meanwhile
+        // on a higher priority lane go out next
+        NextBatch();
+        // each batch goes to the connection current when it was picked
+        auto socket = Socket;
+        auto generation = Generation_;
+        try {
+            co_await Flush(*socket, Sending);
+        } catch (const std::exception& ex) {
+            if (generation == Generation_) {
+                std::cout << "Error on write: " << ex.what() << "\n";
+                Connect();
+                co_return;
             }
+            // the connection was replaced meanwhile, go on with the new one
         }
-    } catch (const std::exception& ex) {
-        std::cout << "Error on write: " << ex.what() << "\n";
-        Connect();
     }
     co_return;
 }
 
+template<typename TSocket>
+void TNode<TSocket>::Shutdown(const std::shared_ptr<TSocket>& socket) {
+    if constexpr (requires { socket->Fd(); }) {
+        if (socket) {
+            ::shutdown(socket->Fd(), SHUT_RDWR);
+        }
+    }
+}
+
+template<typename TSocket>
+void TNode<TSocket>::Attach(TSocket socket) {
+    std::cout << "Attached " << Name << "\n";
+    Shutdown(Socket);
+    Socket = std::make_shared<TSocket>(std::move(socket));
+    Connected = true;
+    Generation_++;
+    if (OnConnected) {
+        OnConnected();
+    }
+    if (HasPending()) {
+        Drain();
+    }
+}
+
+template<typename TSocket>
+void TNode<TSocket>::Disconnect() {
+    Connect();
+}
+
 template<typename TSocket>
 void TNode<TSocket>::Connect() {
+    if (Passive()) {
+        // the peer dials us, queued messages wait for Attach
+        Connected = false;
+        return;
+    }
     if (Address && (!Connector || Connector.done())) {
         if (Connector && Connector.done()) {
             Connector.destroy();
@@ -134,20 +317,92 @@ template<typename TSocket>
 NNet::TVoidSuspendedTask TNode<TSocket>::DoConnect() {
     std::cout << "Connecting " << Name << "\n";
     Connected = false;
+    Shutdown(Socket);
+    auto t0 = TimeSource->Now();
+    Backoff.Reset();
+    std::shared_ptr<TSocket> socket;
     while (!Connected) {
         try {
-            auto deadline = NNet::TClock::now() + std::chrono::milliseconds(100); // TODO: broken timeout in coroio
-            Socket = SocketFactory(*Address);
-            co_await Socket.Connect(deadline);
+            auto deadline = NNet::TClock::now() + ConnectTimeout;
+            socket = std::make_shared<TSocket>(SocketFactory(*Address));
+            PendingConnect = ++ConnectAttempts;
+            ConnectGuard(socket, PendingConnect);
+            co_await socket->Connect(deadline);
+            PendingConnect = 0;
+            if (PeerId) {
+                THello hello;
+                hello.Type = static_cast<uint32_t>(THello::MessageType);
+                hello.Len = sizeof(THello);
+                hello.Src = LocalId;
+                hello.Dst = PeerId;
+                co_await TMessageWriter(*socket).Write(hello);
+            }
             std::cout << "Connected " << Name << "\n";
+            Socket = socket;
             Connected = true;
         } catch (const std::exception& ex) {
+            PendingConnect = 0;
             std::cout << "Error on connect: " << Name << " " << ex.what() << "\n";
         }
         if (!Connected) {
-            co_await Socket.Poller()->Sleep(std::chrono::milliseconds(1000));
+            co_await Poller->Sleep(Backoff.Next());
         }
     }
+    Counters.Reconnects++;
+    Counters.LastReconnectTime = std::chrono::duration_cast<std::chrono::microseconds>(TimeSource->Now() - t0);
+    Generation_++;
+    if (OnConnected) {
+        OnConnected();
+    }
+    if (HasPending()) {
+        Drain();
+    }
+    co_return;
+}
+
+template<typename TSocket>
+NNet::TVoidTask TNode<TSocket>::ConnectGuard(std::shared_ptr<TSocket> socket, uint64_t attempt) {
+    co_await Poller->Sleep(ConnectTimeout);
+    if (PendingConnect == attempt) {
+        // a connecting socket that is shut down fails its pending connect
+        std::cout << "Connect timeout: " << Name << "\n";
+        Shutdown(socket);
+    }
+    co_return;
+}
+
+template<typename TSocket>
+void TRabiaServer<TSocket>::AddPeer(uint32_t id, const std::shared_ptr<INode>& node) {
+    auto peer = std::dynamic_pointer_cast<TNode<TSocket>>(node);
+    if (!peer) {
+        return;
+    }
+    Peers[id] = peer;
+    peer->SetOnConnected([this, id]() {
+        PeerConnection(id);
+    });
+}
+
+template<typename TSocket>
+NNet::TVoidTask TRabiaServer<TSocket>::PeerConnection(uint32_t id) {
+    auto peer = Peers[id];
+    auto generation = peer->Generation();
+    // this connection's socket, a reconnect swaps the peer's one
+    auto socket = peer->Sock();
+    try {
+        while (true) {
+            auto mes = co_await TMessageReader(*socket).Read();
+            // replies go back through the same node, so over the same connection
+            Dispatch(std::move(mes), peer);
+            RequestFlush();
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << "Peer " << id << " exception: " << ex.what() << "\n";
+    }
+    // a newer connection may already have replaced this one
+    if (peer->Generation() == generation) {
+        peer->Disconnect();
+    }
     co_return;
 }
 
@@ -155,15 +410,27 @@ template<typename TSocket>
 NNet::TVoidTask TRabiaServer<TSocket>::InboundConnection(TSocket socket) {
     std::shared_ptr<TNode<TSocket>> client;
     try {
+        auto first = co_await TMessageReader(socket).Read();
+        if (first.Type == static_cast<uint32_t>(EMessageType::HELLO)) {
+            auto it = Peers.find(first.Src);
+            if (it != Peers.end() && it->second->Passive()) {
+                it->second->Attach(std::move(socket));
+                co_return;
+            }
+            std::cerr << "Unexpected hello from " << first.Src << "\n";
+            co_return;
+        }
         client = std::make_shared<TNode<TSocket>>(
             "client", std::move(socket), TimeSource
         );
         Nodes.insert(client);
+        Track(client);
+        Dispatch(std::move(first), client);
+        RequestFlush();
         while (true) {
-            auto mes = co_await TMessageReader(client->Sock()).Read();
-            Raft->Process(TimeSource->Now(), std::move(mes), client);
-            Raft->ProcessTimeout(TimeSource->Now());
-            DrainNodes();
+            auto mes = co_await TMessageReader(*client->Sock()).Read();
+            Dispatch(std::move(mes), client);
+            RequestFlush();
         }
     } catch (const std::exception & ex) {
         std::cerr << "Exception: " << ex.what() << "\n";
@@ -172,15 +439,285 @@ NNet::TVoidTask TRabiaServer<TSocket>::InboundConnection(TSocket socket) {
     co_return;
 }
 
+template<typename TSocket>
+NNet::TVoidTask TRabiaServer<TSocket>::ReactorInbound(std::shared_ptr<IReactor> reactor) {
+    TReactorMessage m;
+    while (true) {
+        co_await TFdReady{&Poller, reactor->InboundEvent().Fd()};
+        reactor->InboundEvent().Reset();
+        while (reactor->Inbound().Pop(m)) {
+            auto& client = ReactorClients[m.ClientId];
+            if (m.Closed) {
+                Nodes.erase(client);
+                ReactorClients.erase(m.ClientId);
+                continue;
+            }
+            if (!client) {
+                client = std::make_shared<TReactorClient>(reactor, m.ClientId);
+                Nodes.insert(client);
+                Track(client);
+            }
+            Dispatch(std::move(m.Message), client);
+        }
+        RequestFlush();
+    }
+    co_return;
+}
+
+template<typename TSocket>
+NNet::TVoidTask TRabiaServer<TSocket>::ReactorDrained(std::shared_ptr<IReactor> reactor) {
+    while (true) {
+        co_await TFdReady{&Poller, reactor->DrainedEvent().Fd()};
+        reactor->DrainedEvent().Reset();
+        // replies stuck in the overflow must not wait for a new one
+        reactor->Flush();
+    }
+    co_return;
+}
+
+template<typename TSocket>
+void TRabiaServer<TSocket>::AddReactor(std::shared_ptr<IReactor> reactor) {
+    Reactors.emplace_back(std::move(reactor));
+}
+
+template<typename TSocket>
+void TRabiaServer<TSocket>::SetApplier(std::shared_ptr<TApplier> applier) {
+    Applier = std::move(applier);
+}
+
+template<typename TSocket>
+NNet::TVoidTask TRabiaServer<TSocket>::ApplierWatch() {
+    while (true) {
+        co_await TFdReady{&Poller, Applier->Event().Fd()};
+        Applier->Event().Reset();
+        // collects the applied index, answers the waiting clients
+        RequestFlush();
+    }
+    co_return;
+}
+
+template<typename TSocket>
+void TRabiaServer<TSocket>::AddLocal(const std::string& path) {
+#ifdef __linux__
+    LocalListener = std::make_shared<TLocalListener>(path);
+#else
+    std::cerr << "Local transport is not supported on this platform\n";
+#endif
+}
+
+template<typename TSocket>
+NNet::TVoidTask TRabiaServer<TSocket>::LocalServe() {
+#ifdef __linux__
+    while (true) {
+        co_await TFdReady{&Poller, LocalListener->Fd()};
+        try {
+            while (auto channel = LocalListener->Accept()) {
+                std::cout << "Accepted local\n";
+                LocalConnection(channel);
+                LocalWatch(std::move(channel));
+            }
+        } catch (const std::exception& ex) {
+            std::cerr << "Local accept: " << ex.what() << "\n";
+        }
+    }
+#endif
+    co_return;
+}
+
+template<typename TSocket>
+NNet::TVoidTask TRabiaServer<TSocket>::LocalConnection(std::shared_ptr<TLocalChannel> channel) {
+#ifdef __linux__
+    std::shared_ptr<TNode<TLocalSocket>> client;
+    try {
+        // responses are staged per flush pass like on any other client node,
+        // the reader is woken at most once per batch
+        client = std::make_shared<TNode<TLocalSocket>>(
+            "local", TLocalSocket(std::move(channel), &Poller), TimeSource
+        );
+        Nodes.insert(client);
+        Track(client);
+        while (true) {
+            auto mes = co_await TMessageReader(*client->Sock()).Read();
+            Dispatch(std::move(mes), client);
+            RequestFlush();
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << "Exception: " << ex.what() << "\n";
+    }
+    Nodes.erase(client);
+#endif
+    co_return;
+}
+
+template<typename TSocket>
+NNet::TVoidTask TRabiaServer<TSocket>::LocalWatch(std::shared_ptr<TLocalChannel> channel) {
+#ifdef __linux__
+    // the client never writes to the handshake socket, it only becomes
+    // readable when the client goes away
+    co_await TFdReady{&Poller, channel->Connection()};
+    channel->Close();
+#endif
+    co_return;
+}
+
+template<typename TSocket>
+void TRabiaServer<TSocket>::SetMetrics(std::shared_ptr<TMetrics> metrics) {
+    static constexpr std::array<const char*, MessageTypes + 1> typeNames = {
+        "protocol", "cmd_req", "replicate", "proposal", "state", "vote", "decided", "response", "hello",
+        "install_snapshot_request", "install_snapshot_response", "read_index_request", "read_index_response",
+        "append_entries_conflict", "log_batch", "forward_request", "forward_response", "leader_hint",
+        "learner_read_request", "learner_read_response", "request_vote_request", "request_vote_response",
+        "append_entries_request", "append_entries_response", "other"
+    };
+    // a name per EMessageType: missing ones leave the last entry empty
+    static_assert(typeNames[MessageTypes] != nullptr, "name every EMessageType");
+    Metrics = std::move(metrics);
+    for (size_t i = 0; i <= MessageTypes; i++) {
+        ReceivedMessages[i] = &Metrics->Counter(
+            "rabia_messages_received_total", "Messages received, by type",
+            std::string("type=\"") + typeNames[i] + "\"");
+    }
+    ReceivedBytes = &Metrics->Counter("rabia_received_bytes_total", "Bytes of messages received");
+    ProcessLatency = &Metrics->Histogram("rabia_stage_seconds", "Time spent per stage", "stage=\"process\"");
+    FlushLatency = &Metrics->Histogram("rabia_stage_seconds", "Time spent per stage", "stage=\"flush\"");
+    Fsyncs = &Metrics->Counter("rabia_fsync_total", "Batched log and state fsyncs");
+    FsyncLatency = &Metrics->Histogram("rabia_fsync_seconds", "Time spent in a batched fsync");
+    Metrics->OnScrape([this]() {
+        Collect();
+    });
+}
+
+template<typename TSocket>
+void TRabiaServer<TSocket>::Dispatch(TMessage message, const std::shared_ptr<INode>& from) {
+    auto now = TimeSource->Now();
+    if (!Metrics) {
+        Raft->Process(now, std::move(message), from);
+        return;
+    }
+    ReceivedMessages[std::min<size_t>(message.Type, MessageTypes)]->Inc();
+    ReceivedBytes->Inc(message.Len);
+    Raft->Process(now, std::move(message), from);
+    ProcessLatency->Observe(TimeSource->Now() - now);
+}
+
+template<typename TSocket>
+void TRabiaServer<TSocket>::Collect() {
+    // scrapes run on this loop, plain reads of consensus state are safe
+    auto* state = Raft->GetState();
+    auto* volatileState = Raft->GetVolatileState();
+    Metrics->Gauge("rabia_term", "Current term").Set(state->CurrentTerm);
+    Metrics->Gauge("rabia_log_size", "Entries in the log").Set(state->LogSize());
+    Metrics->Gauge("rabia_commit_index", "Highest committed index").Set(volatileState->CommitIndex);
+    Metrics->Gauge("rabia_connections", "Peer and client connections").Set(Nodes.size());
+    Metrics->Gauge("rabia_dirty_nodes", "Nodes waiting for the flush pass").Set(Dirty.size());
+    for (const auto& [id, peer] : Peers) {
+        auto labels = "peer=\"" + std::to_string(id) + "\"";
+        const auto& stats = peer->Stats();
+        Metrics->Gauge("rabia_outbox_bytes", "Bytes queued for a peer", labels).Set(stats.OutboxBytes);
+        Metrics->Counter("rabia_sent_messages_total", "Messages written to a peer", labels).Set(stats.Messages);
+        Metrics->Counter("rabia_sent_bytes_total", "Bytes written to a peer", labels).Set(stats.Bytes);
+        Metrics->Counter("rabia_write_syscalls_total", "Write syscalls to a peer", labels).Set(stats.Syscalls);
+        Metrics->Counter("rabia_dropped_messages_total", "Stale messages evicted from a full outbox", labels).Set(stats.DroppedMessages);
+        Metrics->Counter("rabia_dropped_bytes_total", "Bytes of stale messages evicted from a full outbox", labels).Set(stats.DroppedBytes);
+        Metrics->Counter("rabia_reconnects_total", "Connections established to a peer", labels).Set(stats.Reconnects);
+        Metrics->Gauge("rabia_last_reconnect_microseconds", "Time from losing a peer connection to having it back, last reconnect", labels).Set(stats.LastReconnectTime.count());
+    }
+}
+
 template<typename TSocket>
 void TRabiaServer<TSocket>::Serve() {
-    Idle();
+    auto now = TimeSource->Now();
+    Timers.Schedule(now + std::chrono::milliseconds(2000), EDebugPrint);
+    Raft->ProcessTimeout(now);
+    DrainNodes();
+    ScheduleRaftTimeout();
     InboundServe();
+    if (LocalListener) {
+        LocalServe();
+    }
+    for (const auto& reactor : Reactors) {
+        ReactorInbound(reactor);
+        ReactorDrained(reactor);
+    }
+    if (Applier) {
+        ApplierWatch();
+    }
+}
+
+template<typename TSocket>
+void TRabiaServer<TSocket>::Track(const std::shared_ptr<INode>& node) {
+    if (auto flushable = std::dynamic_pointer_cast<TFlushableNode>(node)) {
+        flushable->SetOnDirty([this](const std::shared_ptr<INode>& node) {
+            MarkDirty(node);
+        });
+    } else {
+        Untracked.emplace_back(node);
+    }
+}
+
+template<typename TSocket>
+void TRabiaServer<TSocket>::MarkDirty(const std::shared_ptr<INode>& node) {
+    Dirty.emplace_back(node);
+    RequestFlush();
+}
+
+template<typename TSocket>
+void TRabiaServer<TSocket>::RequestFlush() {
+    if (!FlushScheduled) {
+        FlushScheduled = true;
+        if (Metrics) {
+            FlushRequested = TimeSource->Now();
+        }
+        FlushPass();
+    }
+}
+
+template<typename TSocket>
+NNet::TVoidTask TRabiaServer<TSocket>::FlushPass() {
+    // let every ready connection deliver its messages first
+    co_await Poller.Yield();
+    FlushScheduled = false;
+    auto now = TimeSource->Now();
+    Raft->ProcessTimeout(now);
+    DrainNodes();
+    ScheduleRaftTimeout();
+    if (Metrics) {
+        // from the first queued message of the turn until it was handed to the sockets
+        FlushLatency->Observe(TimeSource->Now() - FlushRequested);
+    }
+    co_return;
+}
+
+template<typename TSocket>
+void TRabiaServer<TSocket>::Persist() {
+    // one fsync covers everything appended since the previous turn
+    auto start = Metrics ? TimeSource->Now() : ITimeSource::Time{};
+    if (Raft->Sync() && Metrics) {
+        Fsyncs->Inc();
+        FsyncLatency->Observe(TimeSource->Now() - start);
+    }
 }
 
 template<typename TSocket>
 void TRabiaServer<TSocket>::DrainNodes() {
-    for (const auto& node : Nodes) {
+    // the leader's appends go out first and replicate while it fsyncs; what
+    // needs the state on disk is held back by the raft until Persist
+    DrainDirty();
+    Persist();
+    DrainDirty();
+}
+
+template<typename TSocket>
+void TRabiaServer<TSocket>::DrainDirty() {
+    while (!Dirty.empty()) {
+        Draining.clear();
+        std::swap(Draining, Dirty);
+        for (const auto& node : Draining) {
+            node->Drain();
+        }
+    }
+    Draining.clear();
+    for (const auto& node : Untracked) {
         node->Drain();
     }
 }
@@ -202,54 +739,92 @@ void TRabiaServer<TSocket>::DebugPrint() {
     if (Raft->CurrentStateName() == EState::LEADER) {
         std::cout << "Leader, "
             << "Term: " << state->CurrentTerm << ", "
-            << "Index: " << state->Log.size() << ", "
+            << "Index: " << state->LogSize() << ", "
             << "CommitIndex: " << volatileState->CommitIndex << ", ";
         std::cout << "Delay: ";
-        for (auto [id, index] : volatileState->MatchIndex) {
-            std::cout << id << ":" << (state->Log.size() - index) << " ";
+        for (const auto& peer : volatileState->Peers) {
+            std::cout << peer.Id << ":" << (state->LogSize() - peer.MatchIndex) << " ";
         }
         std::cout << "MatchIndex: ";
-        for (auto [id, index] : volatileState->MatchIndex) {
-            std::cout << id << ":" << index << " ";
+        for (const auto& peer : volatileState->Peers) {
+            std::cout << peer.Id << ":" << peer.MatchIndex << " ";
         }
         std::cout << "NextIndex: ";
-        for (auto [id, index] : volatileState->NextIndex) {
-            std::cout << id << ":" << index << " ";
+        for (const auto& peer : volatileState->Peers) {
+            std::cout << peer.Id << ":" << peer.NextIndex << " ";
         }
         std::cout << "\n";
     } else if (Raft->CurrentStateName() == EState::CANDIDATE) {
         std::cout << "Candidate, "
             << "Term: " << state->CurrentTerm << ", "
-            << "Index: " << state->Log.size() << ", "
+            << "Index: " << state->LogSize() << ", "
             << "CommitIndex: " << volatileState->CommitIndex << ", "
             << "\n";
     } else if (Raft->CurrentStateName() == EState::FOLLOWER) {
         std::cout << "Follower, "
             << "Term: " << state->CurrentTerm << ", "
-            << "Index: " << state->Log.size() << ", "
+            << "Index: " << state->LogSize() << ", "
             << "CommitIndex: " << volatileState->CommitIndex << ", "
             << "\n";
     }
 }
 
 template<typename TSocket>
-NNet::TVoidTask TRabiaServer<TSocket>::Idle() {
-    auto t0 = TimeSource->Now();
-    auto dt = std::chrono::milliseconds(2000);
-    auto sleep = std::chrono::milliseconds(100);
-    while (true) {
-        Raft->ProcessTimeout(TimeSource->Now());
-        DrainNodes();
-        auto t1 = TimeSource->Now();
-        if (t1 > t0 + dt) {
+void TRabiaServer<TSocket>::ScheduleRaftTimeout() {
+    auto due = Raft->NextTimeout();
+    if (due < RaftDue) {
+        // an already scheduled later ERaftTimeout just fires as a no-op
+        RaftDue = due;
+        Timers.Schedule(due, ERaftTimeout);
+        Arm(due);
+    }
+}
+
+template<typename TSocket>
+void TRabiaServer<TSocket>::Arm(ITimeSource::Time deadline) {
+    // coroio sleeps cannot be cancelled: an earlier deadline gets its own
+    // sleeper, the superseded one wakes up to an empty wheel
+    if (deadline < SleepUntil) {
+        SleepUntil = deadline;
+        Sleeper(deadline);
+    }
+}
+
+template<typename TSocket>
+NNet::TVoidTask TRabiaServer<TSocket>::Sleeper(ITimeSource::Time deadline) {
+    co_await Poller.Sleep(deadline);
+    if (SleepUntil == deadline) {
+        SleepUntil = ITimeSource::Max;
+    }
+    OnTimer();
+    co_return;
+}
+
+template<typename TSocket>
+void TRabiaServer<TSocket>::OnTimer() {
+    auto now = TimeSource->Now();
+    Fired.clear();
+    Timers.Advance(now, Fired);
+    for (auto id : Fired) {
+        switch (id) {
+        case ERaftTimeout:
+            if (RaftDue <= now) {
+                RaftDue = ITimeSource::Max;
+                Raft->ProcessTimeout(now);
+                DrainNodes();
+            }
+            break;
+        case EDebugPrint:
             DebugPrint();
-            t0 = t1;
+            Timers.Schedule(now + std::chrono::milliseconds(2000), EDebugPrint);
+            break;
         }
-        co_await Poller.Sleep(t1 + sleep);
     }
-    co_return;
+    ScheduleRaftTimeout();
+    Arm(Timers.NextExpiry());
 }
 
+template class TNode<NNet::TSocket>;
 template class TRabiaServer<NNet::TSocket>;
 template class TRabiaServer<NNet::TSslSocket<NNet::TSocket>>;
 #ifdef __linux__
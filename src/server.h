@@ -1,15 +1,21 @@
 #pragma once
 
+#include <array>
 #include <exception>
 #include <memory>
 #include <coroutine>
 #include <string_view>
 #include <charconv>
+#include <deque>
 #include <optional>
+#include <type_traits>
+
+#include <sys/uio.h>
 
 #include <coroio/all.hpp>
 
 #include "timesource.h"
+#include "timerwheel.h"
 #include "messages.h"
 #include "raft.h"
 
@@ -39,6 +45,67 @@ private:
     TSocket& Socket;
 };
 
+// Suspends until fd becomes readable (or writable), for syscalls
+// coroio doesn't wrap (writev, eventfd reads, ...)
+struct TFdReady {
+    NNet::TPollerBase* Poller;
+    int Fd;
+    bool Write = false;
+
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+        if (Write) {
+            Poller->AddWrite(Fd, h);
+        } else {
+            Poller->AddRead(Fd, h);
+        }
+    }
+    void await_resume() { }
+};
+
+// Plain sockets expose the fd, so queued messages can be flushed with one writev
+template<typename TSocket>
+constexpr bool IsVectored = std::is_same_v<TSocket, NNet::TSocket>;
+
+struct TNodeStats {
+    // flushes
+    uint64_t Syscalls = 0;
+    uint64_t Messages = 0;
+    uint64_t Bytes = 0;
+    // outbox
+    uint64_t OutboxBytes = 0;
+    uint64_t DroppedMessages = 0;
+    uint64_t DroppedBytes = 0;
+    // reconnects
+    uint64_t Reconnects = 0;
+    std::chrono::microseconds LastReconnectTime{0};
+};
+
+// Reconnect delays: doubles from min up to max. Equal jitter keeps half of
+// each delay random, so peers restarting together don't retry in lockstep
+class TBackoff {
+public:
+    TBackoff(std::chrono::milliseconds min, std::chrono::milliseconds max, uint32_t seed)
+        : Min(min)
+        , Max(max)
+        , Current(min)
+        , Seed(seed | 1)
+    { }
+
+    // delay before the next attempt, within [current / 2, current]
+    std::chrono::milliseconds Next();
+
+    void Reset() {
+        Current = Min;
+    }
+
+private:
+    std::chrono::milliseconds Min;
+    std::chrono::milliseconds Max;
+    std::chrono::milliseconds Current;
+    uint32_t Seed;
+};
+
 struct THost {
     std::string Address;
     int Port = 0;
@@ -68,48 +135,159 @@ struct THost {
     }
 };
 
+// Node that reports its first Send after a Drain, so the server only
+// visits nodes that have queued output
+class TFlushableNode: public INode, public std::enable_shared_from_this<TFlushableNode> {
+public:
+    using TOnDirty = std::function<void(const std::shared_ptr<INode>&)>;
+
+    void SetOnDirty(TOnDirty onDirty) {
+        OnDirty = std::move(onDirty);
+    }
+
+protected:
+    void MarkDirty() {
+        if (!Dirty && OnDirty) {
+            Dirty = true;
+            OnDirty(shared_from_this());
+        }
+    }
+
+    void ClearDirty() {
+        Dirty = false;
+    }
+
+private:
+    TOnDirty OnDirty;
+    bool Dirty = false;
+};
+
 template<typename TSocket>
-class TNode: public INode {
+class TNode: public TFlushableNode {
 public:
-    TNode(const std::function<TSocket(const NNet::TAddress&)> factory, const std::string& name, NNet::TAddress address, const std::shared_ptr<ITimeSource>& ts)
+    // reconnects on its own, sleeping between attempts on poller
+    TNode(const std::function<TSocket(const NNet::TAddress&)> factory, const std::string& name, NNet::TAddress address, const std::shared_ptr<ITimeSource>& ts, NNet::TPollerBase* poller)
         : Name(name)
         , Address(address)
         , TimeSource(ts)
+        , Poller(poller)
         , SocketFactory(factory)
+        , Backoff(MinReconnectDelay, MaxReconnectDelay, std::hash<std::string>()(name))
     { }
 
     TNode(const std::string& name, TSocket socket, const std::shared_ptr<ITimeSource>& ts)
         : Name(name)
-        , Socket(std::move(socket))
-        , Connected(true)
         , TimeSource(ts)
-    { }
+        , Socket(std::make_shared<TSocket>(std::move(socket)))
+        , Connected(true)
+        , Backoff(MinReconnectDelay, MaxReconnectDelay, std::hash<std::string>()(name))
+    {
+        Poller = Socket->Poller();
+    }
 
     void Send(TMessage message) override;
     void Drain() override;
-    TSocket& Sock() {
+    // the current connection. A reader holds on to it: once the node
+    // reconnects it keeps reading the old one, which is shut down
+    std::shared_ptr<TSocket> Sock() {
         return Socket;
     }
 
+    const TNodeStats& Stats() const {
+        return Counters;
+    }
+
+    void SetOutboxLimit(size_t bytes) {
+        OutboxLimit = bytes;
+    }
+
+    // A replica pair shares one connection: the lower id dials and
+    // introduces itself with THello, the higher id adopts the accepted socket
+    void Pair(uint32_t localId, uint32_t peerId) {
+        LocalId = localId;
+        PeerId = peerId;
+    }
+
+    bool Passive() const {
+        return PeerId && LocalId > PeerId;
+    }
+
+    void Attach(TSocket socket);
+    void Disconnect();
+
+    // called each time a new connection is up, so its inbound side can be read
+    void SetOnConnected(std::function<void()> onConnected) {
+        OnConnected = std::move(onConnected);
+    }
+
+    bool IsConnected() const {
+        return Connected;
+    }
+
+    uint64_t Generation() const {
+        return Generation_;
+    }
+
+    static constexpr std::chrono::milliseconds MinReconnectDelay{10};
+    static constexpr std::chrono::milliseconds MaxReconnectDelay{1000};
+    static constexpr std::chrono::milliseconds ConnectTimeout{100};
+
 private:
     void Connect();
+    void Evict();
 
+    bool HasPending() const;
+    void NextBatch();
+    NNet::TValueTask<void> Flush(TSocket& socket, std::vector<TMessage>& messages);
     NNet::TVoidSuspendedTask DoDrain();
     NNet::TVoidSuspendedTask DoConnect();
+    // coroio does not enforce the connect deadline: aborts the attempt
+    // still pending after ConnectTimeout
+    NNet::TVoidTask ConnectGuard(std::shared_ptr<TSocket> socket, uint64_t attempt);
+    // ends the reads and writes still pending on a replaced connection
+    static void Shutdown(const std::shared_ptr<TSocket>& socket);
 
     std::string Name;
     std::optional<NNet::TAddress> Address;
     std::shared_ptr<ITimeSource> TimeSource;
+    // not reached through Socket, which is null until an attempt got one
+    NNet::TPollerBase* Poller = nullptr;
     std::function<TSocket(const NNet::TAddress&)> SocketFactory;
-    TSocket Socket;
+    std::shared_ptr<TSocket> Socket;
     bool Connected = false;
+    uint32_t LocalId = 0;
+    uint32_t PeerId = 0;
+    uint64_t Generation_ = 0;
+    std::function<void()> OnConnected;
 
     std::coroutine_handle<> Drainer;
     std::coroutine_handle<> Connector;
 
-    std::vector<TMessage> Messages;
+    // per ELane queues; a batch takes up to LaneWeights[lane] messages
+    // from each lane per round, control first
+    static constexpr std::array<int, LaneCount> LaneWeights = {8, 4, 1};
+    std::array<std::deque<TMessage>, LaneCount> Lanes;
+    std::vector<TMessage> Sending;
+
+    static constexpr size_t MaxIov = 64;
+    std::array<iovec, MaxIov> Iov;
+    std::vector<char> Staging;
+    size_t OutboxLimit = 64 * 1024 * 1024;
+    TNodeStats Counters;
+    TBackoff Backoff;
+    uint64_t ConnectAttempts = 0;
+    // attempt waiting in Connect, 0 if none
+    uint64_t PendingConnect = 0;
 };
 
+class IReactor;
+class TApplier;
+class TLocalChannel;
+class TLocalListener;
+class TMetrics;
+class TCounter;
+class THistogram;
+
 template<typename TSocket>
 class TRabiaServer {
 public:
@@ -123,19 +301,49 @@ public:
         , Socket(std::move(socket))
         , Raft(raft)
         , TimeSource(ts)
+        , Timers(ts->Now())
     {
-        for (const auto& [_, node] : nodes) {
+        for (const auto& [id, node] : nodes) {
             Nodes.insert(node);
+            Track(node);
+            AddPeer(id, node);
         }
     }
 
+    // client connections accepted by reactor threads are served through it
+    void AddReactor(std::shared_ptr<IReactor> reactor);
+    // accept same-host clients over shared memory rings (Linux only)
+    void AddLocal(const std::string& path);
+    // runs a raft turn whenever the applier has applied entries or results
+    void SetApplier(std::shared_ptr<TApplier> applier);
+    // registers the server's series, sampled ones are read on scrape
+    void SetMetrics(std::shared_ptr<TMetrics> metrics);
     void Serve();
 
 private:
     NNet::TVoidTask InboundServe();
     NNet::TVoidTask InboundConnection(TSocket socket);
-    NNet::TVoidTask Idle();
+    void AddPeer(uint32_t id, const std::shared_ptr<INode>& node);
+    NNet::TVoidTask PeerConnection(uint32_t id);
+    NNet::TVoidTask ReactorInbound(std::shared_ptr<IReactor> reactor);
+    NNet::TVoidTask ReactorDrained(std::shared_ptr<IReactor> reactor);
+    NNet::TVoidTask ApplierWatch();
+    NNet::TVoidTask LocalServe();
+    NNet::TVoidTask LocalConnection(std::shared_ptr<TLocalChannel> channel);
+    NNet::TVoidTask LocalWatch(std::shared_ptr<TLocalChannel> channel);
+    NNet::TVoidTask Sleeper(ITimeSource::Time deadline);
+    void Arm(ITimeSource::Time deadline);
+    void OnTimer();
+    void ScheduleRaftTimeout();
+    void Dispatch(TMessage message, const std::shared_ptr<INode>& from);
+    void Collect();
+    void Track(const std::shared_ptr<INode>& node);
+    void MarkDirty(const std::shared_ptr<INode>& node);
+    void RequestFlush();
+    NNet::TVoidTask FlushPass();
+    void Persist();
     void DrainNodes();
+    void DrainDirty();
     void DebugPrint();
 
     typename TSocket::TPoller& Poller;
@@ -143,4 +351,38 @@ private:
     std::shared_ptr<TRaft> Raft;
     std::unordered_set<std::shared_ptr<INode>> Nodes;
     std::shared_ptr<ITimeSource> TimeSource;
+    // replicas, each reached over a single connection in both directions
+    std::unordered_map<uint32_t, std::shared_ptr<TNode<TSocket>>> Peers;
+
+    // nodes with output queued since their last Drain, flushed once per loop turn
+    std::vector<std::shared_ptr<INode>> Dirty;
+    std::vector<std::shared_ptr<INode>> Draining;
+    // nodes that can't report Sends, drained on every pass
+    std::vector<std::shared_ptr<INode>> Untracked;
+    bool FlushScheduled = false;
+
+    std::vector<std::shared_ptr<IReactor>> Reactors;
+    std::unordered_map<uint64_t, std::shared_ptr<INode>> ReactorClients;
+    std::shared_ptr<TLocalListener> LocalListener;
+    std::shared_ptr<TApplier> Applier;
+
+    std::shared_ptr<TMetrics> Metrics;
+    // indexed by EMessageType, the last one counts unknown types
+    static constexpr size_t MessageTypes = MessageTypeCount;
+    std::array<TCounter*, MessageTypes + 1> ReceivedMessages = {};
+    TCounter* ReceivedBytes = nullptr;
+    THistogram* ProcessLatency = nullptr;
+    THistogram* FlushLatency = nullptr;
+    TCounter* Fsyncs = nullptr;
+    THistogram* FsyncLatency = nullptr;
+    ITimeSource::Time FlushRequested;
+
+    enum ETimer : uint64_t {
+        ERaftTimeout = 1,
+        EDebugPrint = 2,
+    };
+    TTimerWheel Timers;
+    std::vector<uint64_t> Fired;
+    ITimeSource::Time SleepUntil = ITimeSource::Max; // deadline of the latest armed sleeper
+    ITimeSource::Time RaftDue = ITimeSource::Max;    // earliest ERaftTimeout in Timers
 };
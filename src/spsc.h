@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+#include <stddef.h>
+
+// Bounded lock-free single-producer/single-consumer ring.
+// Capacity is rounded up to a power of two.
+template<typename T>
+class TSpscQueue {
+public:
+    explicit TSpscQueue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        Buffer = std::make_unique<T[]>(size);
+        Mask = size - 1;
+    }
+
+    // producer side, false if the ring is full
+    bool Push(T value) {
+        auto tail = Tail.load(std::memory_order_relaxed);
+        if (tail - HeadCache > Mask) {
+            HeadCache = Head.load(std::memory_order_acquire);
+            if (tail - HeadCache > Mask) {
+                return false;
+            }
+        }
+        Buffer[tail & Mask] = std::move(value);
+        Tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side, false if the ring is empty
+    bool Pop(T& value) {
+        auto head = Head.load(std::memory_order_relaxed);
+        if (head == TailCache) {
+            TailCache = Tail.load(std::memory_order_acquire);
+            if (head == TailCache) {
+                return false;
+            }
+        }
+        value = std::move(Buffer[head & Mask]);
+        Head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Empty() const {
+        return Head.load(std::memory_order_acquire) == Tail.load(std::memory_order_acquire);
+    }
+
+    size_t Capacity() const {
+        return Mask + 1;
+    }
+
+private:
+    std::unique_ptr<T[]> Buffer;
+    size_t Mask;
+
+    alignas(64) std::atomic<size_t> Head = 0;
+    size_t TailCache = 0; // consumer's view of Tail
+    alignas(64) std::atomic<size_t> Tail = 0;
+    size_t HeadCache = 0; // producer's view of Head
+};
@@ -0,0 +1,100 @@
+#include <algorithm>
+
+#include "timerwheel.h"
+
+TTimerWheel::TTimerWheel(TTime origin)
+    : Origin(origin)
+{ }
+
+uint64_t TTimerWheel::ToTicks(TTime t) const {
+    if (t <= Origin) {
+        return 0;
+    }
+    return std::chrono::duration_cast<std::chrono::microseconds>(t - Origin) / Tick;
+}
+
+TTimerWheel::TTime TTimerWheel::FromTicks(uint64_t ticks) const {
+    return Origin + ticks * Tick;
+}
+
+void TTimerWheel::Schedule(TTime deadline, uint64_t id) {
+    Insert(TEntry{deadline, id});
+    Size++;
+}
+
+void TTimerWheel::Insert(TEntry entry) {
+    auto ticks = std::max(ToTicks(entry.Deadline), Current);
+    auto delta = ticks - Current;
+    int level = 0;
+    while (level < Levels - 1 && delta >= (uint64_t(1) << (SlotBits * (level + 1)))) {
+        level++;
+    }
+    if (level == Levels - 1 && delta >= (uint64_t(1) << (SlotBits * Levels))) {
+        // beyond the span: park in the farthest top-level slot, it is re-inserted on cascade
+        ticks = Current + (uint64_t(1) << (SlotBits * Levels)) - 1;
+    }
+    auto slot = (ticks >> (SlotBits * level)) & (Slots - 1);
+    Wheel[level][slot].emplace_back(entry);
+}
+
+void TTimerWheel::Cascade(int level) {
+    auto slot = (Current >> (SlotBits * level)) & (Slots - 1);
+    Spare.clear();
+    std::swap(Spare, Wheel[level][slot]);
+    for (auto& entry : Spare) {
+        Insert(entry);
+    }
+    if (slot == 0 && level + 1 < Levels) {
+        Cascade(level + 1);
+    }
+}
+
+void TTimerWheel::Expire(TSlot& slot, TTime now, std::vector<uint64_t>& fired) {
+    // the slot covers a whole tick: keep entries whose exact deadline is still ahead
+    auto it = std::partition(slot.begin(), slot.end(), [&](const TEntry& e) {
+        return e.Deadline > now;
+    });
+    for (auto i = it; i != slot.end(); ++i) {
+        fired.push_back(i->Id);
+    }
+    Size -= slot.end() - it;
+    slot.erase(it, slot.end());
+}
+
+void TTimerWheel::Advance(TTime now, std::vector<uint64_t>& fired) {
+    auto target = ToTicks(now);
+    Expire(Wheel[0][Current & (Slots - 1)], now, fired);
+    while (Current < target) {
+        if (Size == 0) {
+            Current = target;
+            break;
+        }
+        Current++;
+        if ((Current & (Slots - 1)) == 0) {
+            Cascade(1);
+        }
+        Expire(Wheel[0][Current & (Slots - 1)], now, fired);
+    }
+}
+
+TTimerWheel::TTime TTimerWheel::NextExpiry() const {
+    // within a level slots are ordered by time, so the first non-empty one
+    // holds the level's earliest deadline. Levels overlap: a higher level may
+    // hold an earlier deadline than a lower one, so all of them are checked
+    auto next = ITimeSource::Max;
+    for (int level = 0; level < Levels; level++) {
+        auto current = (Current >> (SlotBits * level)) & (Slots - 1);
+        // above level 0 the current slot was already cascaded, an entry there is a full turn ahead
+        int first = level == 0 ? 0 : 1;
+        for (int i = first; i <= Slots - 1 + first; i++) {
+            auto& slot = Wheel[level][(current + i) & (Slots - 1)];
+            if (!slot.empty()) {
+                for (auto& entry : slot) {
+                    next = std::min(next, entry.Deadline);
+                }
+                break;
+            }
+        }
+    }
+    return next;
+}
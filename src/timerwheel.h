@@ -0,0 +1,58 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <vector>
+
+#include <stdint.h>
+
+#include "timesource.h"
+
+// Hierarchical timer wheel: 4 levels of 64 slots over 100us ticks (~28 min span,
+// later deadlines wait in the top level). Entries keep their exact deadline and
+// fire at the first Advance() at or after it.
+class TTimerWheel {
+public:
+    using TTime = ITimeSource::Time;
+    static constexpr std::chrono::microseconds Tick{100};
+
+    explicit TTimerWheel(TTime origin);
+
+    void Schedule(TTime deadline, uint64_t id);
+    // moves time forward, appends ids of expired timers to fired
+    void Advance(TTime now, std::vector<uint64_t>& fired);
+    // exact deadline of the earliest timer, ITimeSource::Max if empty
+    TTime NextExpiry() const;
+
+    bool Empty() const {
+        return Size == 0;
+    }
+
+    size_t Count() const {
+        return Size;
+    }
+
+private:
+    static constexpr int Levels = 4;
+    static constexpr int SlotBits = 6;
+    static constexpr int Slots = 1 << SlotBits;
+
+    struct TEntry {
+        TTime Deadline;
+        uint64_t Id;
+    };
+
+    using TSlot = std::vector<TEntry>;
+
+    uint64_t ToTicks(TTime t) const;
+    TTime FromTicks(uint64_t ticks) const;
+    void Insert(TEntry entry);
+    void Cascade(int level);
+    void Expire(TSlot& slot, TTime now, std::vector<uint64_t>& fired);
+
+    TTime Origin;
+    uint64_t Current = 0;
+    size_t Size = 0;
+    std::array<std::array<TSlot, Slots>, Levels> Wheel;
+    TSlot Spare;
+};
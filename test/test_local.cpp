@@ -0,0 +1,214 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <local.h>
+#include <coroio/all.hpp>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+namespace {
+
+// ring over zero filled process memory, as a fresh memfd would be
+class TRingBuffer {
+public:
+    explicit TRingBuffer(size_t capacity)
+        : Memory(static_cast<char*>(aligned_alloc(64, TShmRing::RegionSize(capacity))))
+    {
+        memset(Memory.get(), 0, TShmRing::RegionSize(capacity));
+        Ring = TShmRing(Memory.get(), capacity);
+    }
+
+    TShmRing Ring;
+
+    TShmRing::THeader* Header() {
+        return reinterpret_cast<TShmRing::THeader*>(Memory.get());
+    }
+
+private:
+    struct TFree {
+        void operator()(char* p) const {
+            free(p);
+        }
+    };
+    std::unique_ptr<char, TFree> Memory;
+};
+
+std::vector<char> Pattern(size_t size, char first) {
+    std::vector<char> data(size);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = static_cast<char>(first + i);
+    }
+    return data;
+}
+
+} // namespace
+
+void test_ring_wraparound(void**) {
+    TRingBuffer buffer(64);
+    auto& ring = buffer.Ring;
+    std::vector<char> out(64);
+
+    auto first = Pattern(40, 'a');
+    assert_int_equal(ring.Write(first.data(), first.size()), 40);
+    assert_int_equal(ring.Read(out.data(), out.size()), 40);
+    assert_memory_equal(out.data(), first.data(), 40);
+
+    // starts at offset 40, the last 26 bytes go to the front of the buffer
+    auto second = Pattern(50, 'A');
+    assert_int_equal(ring.Write(second.data(), second.size()), 50);
+    assert_int_equal(ring.Read(out.data(), 30), 30);
+    assert_int_equal(ring.Read(out.data() + 30, out.size() - 30), 20);
+    assert_memory_equal(out.data(), second.data(), 50);
+}
+
+void test_ring_partial(void**) {
+    TRingBuffer buffer(64);
+    auto& ring = buffer.Ring;
+    auto data = Pattern(100, 0);
+    std::vector<char> out(200);
+
+    assert_int_equal(ring.Read(out.data(), out.size()), 0);
+    // only what fits is copied
+    assert_int_equal(ring.Write(data.data(), data.size()), 64);
+    assert_int_equal(ring.Write(data.data(), data.size()), 0);
+    assert_int_equal(ring.Read(out.data(), 10), 10);
+    assert_int_equal(ring.Write(data.data() + 64, 20), 10);
+    // only what is there is read
+    assert_int_equal(ring.Read(out.data() + 10, out.size()), 64);
+    assert_memory_equal(out.data(), data.data(), 74);
+    assert_int_equal(ring.Read(out.data(), out.size()), 0);
+}
+
+void test_ring_waiting(void**) {
+    TRingBuffer buffer(64);
+    auto& ring = buffer.Ring;
+
+    // a flag is taken once, by the side that signals
+    assert_false(ring.TakeWaiting());
+    ring.SetWaiting(true);
+    assert_true(ring.TakeWaiting());
+    assert_false(ring.TakeWaiting());
+
+    assert_false(ring.TakeWriterWaiting());
+    ring.SetWriterWaiting(true);
+    ring.SetWaiting(true);
+    assert_true(ring.TakeWriterWaiting());
+    assert_false(ring.TakeWriterWaiting());
+    assert_true(ring.TakeWaiting());
+
+    assert_false(ring.Closed());
+    ring.Close();
+    assert_true(ring.Closed());
+}
+
+void test_ring_corrupt_indices(void**) {
+    auto data = Pattern(16, 0);
+    std::vector<char> out(64);
+
+    // the peer claims more than the ring holds
+    TRingBuffer reader(64);
+    reader.Header()->Tail = 1000;
+    assert_int_equal(reader.Ring.Read(out.data(), out.size()), 0);
+    assert_true(reader.Ring.Closed());
+    // and the ring stays closed whatever the peer writes afterwards
+    reader.Header()->Tail = 0;
+    assert_int_equal(reader.Ring.Read(out.data(), out.size()), 0);
+    assert_true(reader.Ring.Closed());
+
+    // Head past Tail
+    TRingBuffer writer(64);
+    writer.Header()->Head = 10;
+    assert_int_equal(writer.Ring.Write(data.data(), data.size()), 0);
+    assert_true(writer.Ring.Closed());
+}
+
+void test_local_socket_dir(void**) {
+    auto dir = "/tmp/test-local-dir-" + std::to_string(getpid());
+    setenv("RABIA_LOCAL_DIR", dir.c_str(), 1);
+    // created private
+    assert_string_equal(LocalSocketPath(8001).c_str(), (dir + "/8001.sock").c_str());
+    struct stat st;
+    assert_int_equal(stat(dir.c_str(), &st), 0);
+    assert_int_equal(st.st_mode & 0777, 0700);
+    assert_true(FindLocalSocket("127.0.0.1", 8001).empty());
+    {
+        TLocalListener listener(LocalSocketPath(8001));
+        assert_int_equal(stat(LocalSocketPath(8001).c_str(), &st), 0);
+        assert_int_equal(st.st_mode & 0777, 0600);
+        assert_string_equal(FindLocalSocket("127.0.0.1", 8001).c_str(), (dir + "/8001.sock").c_str());
+    }
+
+    // a directory others can write to is refused
+    chmod(dir.c_str(), 0777);
+    assert_true(LocalSocketPath(8001).empty());
+    assert_true(FindLocalSocket("127.0.0.1", 8001).empty());
+    rmdir(dir.c_str());
+    unsetenv("RABIA_LOCAL_DIR");
+}
+
+void test_local_socket_full_ring(void**) {
+    auto path = "/tmp/test-local-" + std::to_string(getpid()) + ".sock";
+    TLocalListener listener(path);
+    std::shared_ptr<TLocalChannel> clientChannel;
+    std::thread client([&]() {
+        clientChannel = TLocalChannel::Open(path);
+    });
+    std::shared_ptr<TLocalChannel> serverChannel;
+    while (!(serverChannel = listener.Accept())) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    client.join();
+
+    NNet::TLoop<NNet::TPoll> loop;
+    TLocalSocket writer(clientChannel, &loop.Poller());
+    TLocalSocket reader(serverChannel, &loop.Poller());
+
+    // four times the ring: the writer has to sleep until the reader frees space
+    auto data = Pattern(4 * TLocalChannel::DefaultCapacity, 0);
+    std::vector<char> received(data.size());
+    NNet::TVoidSuspendedTask h1 = [](TLocalSocket& socket, std::vector<char>& data) -> NNet::TVoidSuspendedTask {
+        co_await NNet::TByteWriter(socket).Write(data.data(), data.size());
+        co_return;
+    }(writer, data);
+    NNet::TVoidSuspendedTask h2 = [](TLocalSocket& socket, std::vector<char>& received) -> NNet::TVoidSuspendedTask {
+        size_t offset = 0;
+        while (offset < received.size()) {
+            // small reads, so the writer finds the ring full
+            auto n = co_await socket.ReadSome(received.data() + offset, std::min<size_t>(4096, received.size() - offset));
+            assert_true(n > 0);
+            offset += n;
+        }
+        co_return;
+    }(reader, received);
+    while (!(h1.done() && h2.done())) {
+        loop.Step();
+    }
+    assert_memory_equal(received.data(), data.data(), data.size());
+
+    h1.destroy(); h2.destroy();
+}
+
+int main() {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_ring_wraparound),
+        cmocka_unit_test(test_ring_partial),
+        cmocka_unit_test(test_ring_waiting),
+        cmocka_unit_test(test_ring_corrupt_indices),
+        cmocka_unit_test(test_local_socket_dir),
+        cmocka_unit_test(test_local_socket_full_ring),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,213 @@
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <log.h>
+#include <messages.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+namespace {
+
+std::string TempDir(const char* name) {
+    auto dir = std::filesystem::temp_directory_path() / (std::string(name) + "-" + std::to_string(getpid()));
+    std::filesystem::remove_all(dir);
+    return dir.string();
+}
+
+TMessageHolder<TCmdReq> MakeEntry(uint64_t term, size_t size) {
+    auto entry = NewHoldedMessage<TCmdReq>(sizeof(TCmdReq) + size);
+    entry->Term = term;
+    memset(entry->Data, 'a' + term % 26, size);
+    return entry;
+}
+
+} // namespace
+
+void test_append_read(void**) {
+    auto dir = TempDir("test_log_append");
+    // small segments and two mappings, so reads cross segments and remap
+    TSegmentedLog log(dir, 4096, 2);
+    for (uint64_t i = 1; i <= 1000; i++) {
+        log.Append(MakeEntry(i / 100 + 1, i % 37));
+    }
+    assert_int_equal(log.Size(), 1000);
+    for (uint64_t i = 1; i <= 1000; i++) {
+        assert_int_equal(log.Term(i), i / 100 + 1);
+        auto entry = log.Get(i);
+        assert_int_equal(entry->Len, sizeof(TCmdReq) + i % 37);
+        assert_int_equal(entry->Term, i / 100 + 1);
+    }
+    assert_int_equal(log.Term(0), 0);
+    assert_int_equal(log.Term(1001), 0);
+    std::filesystem::remove_all(dir);
+}
+
+void test_truncate_recover(void**) {
+    auto dir = TempDir("test_log_truncate");
+    {
+        TSegmentedLog log(dir, 4096, 2);
+        for (uint64_t i = 1; i <= 1000; i++) {
+            log.Append(MakeEntry(i / 100 + 1, i % 37));
+        }
+        assert_int_equal(log.Synced(), 0);
+        log.Sync();
+        assert_int_equal(log.Synced(), 1000);
+        log.Truncate(550);
+        assert_int_equal(log.Size(), 550);
+        assert_int_equal(log.Synced(), 550);
+        assert_int_equal(log.Term(550), 6);
+        assert_int_equal(log.Term(551), 0);
+        for (uint64_t i = 551; i <= 600; i++) {
+            log.Append(MakeEntry(9, 5));
+        }
+        log.Sync();
+    }
+    {
+        // stale bytes after the cut must not come back
+        TSegmentedLog log(dir, 4096, 2);
+        assert_int_equal(log.Size(), 600);
+        assert_int_equal(log.Synced(), 600);
+        assert_int_equal(log.Term(550), 6);
+        assert_int_equal(log.Term(551), 9);
+        assert_int_equal(log.Term(600), 9);
+        log.Truncate(0);
+        assert_int_equal(log.Size(), 0);
+        // larger than a segment
+        log.Append(MakeEntry(3, 10000));
+        log.Append(MakeEntry(3, 1));
+        log.Sync();
+    }
+    {
+        TSegmentedLog log(dir, 4096, 2);
+        assert_int_equal(log.Size(), 2);
+        assert_int_equal(log.Get(1)->Len, sizeof(TCmdReq) + 10000);
+        assert_int_equal(log.Term(2), 3);
+    }
+    std::filesystem::remove_all(dir);
+}
+
+void test_meta(void**) {
+    auto dir = TempDir("test_log_meta");
+    {
+        TSegmentedLog log(dir, 4096, 2);
+        assert_int_equal(log.Meta().Term, 0);
+        assert_false(log.Sync());
+        log.SetMeta({.Term = 7, .VotedFor = 2});
+        log.Append(MakeEntry(7, 10));
+        assert_true(log.Sync());
+        // unchanged meta and no appends: nothing to write
+        log.SetMeta({.Term = 7, .VotedFor = 2});
+        assert_false(log.Sync());
+        // not synced, must not survive
+        log.SetMeta({.Term = 8, .VotedFor = 3});
+    }
+    {
+        TSegmentedLog log(dir, 4096, 2);
+        assert_int_equal(log.Meta().Term, 7);
+        assert_int_equal(log.Meta().VotedFor, 2);
+        assert_int_equal(log.Size(), 1);
+    }
+    std::filesystem::remove_all(dir);
+}
+
+void test_compact_snapshot(void**) {
+    auto dir = TempDir("test_log_compact");
+    {
+        TSegmentedLog log(dir, 4096, 2);
+        for (uint64_t i = 1; i <= 1000; i++) {
+            log.Append(MakeEntry(1, 20));
+        }
+        log.SaveSnapshot(600, 1, std::vector<char>(100, 's'));
+        log.Compact(600);
+        // whole segments only, entries just before the snapshot may stay
+        assert_int_equal(log.Size(), 1000);
+        assert_int_equal(log.Term(1), 0);
+        assert_int_equal(log.Term(601), 1);
+        log.Sync();
+    }
+    {
+        TSegmentedLog log(dir, 4096, 2);
+        assert_int_equal(log.Size(), 1000);
+        assert_int_equal(log.Term(601), 1);
+        auto snapshot = log.LoadSnapshot();
+        assert_true(snapshot);
+        assert_int_equal(snapshot->Index, 600);
+        assert_int_equal(snapshot->Data.size(), 100);
+        // a snapshot past the end empties the log
+        log.Compact(5000);
+        assert_int_equal(log.Size(), 5000);
+        log.Append(MakeEntry(2, 1));
+        log.Sync();
+    }
+    {
+        TSegmentedLog log(dir, 4096, 2);
+        assert_int_equal(log.Size(), 5001);
+        assert_int_equal(log.Term(5001), 2);
+        assert_int_equal(log.Term(5000), 0);
+    }
+    std::filesystem::remove_all(dir);
+}
+
+void test_torn_append(void**) {
+    auto dir = TempDir("test_log_torn");
+    // 8 byte record header before each entry
+    const uint64_t stride = 8 + ((sizeof(TCmdReq) + 16 + 7) & ~7ULL);
+    {
+        TSegmentedLog log(dir, 4096, 2);
+        for (uint64_t i = 1; i <= 200; i++) {
+            log.Append(MakeEntry(1, 16));
+        }
+        log.Sync();
+    }
+    auto segments = [&]() {
+        int count = 0;
+        for (const auto& file : std::filesystem::directory_iterator(dir)) {
+            count += file.path().extension() == ".seg";
+        }
+        return count;
+    };
+    assert_true(segments() > 1);
+    {
+        // the header of entry 30 reached the disk, its payload did not
+        auto path = std::filesystem::path(dir) / "log-00000000000000000001.seg";
+        int fd = open(path.c_str(), O_WRONLY);
+        char garbage = 'z';
+        assert_int_equal(pwrite(fd, &garbage, 1, 29 * stride + stride - 9), 1);
+        close(fd);
+    }
+    {
+        TSegmentedLog log(dir, 4096, 2);
+        assert_int_equal(log.Size(), 29);
+        assert_int_equal(log.Synced(), 29);
+        assert_int_equal(segments(), 1);
+        log.Append(MakeEntry(2, 16));
+        log.Sync();
+    }
+    {
+        TSegmentedLog log(dir, 4096, 2);
+        assert_int_equal(log.Size(), 30);
+        assert_int_equal(log.Term(30), 2);
+    }
+    std::filesystem::remove_all(dir);
+}
+
+int main() {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_append_read),
+        cmocka_unit_test(test_truncate_recover),
+        cmocka_unit_test(test_meta),
+        cmocka_unit_test(test_compact_snapshot),
+        cmocka_unit_test(test_torn_append),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,58 @@
+#include <chrono>
+#include <string>
+
+#include <metrics.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+using namespace std::chrono_literals;
+
+void test_counter_and_gauge(void**) {
+    TMetrics metrics;
+    metrics.Counter("rabia_messages_received_total", "Messages", "type=\"vote\"").Inc(3);
+    metrics.Counter("rabia_messages_received_total", "Messages", "type=\"vote\"").Inc();
+    metrics.Gauge("rabia_commit_index", "Commit").Set(42);
+    auto out = metrics.Render();
+    assert_true(out.find("# TYPE rabia_messages_received_total counter\n") != std::string::npos);
+    assert_true(out.find("rabia_messages_received_total{type=\"vote\"} 4\n") != std::string::npos);
+    assert_true(out.find("rabia_commit_index 42\n") != std::string::npos);
+}
+
+void test_scrape_collector(void**) {
+    TMetrics metrics;
+    int value = 1;
+    metrics.OnScrape([&]() {
+        metrics.Gauge("rabia_outbox_bytes", "Outbox", "peer=\"2\"").Set(value);
+    });
+    assert_true(metrics.Render().find("rabia_outbox_bytes{peer=\"2\"} 1\n") != std::string::npos);
+    value = 7;
+    assert_true(metrics.Render().find("rabia_outbox_bytes{peer=\"2\"} 7\n") != std::string::npos);
+}
+
+void test_histogram(void**) {
+    TMetrics metrics;
+    auto& h = metrics.Histogram("rabia_stage_seconds", "Stage", "stage=\"process\"");
+    h.Observe(30us);
+    h.Observe(3ms);
+    h.Observe(5s);
+    auto out = metrics.Render();
+    assert_true(out.find("rabia_stage_seconds_bucket{stage=\"process\",le=\"0.000025\"} 0\n") != std::string::npos);
+    assert_true(out.find("rabia_stage_seconds_bucket{stage=\"process\",le=\"0.000050\"} 1\n") != std::string::npos);
+    assert_true(out.find("rabia_stage_seconds_bucket{stage=\"process\",le=\"0.005000\"} 2\n") != std::string::npos);
+    assert_true(out.find("rabia_stage_seconds_bucket{stage=\"process\",le=\"+Inf\"} 3\n") != std::string::npos);
+    assert_true(out.find("rabia_stage_seconds_count{stage=\"process\"} 3\n") != std::string::npos);
+}
+
+int main() {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_counter_and_gauge),
+        cmocka_unit_test(test_scrape_collector),
+        cmocka_unit_test(test_histogram),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -1,15 +1,20 @@
 #include <chrono>
 #include <coroutine>
 #include <cstdint>
+#include <filesystem>
 #include <iostream>
 #include <memory>
 #include <functional>
 
+#include <applier.h>
+#include <log.h>
 #include <messages.h>
 #include <raft.h>
 #include <timesource.h>
 #include <coroio/all.hpp>
 
+#include <poll.h>
+#include <unistd.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <setjmp.h>
@@ -99,6 +104,26 @@ void assert_terms(const std::vector<TMessageHolder<TCmdReq>>& log, const std::ve
     }
 }
 
+TMessageHolder<TInstallSnapshotRequest> MakeSnapshotChunk(
+    const std::vector<char>& data, uint64_t offset, uint64_t size, uint64_t index, uint64_t term)
+{
+    auto mes = NewHoldedMessage<TInstallSnapshotRequest>(sizeof(TInstallSnapshotRequest) + size);
+    mes->Src = 2;
+    mes->Dst = 1;
+    mes->Term = 1;
+    mes->LastIncludedIndex = index;
+    mes->LastIncludedTerm = term;
+    mes->Offset = offset;
+    mes->LeaderId = 2;
+    mes->Done = offset + size == data.size();
+    memcpy(mes->Data, data.data() + offset, size);
+    return mes;
+}
+
+const TPeerState& Peer(const std::shared_ptr<TRaft>& raft, uint32_t id) {
+    return raft->GetVolatileState()->Peers.at(raft->Ordinal(id));
+}
+
 template<typename T>
 void assert_message_equal(TMessageHolder<TMessage> m1, const T& m2) {
     auto mm = m1.Maybe<T>();
@@ -217,6 +242,32 @@ void test_numbers(void**) {
     assert_int_equal(raft->GetNpeers(), 9);
 }
 
+void test_sparse_peer_ids(void**) {
+    TNodeDict nodes;
+    nodes[4000000000] = std::make_shared<TFakeNode>();
+    nodes[7] = std::make_shared<TFakeNode>();
+    auto raft = std::make_shared<TRaft>(std::make_shared<TDummyRsm>(), 1, nodes);
+    assert_int_equal(raft->Ordinal(7), 0);
+    assert_int_equal(raft->Ordinal(4000000000), 1);
+    assert_int_equal(raft->Ordinal(8), -1);
+    assert_int_equal(raft->Ordinal(4000000001), -1);
+
+    // replies from the large id land in its own slot
+    auto ts = std::make_shared<TFakeTimeSource>();
+    raft->SetState(TState{
+        .CurrentTerm = 1,
+        .Log = MakeLog<TCmdReq>({1})
+    });
+    raft->Become(EState::LEADER);
+    raft->ProcessTimeout(ts->Now());
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 4000000000, .Dst = 1, .Term = 1},
+        TAppendEntriesResponse {.MatchIndex = 1, .Success = true}));
+    assert_int_equal(Peer(raft, 4000000000).Id, 4000000000);
+    assert_int_equal(Peer(raft, 4000000000).MatchIndex, 1);
+    assert_int_equal(Peer(raft, 7).MatchIndex, 0);
+}
+
 void test_become(void**) {
     auto raft = MakeRaft();
     assert_true(raft->CurrentStateName() == EState::FOLLOWER);
@@ -407,6 +458,88 @@ void test_follower_append_entries_7f(void**) {
     assert_terms(raft->GetState()->Log, {1,1,1,4,4,5,5,6,6,6});
 }
 
+void test_follower_append_entries_conflict_hint(void**) {
+    std::vector<TMessageHolder<TMessage>> messages;
+    auto onSend = [&](const TMessageHolder<TMessage>& message) {
+        messages.push_back(message);
+    };
+    auto ts = std::make_shared<TFakeTimeSource>();
+    auto raft = MakeRaft(onSend, 3);
+    raft->SetState(TState{
+        .CurrentTerm = 4,
+        .Log = MakeLog<TCmdReq>({1,1,1,2,2,2,3,3})
+    });
+    auto probe = [&](uint64_t prevIndex, uint64_t prevTerm) {
+        raft->Process(ts->Now(), NewHoldedMessage(
+            TMessage {.Src = 2, .Dst = 1, .Term = 4},
+            TAppendEntriesRequest {.PrevLogIndex = prevIndex, .PrevLogTerm = prevTerm, .LeaderId = 2}));
+        auto maybeConflict = messages.back().Maybe<TAppendEntriesConflict>();
+        assert_true(maybeConflict);
+        return maybeConflict.Cast();
+    };
+
+    // the whole run of term 2 is reported
+    auto conflict = probe(5, 4);
+    assert_int_equal(conflict->ConflictTerm, 2);
+    assert_int_equal(conflict->ConflictIndex, 4);
+    conflict = probe(8, 4);
+    assert_int_equal(conflict->ConflictTerm, 3);
+    assert_int_equal(conflict->ConflictIndex, 7);
+    // past the end of the log
+    conflict = probe(20, 4);
+    assert_int_equal(conflict->ConflictTerm, 0);
+    assert_int_equal(conflict->ConflictIndex, 9);
+}
+
+void test_leader_repairs_diverged_follower(void**) {
+    std::vector<TMessageHolder<TMessage>> toFollower, toLeader;
+    auto leader = MakeRaft([&](const TMessageHolder<TMessage>& message) {
+        if (message->Dst == 2) {
+            toFollower.push_back(message);
+        }
+    }, 3);
+    TNodeDict nodes;
+    nodes[1] = std::make_shared<TFakeNode>([&](const TMessageHolder<TMessage>& message) {
+        toLeader.push_back(message);
+    });
+    nodes[3] = std::make_shared<TFakeNode>();
+    auto follower = std::make_shared<TRaft>(std::make_shared<TDummyRsm>(), 2, nodes);
+
+    std::vector<uint64_t> leaderTerms(1000, 1), followerTerms(1000, 1);
+    leaderTerms.insert(leaderTerms.end(), 2000, 3);
+    followerTerms.insert(followerTerms.end(), 3000, 2);
+    leader->SetState(TState{.CurrentTerm = 3, .Log = MakeLog<TCmdReq>(leaderTerms)});
+    follower->SetState(TState{.CurrentTerm = 3, .Log = MakeLog<TCmdReq>(followerTerms)});
+
+    // elected by node 3, the leader starts probing at the end of its log
+    auto ts = std::make_shared<TFakeTimeSource>();
+    ts->Advance(TTimeout::Election * 3);
+    leader->ProcessTimeout(ts->Now());
+    leader->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 3, .Dst = 1, .Term = 4},
+        TRequestVoteResponse {.VoteGranted = true}));
+    toFollower.clear();
+    int roundTrips = 0;
+    // the log ends with the no-op of the new term
+    while (Peer(leader, 2).MatchIndex < 3001) {
+        assert_true(roundTrips++ < 10);
+        leader->ProcessTimeout(ts->Now());
+        for (auto& m : toFollower) {
+            follower->Process(ts->Now(), m);
+        }
+        toFollower.clear();
+        for (auto& m : toLeader) {
+            leader->Process(ts->Now(), m);
+        }
+        toLeader.clear();
+    }
+    // one round to learn the conflicting term, one probe, one batch
+    assert_int_equal(roundTrips, 3);
+    assert_int_equal(follower->GetState()->LogSize(), 3001);
+    assert_int_equal(follower->GetState()->LogTerm(3000), 3);
+    assert_int_equal(follower->GetState()->LogTerm(3001), 4);
+}
+
 void test_follower_append_entries_empty_to_empty_log(void**) {
     std::vector<TMessageHolder<TMessage>> messages;
     auto onSend = [&](auto message) {
@@ -617,7 +750,7 @@ void test_commit_advance(void**) {
     };
 
     auto s = TVolatileState {
-        .MatchIndex = {{1, 1}}
+        .Peers = {{.Id = 2, .MatchIndex = 1}}
     };
 
     auto s1 = TVolatileState(s).CommitAdvance(3, state);
@@ -626,7 +759,7 @@ void test_commit_advance(void**) {
     assert_int_equal(s1.CommitIndex, 0);
 
     s = TVolatileState {
-        .MatchIndex = {{1, 1}, {2, 2}}
+        .Peers = {{.Id = 2, .MatchIndex = 1}, {.Id = 3, .MatchIndex = 2}}
     };
     auto add = MakeLog<TCmdReq>({1});
     state.Log.insert(state.Log.end(), add.begin(), add.end());
@@ -642,12 +775,48 @@ void test_commit_advance_wrong_term(void**) {
         .Log = MakeLog<TCmdReq>({1,1})
     };
     auto s = TVolatileState {
-        .MatchIndex = {{1, 1}, {2, 2}}
+        .Peers = {{.Id = 2, .MatchIndex = 1}, {.Id = 3, .MatchIndex = 2}}
     };
     auto s1 = TVolatileState(s).CommitAdvance(3, state);
     assert_int_equal(s1.CommitIndex, 0);
 }
 
+void test_commit_advance_even(void**) {
+    auto state = TState {
+        .CurrentTerm = 1,
+        .Log = MakeLog<TCmdReq>({1,1,1})
+    };
+    // 4 servers need 3 of them, the leader and two peers
+    auto s = TVolatileState {
+        .Peers = {{.Id = 2, .MatchIndex = 3}, {.Id = 3, .MatchIndex = 1}, {.Id = 4, .MatchIndex = 0}}
+    };
+    auto s1 = TVolatileState(s).CommitAdvance(4, state);
+    assert_int_equal(s1.CommitIndex, 1);
+}
+
+void test_commit_advance_incremental(void**) {
+    auto state = TState {
+        .CurrentTerm = 1,
+        .Log = MakeLog<TCmdReq>(std::vector<uint64_t>(1000, 1))
+    };
+    uint32_t seed = 1;
+    for (int nservers : {3, 5, 7, 9}) {
+        TVolatileState s;
+        s.Peers.resize(nservers - 1);
+        std::vector<uint64_t> match(nservers - 1);
+        for (int i = 0; i < 10000; i++) {
+            seed = seed * 1103515245 + 12345;
+            auto peer = (seed >> 16) % match.size();
+            match[peer] = std::min<uint64_t>(1000, match[peer] + (seed >> 8) % 4);
+            s.SetMatchIndex(peer, match[peer]).CommitAdvance(nservers, state);
+
+            auto sorted = match;
+            std::sort(sorted.begin(), sorted.end(), std::greater<>());
+            assert_int_equal(s.CommitIndex, sorted[nservers / 2 - 1]);
+        }
+    }
+}
+
 void test_leader_heartbeat(void**) {
     std::vector<TMessageHolder<TMessage>> messages;
     auto onSend = [&](auto message) {
@@ -672,6 +841,990 @@ void test_leader_heartbeat(void**) {
     assert_int_equal(req1->Nentries, 0);
 }
 
+void test_state_compact(void**) {
+    auto state = TState {
+        .CurrentTerm = 3,
+        .Log = MakeLog<TCmdReq>({1,1,2,2,3})
+    };
+    state.Compact(3, 2);
+    assert_int_equal(state.LogSize(), 5);
+    assert_int_equal(state.Log.size(), 2);
+    assert_int_equal(state.LogTerm(), 3);
+    assert_int_equal(state.LogTerm(3), 2);
+    assert_int_equal(state.LogTerm(2), 0);
+    assert_int_equal(state.LogEntry(4)->Term, 2);
+    state.Truncate(4);
+    assert_int_equal(state.LogSize(), 4);
+    // past the end
+    state.Compact(10, 4);
+    assert_int_equal(state.LogSize(), 10);
+    assert_int_equal(state.LogTerm(), 4);
+    assert_true(state.Log.empty());
+}
+
+void test_follower_install_snapshot(void**) {
+    std::vector<TMessageHolder<TMessage>> messages;
+    auto onSend = [&](const TMessageHolder<TMessage>& message) {
+        messages.push_back(message);
+    };
+    auto ts = std::make_shared<TFakeTimeSource>();
+    auto raft = MakeRaft(onSend, 3);
+    raft->SetState(TState{
+        .CurrentTerm = 1,
+        .Log = MakeLog<TCmdReq>({1,1})
+    });
+
+    TDummyRsm leaderRsm;
+    for (uint64_t i = 1; i <= 100; i++) {
+        auto entry = NewHoldedMessage<TCmdReq>(sizeof(TCmdReq) + 8);
+        entry->Term = 1;
+        memcpy(entry->Data, &i, sizeof(i));
+        leaderRsm.Write(entry, i);
+    }
+    auto data = leaderRsm.Snapshot();
+    auto half = data.size() / 2;
+
+    raft->Process(ts->Now(), MakeSnapshotChunk(data, 0, half, 100, 1));
+    assert_int_equal(messages.size(), 1);
+    auto reply = messages.back().Cast<TInstallSnapshotResponse>();
+    assert_true(messages.back().Maybe<TInstallSnapshotResponse>());
+    assert_int_equal(reply->Offset, half);
+    assert_false(reply->Done);
+
+    // offset 0 restarts the transfer, a chunk past what is held is
+    // answered with the offset to resend from
+    raft->Process(ts->Now(), MakeSnapshotChunk(data, 0, half - 1, 100, 1));
+    raft->Process(ts->Now(), MakeSnapshotChunk(data, half, data.size() - half, 100, 1));
+    assert_int_equal(messages.size(), 3);
+    assert_int_equal(messages[2].Cast<TInstallSnapshotResponse>()->Offset, half - 1);
+    assert_false(messages[2].Cast<TInstallSnapshotResponse>()->Done);
+    assert_int_equal(raft->GetState()->SnapshotIndex, 0);
+
+    raft->Process(ts->Now(), MakeSnapshotChunk(data, 0, half, 100, 1));
+    raft->Process(ts->Now(), MakeSnapshotChunk(data, half, data.size() - half, 100, 1));
+    assert_int_equal(messages.size(), 5);
+    reply = messages.back().Cast<TInstallSnapshotResponse>();
+    assert_true(reply->Done);
+    assert_int_equal(reply->Offset, data.size());
+    assert_int_equal(raft->GetState()->SnapshotIndex, 100);
+    assert_int_equal(raft->GetState()->LogSize(), 100);
+    assert_int_equal(raft->GetState()->LogTerm(), 1);
+    assert_int_equal(raft->GetVolatileState()->CommitIndex, 100);
+    assert_int_equal(raft->GetVolatileState()->LastApplied, 100);
+
+    // the log continues after the snapshot
+    auto mes = NewHoldedMessage(TMessage {
+        .Src = 2,
+        .Dst = 1,
+        .Term = 1,
+    }, TAppendEntriesRequest {
+        .PrevLogIndex = 100,
+        .PrevLogTerm = 1,
+        .LeaderCommit = 101,
+        .LeaderId = 2,
+        .Nentries = 1,
+    });
+    SetPayload(mes, MakeLog({1}));
+    raft->Process(ts->Now(), mes);
+    auto appendReply = messages.back().Cast<TAppendEntriesResponse>();
+    assert_true(appendReply->Success);
+    assert_int_equal(appendReply->MatchIndex, 101);
+}
+
+void test_leader_sends_snapshot(void**) {
+    std::vector<TMessageHolder<TMessage>> messages;
+    auto onSend = [&](const TMessageHolder<TMessage>& message) {
+        messages.push_back(message);
+    };
+    auto ts = std::make_shared<TFakeTimeSource>();
+    auto raft = MakeRaft(onSend, 3);
+    raft->SetCompactThreshold(2);
+    raft->SetState(TState{
+        .CurrentTerm = 1,
+        .Log = MakeLog<TCmdReq>({1,1,1,1})
+    });
+    raft->Become(EState::LEADER);
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 1},
+        TAppendEntriesResponse {.MatchIndex = 4, .Success = true}));
+    assert_int_equal(raft->GetVolatileState()->CommitIndex, 4);
+    raft->ProcessTimeout(ts->Now());
+    // applied and compacted
+    assert_int_equal(raft->GetState()->SnapshotIndex, 4);
+    assert_true(raft->GetState()->Log.empty());
+
+    messages.clear();
+    ts->Advance(std::chrono::milliseconds(10000));
+    raft->ProcessTimeout(ts->Now());
+    TMessageHolder<TInstallSnapshotRequest> chunk;
+    for (auto& m : messages) {
+        if (m->Dst == 3) {
+            assert_true(m.Maybe<TInstallSnapshotRequest>());
+            chunk = m.Cast<TInstallSnapshotRequest>();
+        }
+    }
+    assert_true(chunk);
+    assert_int_equal(chunk->LastIncludedIndex, 4);
+    assert_int_equal(chunk->LastIncludedTerm, 1);
+    assert_int_equal(chunk->Offset, 0);
+    assert_true(chunk->Done);
+
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 3, .Dst = 1, .Term = 1},
+        TInstallSnapshotResponse {.LastIncludedIndex = 4, .Offset = chunk->Len - sizeof(TInstallSnapshotRequest), .Done = true}));
+    assert_int_equal(Peer(raft, 3).MatchIndex, 4);
+    assert_int_equal(Peer(raft, 3).NextIndex, 5);
+}
+
+void test_leader_pipelines_batches(void**) {
+    std::vector<TMessageHolder<TMessage>> messages;
+    auto onSend = [&](const TMessageHolder<TMessage>& message) {
+        if (message->Dst == 2) {
+            messages.push_back(message);
+        }
+    };
+    auto ts = std::make_shared<TFakeTimeSource>();
+    auto raft = MakeRaft(onSend, 3);
+    raft->SetMaxInFlight(2);
+    raft->SetState(TState{
+        .CurrentTerm = 1,
+        .Log = MakeLog<TCmdReq>(std::vector<uint64_t>(5000, 1))
+    });
+    raft->Become(EState::LEADER);
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(messages.size(), 1);
+    assert_int_equal(messages[0].Cast<TAppendEntriesRequest>()->Nentries, 1);
+
+    // the follower matches: the window fills without waiting for answers
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 1},
+        TAppendEntriesResponse {.MatchIndex = 1, .Success = true}));
+    messages.clear();
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(messages.size(), 2);
+    auto req0 = messages[0].Cast<TAppendEntriesRequest>();
+    auto req1 = messages[1].Cast<TAppendEntriesRequest>();
+    assert_int_equal(req0->PrevLogIndex, 1);
+    assert_int_equal(req0->Nentries, 1024);
+    assert_int_equal(req1->PrevLogIndex, 1025);
+    assert_int_equal(req1->Nentries, 1024);
+    assert_int_equal(Peer(raft, 2).NextIndex, 2050);
+
+    // an answer opens room for one more batch
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 1},
+        TAppendEntriesResponse {.MatchIndex = 1025, .Success = true}));
+    messages.clear();
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(messages.size(), 1);
+    assert_int_equal(messages[0].Cast<TAppendEntriesRequest>()->PrevLogIndex, 2049);
+
+    // a rejection voids everything past the last match
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 1},
+        TAppendEntriesResponse {.MatchIndex = 0, .Success = false}));
+    assert_int_equal(Peer(raft, 2).NextIndex, 1025);
+    assert_false(Peer(raft, 2).Pipelined);
+    messages.clear();
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(messages.size(), 1);
+}
+
+void test_leader_pipeline_resend_on_timeout(void**) {
+    std::vector<TMessageHolder<TMessage>> messages;
+    auto onSend = [&](const TMessageHolder<TMessage>& message) {
+        if (message->Dst == 2) {
+            messages.push_back(message);
+        }
+    };
+    auto ts = std::make_shared<TFakeTimeSource>();
+    auto raft = MakeRaft(onSend, 3);
+    raft->SetState(TState{
+        .CurrentTerm = 1,
+        .Log = MakeLog<TCmdReq>(std::vector<uint64_t>(100, 1))
+    });
+    raft->Become(EState::LEADER);
+    raft->ProcessTimeout(ts->Now());
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 1},
+        TAppendEntriesResponse {.MatchIndex = 1, .Success = true}));
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(Peer(raft, 2).NextIndex, 101);
+
+    // the batch got lost
+    messages.clear();
+    ts->Advance(TTimeout::Rpc + std::chrono::milliseconds(1));
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(messages.size(), 1);
+    auto req = messages[0].Cast<TAppendEntriesRequest>();
+    assert_int_equal(req->PrevLogIndex, 1);
+    assert_int_equal(req->Nentries, 99);
+}
+
+void test_leader_read_index(void**) {
+    std::vector<TMessageHolder<TMessage>> messages;
+    std::vector<TMessageHolder<TMessage>> replies;
+    auto onSend = [&](const TMessageHolder<TMessage>& message) {
+        messages.push_back(message);
+    };
+    auto client = std::make_shared<TFakeNode>([&](const TMessageHolder<TMessage>& message) {
+        replies.push_back(message);
+    });
+    auto ts = std::make_shared<TFakeTimeSource>();
+    auto raft = MakeRaft(onSend, 3);
+    raft->SetState(TState{
+        .CurrentTerm = 1,
+        .Log = MakeLog<TCmdReq>({1, 1})
+    });
+    raft->Become(EState::LEADER);
+    raft->ProcessTimeout(ts->Now());
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 1},
+        TAppendEntriesResponse {.MatchIndex = 2, .Success = true}));
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(raft->GetVolatileState()->LastApplied, 2);
+
+    // a write that cannot commit yet must not hold the read back
+    auto write = NewHoldedMessage<TCommandRequest>(sizeof(TCommandRequest) + 8);
+    write->Flags = TCommandRequest::EWrite;
+    raft->Process(ts->Now(), write, client);
+    auto read = NewHoldedMessage<TCommandRequest>(sizeof(TCommandRequest) + 8);
+    raft->Process(ts->Now(), read, client);
+    assert_int_equal(replies.size(), 0);
+
+    messages.clear();
+    raft->ProcessTimeout(ts->Now());
+    int rounds = 0;
+    for (const auto& m : messages) {
+        if (auto req = m.Maybe<TReadIndexRequest>()) {
+            assert_int_equal(req.Cast()->Seq, 1);
+            rounds++;
+        }
+    }
+    assert_int_equal(rounds, 2);
+    assert_int_equal(replies.size(), 0);
+
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 3, .Dst = 1, .Term = 1},
+        TReadIndexResponse {.Seq = 1}));
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(replies.size(), 1);
+    assert_int_equal(replies[0].Cast<TCommandResponse>()->Index, 2);
+}
+
+void test_leader_lease_read(void**) {
+    std::vector<TMessageHolder<TMessage>> messages;
+    int replies = 0;
+    auto onSend = [&](const TMessageHolder<TMessage>& message) {
+        messages.push_back(message);
+    };
+    auto client = std::make_shared<TFakeNode>([&](const TMessageHolder<TMessage>&) {
+        replies++;
+    });
+    auto countRounds = [&]() {
+        int rounds = 0;
+        for (const auto& m : messages) {
+            rounds += !!m.Maybe<TReadIndexRequest>();
+        }
+        messages.clear();
+        return rounds;
+    };
+    auto ts = std::make_shared<TFakeTimeSource>();
+    auto raft = MakeRaft(onSend, 3);
+    raft->SetLeaseReads(true);
+    raft->SetState(TState{
+        .CurrentTerm = 1,
+        .Log = MakeLog<TCmdReq>({1})
+    });
+    raft->Become(EState::LEADER);
+    raft->ProcessTimeout(ts->Now());
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 1},
+        TAppendEntriesResponse {.MatchIndex = 1, .Success = true}));
+    raft->ProcessTimeout(ts->Now());
+
+    auto read = NewHoldedMessage<TCommandRequest>(sizeof(TCommandRequest) + 8);
+    raft->Process(ts->Now(), read, client);
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(countRounds(), 2);
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 1},
+        TReadIndexResponse {.Seq = 1}));
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(replies, 1);
+
+    // within the lease no round is needed
+    ts->Advance(TTimeout::Election / 2);
+    raft->Process(ts->Now(), read, client);
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(replies, 2);
+    assert_int_equal(countRounds(), 0);
+
+    // once it ran out the read waits for a round again
+    ts->Advance(TTimeout::Election);
+    raft->Process(ts->Now(), read, client);
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(replies, 2);
+    assert_int_equal(countRounds(), 2);
+}
+
+void test_leader_reads_without_writes(void**) {
+    std::vector<TMessageHolder<TMessage>> replies;
+    auto client = std::make_shared<TFakeNode>([&](const TMessageHolder<TMessage>& message) {
+        replies.push_back(message);
+    });
+    auto ts = std::make_shared<TFakeTimeSource>();
+    auto raft = MakeRaft({}, 3);
+    raft->SetState(TState{
+        .CurrentTerm = 1,
+        .Log = MakeLog<TCmdReq>({1, 1})
+    });
+
+    // elected in term 2, the entries of term 1 cannot commit by themselves
+    ts->Advance(TTimeout::Election * 3);
+    raft->ProcessTimeout(ts->Now());
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 3, .Dst = 1, .Term = 2},
+        TRequestVoteResponse {.VoteGranted = true}));
+    raft->ProcessTimeout(ts->Now());
+    assert_true(raft->CurrentStateName() == EState::LEADER);
+    assert_int_equal(raft->GetState()->LogSize(), 3);
+    assert_int_equal(raft->GetState()->LogTerm(3), 2);
+
+    auto read = NewHoldedMessage<TCommandRequest>(sizeof(TCommandRequest) + 8);
+    raft->Process(ts->Now(), read, client);
+    raft->ProcessTimeout(ts->Now());
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 2},
+        TReadIndexResponse {.Seq = 1}));
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(replies.size(), 0);
+
+    // the no-op commits without a client write
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 2},
+        TAppendEntriesResponse {.MatchIndex = 3, .Success = true}));
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(raft->GetVolatileState()->CommitIndex, 3);
+    assert_int_equal(replies.size(), 1);
+    assert_int_equal(replies[0].Cast<TCommandResponse>()->Index, 3);
+}
+
+void test_follower_lease_ignores_votes(void**) {
+    std::vector<TMessageHolder<TMessage>> messages;
+    auto onSend = [&](const TMessageHolder<TMessage>& message) {
+        messages.push_back(message);
+    };
+    auto ts = std::make_shared<TFakeTimeSource>();
+    auto raft = MakeRaft(onSend, 3);
+    raft->SetLeaseReads(true);
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 1},
+        TAppendEntriesRequest {.PrevLogIndex = 0, .PrevLogTerm = 0, .LeaderCommit = 0, .LeaderId = 2, .Nentries = 0}));
+    messages.clear();
+
+    // the leader may still be serving lease reads
+    auto vote = NewHoldedMessage(
+        TMessage {.Src = 3, .Dst = 1, .Term = 2},
+        TRequestVoteRequest {.LastLogIndex = 0, .LastLogTerm = 0, .CandidateId = 3});
+    raft->Process(ts->Now(), vote);
+    assert_int_equal(messages.size(), 0);
+    assert_int_equal(raft->GetState()->CurrentTerm, 1);
+
+    ts->Advance(TTimeout::Election + std::chrono::milliseconds(1));
+    raft->Process(ts->Now(), vote);
+    assert_int_equal(messages.size(), 1);
+    assert_int_equal(raft->GetState()->CurrentTerm, 2);
+}
+
+void test_leader_batch_bytes(void**) {
+    std::vector<TMessageHolder<TAppendEntriesRequest>> messages;
+    auto onSend = [&](const TMessageHolder<TMessage>& message) {
+        if (message->Dst == 2) {
+            messages.push_back(message.Cast<TAppendEntriesRequest>());
+        }
+    };
+    auto ts = std::make_shared<TFakeTimeSource>();
+    auto raft = MakeRaft(onSend, 3);
+    raft->SetMaxInFlight(1);
+    raft->SetBatchLatency(std::chrono::milliseconds(100));
+    std::vector<TMessageHolder<TCmdReq>> log;
+    for (int i = 0; i < 100; i++) {
+        auto entry = NewHoldedMessage<TCmdReq>(sizeof(TCmdReq) + 30000);
+        entry->Term = 1;
+        log.push_back(entry);
+    }
+    raft->SetState(TState{.CurrentTerm = 1, .Log = log});
+    raft->Become(EState::LEADER);
+    raft->ProcessTimeout(ts->Now());
+    auto ack = [&]() {
+        auto req = messages.back();
+        raft->Process(ts->Now(), NewHoldedMessage(
+            TMessage {.Src = 2, .Dst = 1, .Term = 1},
+            TAppendEntriesResponse {.MatchIndex = req->PrevLogIndex + req->Nentries, .Success = true}));
+        messages.clear();
+        raft->ProcessTimeout(ts->Now());
+        assert_int_equal(messages.size(), 1);
+        return messages.back()->Nentries;
+    };
+
+    // one entry probes, then the 64KiB budget doubles on every fast ack
+    assert_int_equal(messages.back()->Nentries, 1);
+    assert_int_equal(ack(), 4);
+    assert_int_equal(ack(), 8);
+    // a slow one halves it
+    ts->Advance(std::chrono::milliseconds(200));
+    assert_int_equal(ack(), 4);
+    // in between it stays
+    ts->Advance(std::chrono::milliseconds(70));
+    assert_int_equal(ack(), 4);
+    // the entry count still caps it
+    raft->SetMaxBatch(3, TRaft::DefaultMaxBatchBytes);
+    assert_int_equal(ack(), 3);
+}
+
+void test_leader_batches_writes(void**) {
+    std::vector<TMessageHolder<TMessage>> messages;
+    std::vector<TMessageHolder<TCommandResponse>> replies;
+    auto onSend = [&](const TMessageHolder<TMessage>& message) {
+        if (message->Dst == 2) {
+            messages.push_back(message);
+        }
+    };
+    auto client = std::make_shared<TFakeNode>([&](const TMessageHolder<TMessage>& message) {
+        replies.push_back(message.Cast<TCommandResponse>());
+    });
+    auto ts = std::make_shared<TFakeTimeSource>();
+    auto rsm = std::make_shared<TDummyRsm>();
+    TNodeDict nodes;
+    nodes[2] = std::make_shared<TFakeNode>(onSend);
+    nodes[3] = std::make_shared<TFakeNode>();
+    auto raft = std::make_shared<TRaft>(rsm, 1, nodes);
+    raft->Become(EState::LEADER);
+    raft->ProcessTimeout(ts->Now());
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 1},
+        TAppendEntriesResponse {.MatchIndex = 0, .Success = true}));
+
+    // three writes in one turn take one entry
+    for (int i = 1; i <= 3; i++) {
+        auto write = NewHoldedMessage<TCommandRequest>(sizeof(TCommandRequest) + i);
+        write->Flags = TCommandRequest::EWrite;
+        memset(write->Data, 'a' + i, i);
+        raft->Process(ts->Now(), write, client);
+    }
+    assert_true(raft->NextTimeout() <= ts->Now());
+    messages.clear();
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(raft->GetState()->LogSize(), 1);
+    auto req = messages.back().Cast<TAppendEntriesRequest>();
+    assert_int_equal(req->Nentries, 1);
+
+    std::vector<std::string> commands;
+    ForEachCommand(req.Payload[0].Cast<TCmdReq>(), [&](TMessageHolder<TCmdReq> command) {
+        commands.emplace_back(command->Data, command->Len - sizeof(TCmdReq));
+    });
+    assert_int_equal(commands.size(), 3);
+    assert_string_equal(commands[0].c_str(), "b");
+    assert_string_equal(commands[2].c_str(), "ddd");
+
+    // every command is acknowledged and applied
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 1},
+        TAppendEntriesResponse {.MatchIndex = 1, .Success = true}));
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(replies.size(), 3);
+    for (const auto& reply : replies) {
+        assert_int_equal(reply->Index, 1);
+    }
+
+    // a lone write is not wrapped
+    auto write = NewHoldedMessage<TCommandRequest>(sizeof(TCommandRequest) + 1);
+    write->Flags = TCommandRequest::EWrite;
+    raft->Process(ts->Now(), write, client);
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(raft->GetState()->LogSize(), 2);
+    assert_true(raft->GetState()->LogEntry(2).Maybe<TCmdReq>());
+
+    // the state machine keeps the batch at its raft index
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 1},
+        TAppendEntriesResponse {.MatchIndex = 2, .Success = true}));
+    raft->ProcessTimeout(ts->Now());
+    auto readAt = [&](int64_t index) {
+        auto read = NewHoldedMessage<TCommandRequest>(sizeof(TCommandRequest) + sizeof(index));
+        memcpy(read->Data, &index, sizeof(index));
+        auto res = rsm->Read(read, 2).Cast<TCommandResponse>();
+        return std::string(res->Data, res->Len - sizeof(TCommandResponse));
+    };
+    assert_string_equal(readAt(1).c_str(), "bccddd");
+    assert_int_equal(readAt(2).size(), 1);
+    assert_string_equal(readAt(3).c_str(), "");
+}
+
+void test_leader_step_down_hints_writes(void**) {
+    std::vector<TMessageHolder<TMessage>> replies;
+    auto client = std::make_shared<TFakeNode>([&](const TMessageHolder<TMessage>& message) {
+        replies.push_back(message);
+    });
+    auto ts = std::make_shared<TFakeTimeSource>();
+    auto raft = MakeRaft({}, 3);
+    raft->Become(EState::LEADER);
+    raft->ProcessTimeout(ts->Now());
+
+    // buffered for the next turn, when node 3 has already taken over
+    auto write = NewHoldedMessage<TCommandRequest>(sizeof(TCommandRequest) + 1);
+    write->Flags = TCommandRequest::EWrite;
+    raft->Process(ts->Now(), write, client);
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 3, .Dst = 1, .Term = 2},
+        TAppendEntriesRequest {.LeaderId = 3}));
+    raft->ProcessTimeout(ts->Now());
+    assert_true(raft->CurrentStateName() == EState::FOLLOWER);
+    assert_int_equal(raft->GetState()->LogSize(), 0);
+    assert_int_equal(replies.size(), 1);
+    assert_int_equal(replies[0].Cast<TLeaderHint>()->LeaderId, 3);
+}
+
+void test_leader_step_down_hints_reads(void**) {
+    std::vector<TMessageHolder<TMessage>> replies;
+    auto client = std::make_shared<TFakeNode>([&](const TMessageHolder<TMessage>& message) {
+        replies.push_back(message);
+    });
+    auto ts = std::make_shared<TFakeTimeSource>();
+    auto raft = MakeRaft({}, 3);
+    raft->SetLeaseReads(true);
+    raft->Become(EState::LEADER);
+    raft->ProcessTimeout(ts->Now());
+
+    // a write appended but not committed, and a read waiting for its round
+    auto write = NewHoldedMessage<TCommandRequest>(sizeof(TCommandRequest) + 1);
+    write->Flags = TCommandRequest::EWrite;
+    raft->Process(ts->Now(), write, client);
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(raft->GetState()->LogSize(), 1);
+    auto read = NewHoldedMessage<TCommandRequest>(sizeof(TCommandRequest) + 8);
+    raft->Process(ts->Now(), read, client);
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(replies.size(), 0);
+
+    // node 3 took over and replaced the entry
+    auto mes = NewHoldedMessage(
+        TMessage {.Src = 3, .Dst = 1, .Term = 2},
+        TAppendEntriesRequest {.PrevLogIndex = 0, .PrevLogTerm = 0, .LeaderCommit = 1, .LeaderId = 3, .Nentries = 1});
+    SetPayload(mes, MakeLog({2}));
+    raft->Process(ts->Now(), mes);
+    raft->ProcessTimeout(ts->Now());
+    assert_true(raft->CurrentStateName() == EState::FOLLOWER);
+    assert_int_equal(raft->GetState()->LogTerm(1), 2);
+    assert_int_equal(replies.size(), 2);
+    for (const auto& reply : replies) {
+        assert_int_equal(reply.Cast<TLeaderHint>()->LeaderId, 3);
+    }
+
+    // nothing is left to answer later, nor a round to start
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(replies.size(), 2);
+    assert_true(raft->NextTimeout() > ts->Now());
+}
+
+void test_follower_forwards_command(void**) {
+    std::vector<TMessageHolder<TMessage>> messages;
+    std::vector<TMessageHolder<TMessage>> replies;
+    auto onSend = [&](const TMessageHolder<TMessage>& message) {
+        messages.push_back(message);
+    };
+    auto client = std::make_shared<TFakeNode>([&](const TMessageHolder<TMessage>& message) {
+        replies.push_back(message);
+    });
+    auto makeWrite = [&]() {
+        auto write = NewHoldedMessage<TCommandRequest>(sizeof(TCommandRequest) + 3);
+        write->Flags = TCommandRequest::EWrite;
+        memcpy(write->Data, "abc", 3);
+        return write;
+    };
+    auto ts = std::make_shared<TFakeTimeSource>();
+    auto raft = MakeRaft(onSend, 3);
+
+    // no leader known yet
+    raft->Process(ts->Now(), makeWrite(), client);
+    assert_int_equal(replies.size(), 1);
+    assert_int_equal(replies[0].Cast<TLeaderHint>()->LeaderId, 0);
+    assert_int_equal(messages.size(), 0);
+
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 1},
+        TAppendEntriesRequest {.LeaderId = 2}));
+    assert_int_equal(raft->GetLeaderId(), 2);
+    messages.clear();
+    raft->Process(ts->Now(), makeWrite(), client);
+    assert_int_equal(messages.size(), 1);
+    auto forward = messages[0].Cast<TForwardRequest>();
+    assert_int_equal(forward->Dst, 2);
+    auto command = (TCommandRequest*)forward->Data;
+    assert_int_equal(command->Len, sizeof(TCommandRequest) + 3);
+    assert_memory_equal(command->Data, "abc", 3);
+
+    // the leader's answer is relayed to the client
+    auto response = NewHoldedMessage<TForwardResponse>(sizeof(TForwardResponse) + sizeof(TCommandResponse));
+    response->Src = 2;
+    response->Dst = 1;
+    response->Term = 1;
+    response->Seq = forward->Seq;
+    auto inner = NewHoldedMessage(TCommandResponse {.Index = 5});
+    memcpy(response->Data, inner.Mes, inner->Len);
+    raft->Process(ts->Now(), response);
+    assert_int_equal(replies.size(), 2);
+    assert_int_equal(replies[1].Cast<TCommandResponse>()->Index, 5);
+    raft->Process(ts->Now(), response);
+    assert_int_equal(replies.size(), 2);
+
+    // a leader change leaves relayed commands with an unknown outcome
+    raft->Process(ts->Now(), makeWrite(), client);
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 3, .Dst = 1, .Term = 2},
+        TAppendEntriesRequest {.LeaderId = 3}));
+    // hinted as soon as the term moves on
+    assert_int_equal(replies.size(), 3);
+    assert_int_equal(replies[2].Cast<TLeaderHint>()->LeaderId, 0);
+    assert_int_equal(raft->GetLeaderId(), 3);
+}
+
+void test_leader_answers_forwarded_command(void**) {
+    std::vector<TMessageHolder<TMessage>> messages;
+    auto onSend = [&](const TMessageHolder<TMessage>& message) {
+        messages.push_back(message);
+    };
+    auto ts = std::make_shared<TFakeTimeSource>();
+    auto raft = MakeRaft(onSend, 3);
+    raft->Become(EState::LEADER);
+    raft->ProcessTimeout(ts->Now());
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 1},
+        TAppendEntriesResponse {.MatchIndex = 0, .Success = true}));
+
+    auto forward = NewHoldedMessage<TForwardRequest>(sizeof(TForwardRequest) + sizeof(TCommandRequest) + 3);
+    forward->Src = 2;
+    forward->Dst = 1;
+    forward->Term = 1;
+    forward->Seq = 7;
+    auto command = (TCommandRequest*)forward->Data;
+    command->Type = static_cast<uint32_t>(EMessageType::COMMAND_REQUEST);
+    command->Len = sizeof(TCommandRequest) + 3;
+    command->Flags = TCommandRequest::EWrite;
+    memcpy(command->Data, "abc", 3);
+    raft->Process(ts->Now(), forward);
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(raft->GetState()->LogSize(), 1);
+
+    messages.clear();
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 1},
+        TAppendEntriesResponse {.MatchIndex = 1, .Success = true}));
+    raft->ProcessTimeout(ts->Now());
+    std::vector<TMessageHolder<TForwardResponse>> responses;
+    for (const auto& m : messages) {
+        if (auto response = m.Maybe<TForwardResponse>()) {
+            responses.push_back(response.Cast());
+        }
+    }
+    assert_int_equal(responses.size(), 1);
+    assert_int_equal(responses[0]->Dst, 2);
+    assert_int_equal(responses[0]->Seq, 7);
+    auto inner = (TCommandResponse*)responses[0]->Data;
+    assert_int_equal(inner->Type, static_cast<uint32_t>(EMessageType::COMMAND_RESPONSE));
+    assert_int_equal(inner->Index, 1);
+}
+
+// holds Write until released, like a slow state machine
+class TGatedRsm: public TDummyRsm {
+public:
+    void Write(TMessageHolder<TCmdReq> message, uint64_t index) override {
+        while (!Open) {
+            std::this_thread::yield();
+        }
+        TDummyRsm::Write(std::move(message), index);
+    }
+
+    std::atomic<bool> Open = false;
+};
+
+// runs ProcessTimeout on applier wakeups until done returns true
+template<typename F>
+void WaitApplied(TApplier& applier, TRaft& raft, ITimeSource::Time now, F&& done) {
+    for (int i = 0; i < 100 && !done(); i++) {
+        pollfd pfd = {.fd = applier.Event().Fd(), .events = POLLIN};
+        poll(&pfd, 1, 20);
+        applier.Event().Reset();
+        raft.ProcessTimeout(now);
+    }
+    assert_true(done());
+}
+
+void test_leader_applies_on_applier(void**) {
+    std::vector<TMessageHolder<TCommandResponse>> replies;
+    auto client = std::make_shared<TFakeNode>([&](const TMessageHolder<TMessage>& message) {
+        replies.push_back(message.Cast<TCommandResponse>());
+    });
+    auto ts = std::make_shared<TFakeTimeSource>();
+    auto rsm = std::make_shared<TGatedRsm>();
+    auto applier = std::make_shared<TApplier>(rsm, 4);
+    applier->Start();
+    auto raft = std::make_shared<TRaft>(rsm, 1, TNodeDict{});
+    raft->SetApplier(applier);
+    raft->SetCompactThreshold(8);
+    raft->Become(EState::LEADER);
+
+    // the loop goes on while the state machine is stuck
+    auto write = NewHoldedMessage<TCommandRequest>(sizeof(TCommandRequest) + 8);
+    write->Flags = TCommandRequest::EWrite;
+    raft->Process(ts->Now(), write, client);
+    raft->ProcessTimeout(ts->Now());
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(raft->GetVolatileState()->CommitIndex, 1);
+    assert_int_equal(raft->GetVolatileState()->LastApplied, 0);
+    assert_int_equal(replies.size(), 0);
+
+    rsm->Open = true;
+    WaitApplied(*applier, *raft, ts->Now(), [&]() { return replies.size() == 1; });
+    assert_int_equal(replies[0]->Index, 1);
+    assert_int_equal(raft->GetVolatileState()->LastApplied, 1);
+
+    // reads and snapshots run on the applier too, in log order
+    for (int i = 0; i < 10; i++) {
+        raft->Process(ts->Now(), write, client);
+        raft->ProcessTimeout(ts->Now());
+    }
+    auto read = NewHoldedMessage<TCommandRequest>(sizeof(TCommandRequest) + 8);
+    raft->Process(ts->Now(), read, client);
+    raft->ProcessTimeout(ts->Now());
+    WaitApplied(*applier, *raft, ts->Now(), [&]() {
+        return replies.size() == 12 && raft->GetState()->SnapshotIndex > 0;
+    });
+    assert_int_equal(replies.back()->Index, 11);
+    assert_int_equal(raft->GetVolatileState()->LastApplied, 11);
+    applier->Stop();
+}
+
+void test_leader_commits_after_own_sync(void**) {
+    std::vector<TMessageHolder<TMessage>> messages;
+    auto onSend = [&](const TMessageHolder<TMessage>& message) {
+        messages.push_back(message);
+    };
+    auto dir = std::filesystem::temp_directory_path() / ("test_raft_sync-" + std::to_string(getpid()));
+    std::filesystem::remove_all(dir);
+    auto ts = std::make_shared<TFakeTimeSource>();
+    auto raft = MakeRaft(onSend, 5);
+    TState state;
+    state.Store = std::make_shared<TSegmentedLog>(dir.string());
+    raft->SetState(state);
+    raft->Become(EState::LEADER);
+    raft->ProcessTimeout(ts->Now());
+    for (uint32_t id = 2; id <= 5; id++) {
+        raft->Process(ts->Now(), NewHoldedMessage(
+            TMessage {.Src = id, .Dst = 1, .Term = 1},
+            TAppendEntriesResponse {.MatchIndex = 0, .Success = true}));
+    }
+    auto ack = [&](uint32_t id, uint64_t index) {
+        raft->Process(ts->Now(), NewHoldedMessage(
+            TMessage {.Src = id, .Dst = 1, .Term = 1},
+            TAppendEntriesResponse {.MatchIndex = index, .Success = true}));
+    };
+    auto write = [&]() {
+        auto write = NewHoldedMessage<TCommandRequest>(sizeof(TCommandRequest) + 8);
+        write->Flags = TCommandRequest::EWrite;
+        raft->Process(ts->Now(), write);
+        raft->ProcessTimeout(ts->Now());
+    };
+
+    // the entries go out before the leader's fsync
+    messages.clear();
+    write();
+    assert_int_equal(messages.size(), 4);
+    assert_int_equal(raft->GetState()->DurableSize(), 0);
+
+    // two peers are no majority of five without the leader's own copy
+    ack(2, 1);
+    ack(3, 1);
+    assert_int_equal(raft->GetVolatileState()->CommitIndex, 0);
+    raft->Sync();
+    assert_int_equal(raft->GetVolatileState()->CommitIndex, 1);
+    assert_true(raft->NextTimeout() <= ts->Now());
+
+    // or the fsync is the slower one and three peers commit on their own
+    write();
+    ack(2, 2);
+    ack(3, 2);
+    assert_int_equal(raft->GetVolatileState()->CommitIndex, 1);
+    ack(4, 2);
+    assert_int_equal(raft->GetVolatileState()->CommitIndex, 2);
+    std::filesystem::remove_all(dir);
+}
+
+void test_leader_learner_not_in_quorum(void**) {
+    std::vector<TMessageHolder<TMessage>> messages;
+    auto onSend = [&](const TMessageHolder<TMessage>& message) {
+        messages.push_back(message);
+    };
+    auto ts = std::make_shared<TFakeTimeSource>();
+    TNodeDict nodes;
+    for (uint32_t id = 2; id <= 4; id++) {
+        nodes[id] = std::make_shared<TFakeNode>(onSend);
+    }
+    auto raft = std::make_shared<TRaft>(std::make_shared<TDummyRsm>(), 1, nodes, std::unordered_set<uint32_t>{4});
+    assert_int_equal(raft->GetNservers(), 3);
+    assert_int_equal(raft->GetMinVotes(), 2);
+
+    // the learner is not asked for a vote
+    ts->Advance(std::chrono::milliseconds(20000));
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(raft->CurrentStateName(), EState::CANDIDATE);
+    for (const auto& m : messages) {
+        assert_true(m->Dst != 4);
+    }
+
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 2},
+        TRequestVoteResponse {.VoteGranted = true}));
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(raft->CurrentStateName(), EState::LEADER);
+    auto write = NewHoldedMessage<TCommandRequest>(sizeof(TCommandRequest) + 8);
+    write->Flags = TCommandRequest::EWrite;
+    raft->Process(ts->Now(), write);
+    raft->ProcessTimeout(ts->Now());
+
+    // but gets the log, and its acks do not commit
+    assert_int_equal(Peer(raft, 4).NextIndex, 1);
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 4, .Dst = 1, .Term = 2},
+        TAppendEntriesResponse {.MatchIndex = 1, .Success = true}));
+    assert_int_equal(Peer(raft, 4).MatchIndex, 1);
+    assert_int_equal(raft->GetVolatileState()->CommitIndex, 0);
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 2},
+        TAppendEntriesResponse {.MatchIndex = 1, .Success = true}));
+    assert_int_equal(raft->GetVolatileState()->CommitIndex, 1);
+
+    // a learner's read index waits for a round of the voters
+    messages.clear();
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 4, .Dst = 1, .Term = 2},
+        TLearnerReadRequest {.Seq = 7}));
+    raft->ProcessTimeout(ts->Now());
+    uint64_t round = 0;
+    for (const auto& m : messages) {
+        if (auto req = m.Maybe<TReadIndexRequest>()) {
+            assert_true(m->Dst != 4);
+            round = req.Cast()->Seq;
+        }
+        assert_false(m.Maybe<TLearnerReadResponse>());
+    }
+    messages.clear();
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 3, .Dst = 1, .Term = 2},
+        TReadIndexResponse {.Seq = round}));
+    raft->ProcessTimeout(ts->Now());
+    auto grant = std::find_if(messages.begin(), messages.end(), [](const auto& m) {
+        return !!m.template Maybe<TLearnerReadResponse>();
+    });
+    assert_true(grant != messages.end());
+    assert_int_equal((*grant)->Dst, 4);
+    assert_int_equal(grant->template Cast<TLearnerReadResponse>()->Seq, 7);
+    assert_int_equal(grant->template Cast<TLearnerReadResponse>()->Index, 1);
+}
+
+void test_learner_reads(void**) {
+    std::vector<TMessageHolder<TMessage>> messages;
+    std::vector<TMessageHolder<TCommandResponse>> replies;
+    auto onSend = [&](const TMessageHolder<TMessage>& message) {
+        messages.push_back(message);
+    };
+    auto client = std::make_shared<TFakeNode>([&](const TMessageHolder<TMessage>& message) {
+        replies.push_back(message.Cast<TCommandResponse>());
+    });
+    auto ts = std::make_shared<TFakeTimeSource>();
+    TNodeDict nodes;
+    nodes[2] = std::make_shared<TFakeNode>(onSend);
+    nodes[3] = std::make_shared<TFakeNode>(onSend);
+    auto raft = std::make_shared<TRaft>(std::make_shared<TDummyRsm>(), 1, nodes, std::unordered_set<uint32_t>{1});
+    assert_true(raft->IsLearner());
+    assert_int_equal(raft->GetNservers(), 2);
+
+    // never campaigns, never votes
+    ts->Advance(std::chrono::milliseconds(20000));
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(raft->CurrentStateName(), EState::FOLLOWER);
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 3, .Dst = 1, .Term = 2},
+        TRequestVoteRequest {.LastLogIndex = 0, .LastLogTerm = 0, .CandidateId = 3}));
+    assert_int_equal(messages.size(), 0);
+
+    // applies what the leader committed
+    auto append = NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 2},
+        TAppendEntriesRequest {.PrevLogIndex = 0, .PrevLogTerm = 0, .LeaderCommit = 1, .LeaderId = 2, .Nentries = 1});
+    SetPayload(append, MakeLog({2}));
+    raft->Process(ts->Now(), append);
+    assert_true(raft->NextTimeout() <= ts->Now());
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(raft->GetVolatileState()->LastApplied, 1);
+
+    // a read asks the leader for its index and is served locally
+    messages.clear();
+    auto read = NewHoldedMessage<TCommandRequest>(sizeof(TCommandRequest) + 8);
+    raft->Process(ts->Now(), read, client);
+    raft->Process(ts->Now(), read, client);
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(messages.size(), 1);
+    auto req = messages[0].Cast<TLearnerReadRequest>();
+    assert_int_equal(req->Dst, 2);
+    assert_int_equal(replies.size(), 0);
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 2},
+        TLearnerReadResponse {.Seq = req->Seq, .Index = 1}));
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(replies.size(), 2);
+    assert_int_equal(replies[0]->Index, 1);
+
+    // within the staleness bound it does not ask
+    raft->SetStaleReads(std::chrono::milliseconds(1000));
+    messages.clear();
+    raft->Process(ts->Now(), read, client);
+    raft->ProcessTimeout(ts->Now());
+    assert_int_equal(messages.size(), 0);
+    assert_int_equal(replies.size(), 3);
+}
+
+void test_learner_reads_without_leader(void**) {
+    std::vector<TMessageHolder<TMessage>> replies;
+    auto client = std::make_shared<TFakeNode>([&](const TMessageHolder<TMessage>& message) {
+        replies.push_back(message);
+    });
+    auto ts = std::make_shared<TFakeTimeSource>();
+    TNodeDict nodes;
+    nodes[2] = std::make_shared<TFakeNode>();
+    nodes[3] = std::make_shared<TFakeNode>();
+    auto raft = std::make_shared<TRaft>(std::make_shared<TDummyRsm>(), 1, nodes, std::unordered_set<uint32_t>{1});
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 2, .Dst = 1, .Term = 2},
+        TAppendEntriesRequest {.PrevLogIndex = 0, .PrevLogTerm = 0, .LeaderCommit = 0, .LeaderId = 2, .Nentries = 0}));
+    auto read = NewHoldedMessage<TCommandRequest>(sizeof(TCommandRequest) + 8);
+    raft->Process(ts->Now(), read, client);
+    raft->ProcessTimeout(ts->Now());
+
+    // a new term, its leader not known yet, while the round is outstanding
+    raft->Process(ts->Now(), NewHoldedMessage(
+        TMessage {.Src = 3, .Dst = 1, .Term = 3},
+        TRequestVoteRequest {.LastLogIndex = 0, .LastLogTerm = 0, .CandidateId = 3}));
+    assert_int_equal(raft->GetLeaderId(), 0);
+    assert_true(raft->NextTimeout() != ITimeSource::Time{});
+    raft->ProcessTimeout(ts->Now());
+    assert_true(raft->NextTimeout() != ITimeSource::Time{});
+    assert_true(raft->NextTimeout() > ts->Now());
+    assert_int_equal(replies.size(), 1);
+    assert_int_equal(replies[0].Cast<TLeaderHint>()->LeaderId, 0);
+}
+
 int main() {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_empty),
@@ -680,6 +1833,7 @@ int main() {
         cmocka_unit_test(test_message_send_recv),
         cmocka_unit_test(test_initial),
         cmocka_unit_test(test_numbers),
+        cmocka_unit_test(test_sparse_peer_ids),
         cmocka_unit_test(test_become),
         cmocka_unit_test(test_become_same_func),
         cmocka_unit_test(test_follower_to_candidate_on_timeout),
@@ -689,6 +1843,8 @@ int main() {
         cmocka_unit_test(test_follower_append_entries_7c),
         cmocka_unit_test(test_follower_append_entries_7f),
         cmocka_unit_test(test_follower_append_entries_empty_to_empty_log),
+        cmocka_unit_test(test_follower_append_entries_conflict_hint),
+        cmocka_unit_test(test_leader_repairs_diverged_follower),
         cmocka_unit_test(test_candidate_initiate_election),
         cmocka_unit_test(test_candidate_vote_request_small_term),
         cmocka_unit_test(test_candidate_vote_request_ok_term),
@@ -697,7 +1853,29 @@ int main() {
         cmocka_unit_test(test_election_5_nodes),
         cmocka_unit_test(test_commit_advance),
         cmocka_unit_test(test_commit_advance_wrong_term),
+        cmocka_unit_test(test_commit_advance_even),
+        cmocka_unit_test(test_commit_advance_incremental),
         cmocka_unit_test(test_leader_heartbeat),
+        cmocka_unit_test(test_state_compact),
+        cmocka_unit_test(test_follower_install_snapshot),
+        cmocka_unit_test(test_leader_sends_snapshot),
+        cmocka_unit_test(test_leader_pipelines_batches),
+        cmocka_unit_test(test_leader_pipeline_resend_on_timeout),
+        cmocka_unit_test(test_leader_batch_bytes),
+        cmocka_unit_test(test_leader_batches_writes),
+        cmocka_unit_test(test_leader_step_down_hints_writes),
+        cmocka_unit_test(test_leader_step_down_hints_reads),
+        cmocka_unit_test(test_leader_read_index),
+        cmocka_unit_test(test_leader_lease_read),
+        cmocka_unit_test(test_leader_reads_without_writes),
+        cmocka_unit_test(test_follower_lease_ignores_votes),
+        cmocka_unit_test(test_follower_forwards_command),
+        cmocka_unit_test(test_leader_answers_forwarded_command),
+        cmocka_unit_test(test_leader_applies_on_applier),
+        cmocka_unit_test(test_leader_commits_after_own_sync),
+        cmocka_unit_test(test_leader_learner_not_in_quorum),
+        cmocka_unit_test(test_learner_reads),
+        cmocka_unit_test(test_learner_reads_without_leader),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
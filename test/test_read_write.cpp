@@ -1,9 +1,13 @@
+#include <algorithm>
 #include <chrono>
 #include <coroutine>
 #include <cstdint>
 #include <iostream>
 #include <memory>
 #include <functional>
+#include <system_error>
+#include <utility>
+#include <vector>
 
 #include <messages.h>
 #include <raft.h>
@@ -18,6 +22,8 @@ extern "C" {
 #include <cmocka.h>
 }
 
+using namespace std::chrono_literals;
+
 namespace {
 
 TMessageHolder<TCmdReq> MakeEntry(const char* text) {
@@ -29,6 +35,29 @@ TMessageHolder<TCmdReq> MakeEntry(const char* text) {
     return mes;
 }
 
+TMessage MakeMessage(EMessageType type, uint32_t len) {
+    return TMessage{.Type = static_cast<uint32_t>(type), .Len = len};
+}
+
+// both ends of a loopback connection accepted by listener
+std::pair<NNet::TSocket, NNet::TSocket> Connect(NNet::TLoop<NNet::TPoll>& loop, NNet::TSocket& listener, NNet::TAddress address) {
+    NNet::TSocket client(address, loop.Poller());
+    NNet::TSocket server;
+    NNet::TVoidSuspendedTask h1 = [](NNet::TSocket& client) -> NNet::TVoidSuspendedTask {
+        co_await client.Connect();
+        co_return;
+    }(client);
+    NNet::TVoidSuspendedTask h2 = [](NNet::TSocket& listener, NNet::TSocket& server) -> NNet::TVoidSuspendedTask {
+        server = std::move(co_await listener.Accept());
+        co_return;
+    }(listener, server);
+    while (!(h1.done() && h2.done())) {
+        loop.Step();
+    }
+    h1.destroy(); h2.destroy();
+    return {std::move(client), std::move(server)};
+}
+
 } // namespace
 
 void test_read_write(void**) {
@@ -112,10 +141,189 @@ void test_read_write_payload(void**) {
     h1.destroy(); h2.destroy();
 }
 
+void test_outbox_evicts_resendable(void**) {
+    NNet::TLoop<NNet::TPoll> loop;
+    // never drained, as if the peer were down
+    TNode<NNet::TSocket> node(
+        [&](const NNet::TAddress& addr) { return NNet::TSocket(addr, loop.Poller()); },
+        "peer", NNet::TAddress{"127.0.0.1", 8890}, std::make_shared<TTimeSource>(), &loop.Poller());
+    node.SetOutboxLimit(1000);
+
+    // the oldest AppendEntries go once the outbox is over the limit
+    for (int i = 0; i < 10; i++) {
+        node.Send(MakeMessage(EMessageType::APPEND_ENTRIES_REQUEST, 200));
+    }
+    assert_int_equal(node.Stats().OutboxBytes, 1000);
+    assert_int_equal(node.Stats().DroppedMessages, 5);
+    assert_int_equal(node.Stats().DroppedBytes, 1000);
+
+    // votes are kept even past the limit, the rest of the AppendEntries are not
+    for (int i = 0; i < 20; i++) {
+        node.Send(MakeMessage(EMessageType::REQUEST_VOTE_REQUEST, 100));
+    }
+    assert_int_equal(node.Stats().OutboxBytes, 2000);
+    assert_int_equal(node.Stats().DroppedMessages, 10);
+    assert_int_equal(node.Stats().DroppedBytes, 2000);
+}
+
+void test_connect_factory_throws(void**) {
+    NNet::TLoop<NNet::TPoll> loop;
+    NNet::TAddress address{"127.0.0.1", 8893};
+    NNet::TSocket listener(address, loop.Poller());
+    listener.Bind();
+    listener.Listen();
+
+    // no socket at all on the first attempt, as on EMFILE
+    int attempts = 0;
+    auto node = std::make_shared<TNode<NNet::TSocket>>(
+        [&](const NNet::TAddress& addr) {
+            if (attempts++ == 0) {
+                throw std::system_error(EMFILE, std::generic_category(), "socket");
+            }
+            return NNet::TSocket(addr, loop.Poller());
+        },
+        "peer", address, std::make_shared<TTimeSource>(), &loop.Poller());
+    node->Send(MakeMessage(EMessageType::REQUEST_VOTE_REQUEST, sizeof(TMessage)));
+    node->Drain();
+    for (int i = 0; i < 1000 && !node->IsConnected(); i++) {
+        loop.Step();
+    }
+    assert_true(node->IsConnected());
+    assert_int_equal(attempts, 2);
+}
+
+void test_reconnect_backoff(void**) {
+    TBackoff backoff(10ms, 1000ms, 42);
+    auto current = 10ms;
+    for (int i = 0; i < 20; i++) {
+        auto delay = backoff.Next();
+        assert_true(delay >= current / 2);
+        assert_true(delay <= current);
+        current = std::min(current * 2, 1000ms);
+    }
+    assert_true(current == 1000ms);
+    backoff.Reset();
+    assert_true(backoff.Next() <= 10ms);
+}
+
+void test_lanes_weighted(void**) {
+    NNet::TLoop<NNet::TPoll> loop;
+    NNet::TAddress address{"127.0.0.1", 8891};
+    NNet::TSocket listener(address, loop.Poller());
+    listener.Bind();
+    listener.Listen();
+    auto [client, server] = Connect(loop, listener, address);
+
+    TNode<NNet::TSocket> node("peer", std::move(client), std::make_shared<TTimeSource>());
+    const int count = 20;
+    for (int i = 0; i < count; i++) {
+        auto append = MakeMessage(EMessageType::APPEND_ENTRIES_REQUEST, sizeof(TMessage));
+        append.Src = i;
+        node.Send(append);
+        node.Send(MakeMessage(EMessageType::REQUEST_VOTE_REQUEST, sizeof(TMessage)));
+        node.Send(MakeMessage(EMessageType::CMD_REQ, sizeof(TMessage)));
+    }
+    node.Drain();
+
+    std::vector<TMessage> received(3 * count);
+    NNet::TVoidSuspendedTask h3 = [](NNet::TSocket& server, std::vector<TMessage>& received) -> NNet::TVoidSuspendedTask {
+        auto* p = reinterpret_cast<char*>(received.data());
+        size_t left = received.size() * sizeof(TMessage);
+        while (left > 0) {
+            auto r = co_await server.ReadSome(p, left);
+            assert_true(r > 0);
+            p += r; left -= r;
+        }
+        co_return;
+    }(server, received);
+    while (!h3.done()) {
+        loop.Step();
+    }
+
+    // first round: 8 control, 4 client, 1 bulk message
+    for (int i = 0; i < 13; i++) {
+        auto type = static_cast<EMessageType>(received[i].Type);
+        auto expected = i < 8 ? EMessageType::REQUEST_VOTE_REQUEST
+            : i < 12 ? EMessageType::CMD_REQ
+            : EMessageType::APPEND_ENTRIES_REQUEST;
+        assert_int_equal(static_cast<uint32_t>(type), static_cast<uint32_t>(expected));
+    }
+    // AppendEntries keep their order
+    uint32_t next = 0;
+    for (const auto& m : received) {
+        if (m.Type == static_cast<uint32_t>(EMessageType::APPEND_ENTRIES_REQUEST)) {
+            assert_int_equal(m.Src, next++);
+        }
+    }
+    assert_int_equal(next, count);
+
+    h3.destroy();
+}
+
+void test_reconnect_during_read(void**) {
+    NNet::TLoop<NNet::TPoll> loop;
+    NNet::TAddress address{"127.0.0.1", 8892};
+    NNet::TSocket listener(address, loop.Poller());
+    listener.Bind();
+    listener.Listen();
+    auto [oldLocal, oldRemote] = Connect(loop, listener, address);
+    auto [newLocal, newRemote] = Connect(loop, listener, address);
+
+    auto node = std::make_shared<TNode<NNet::TSocket>>("peer", std::move(oldLocal), std::make_shared<TTimeSource>());
+    auto reader = [](std::shared_ptr<NNet::TSocket> socket, TMessage& received, bool& failed) -> NNet::TVoidSuspendedTask {
+        try {
+            received = co_await TMessageReader(*socket).Read();
+        } catch (const std::exception&) {
+            failed = true;
+        }
+        co_return;
+    };
+    TMessage oldReceived{}, newReceived{};
+    bool oldFailed = false, newFailed = false;
+    auto h1 = reader(node->Sock(), oldReceived, oldFailed);
+
+    // the old reader is left in the middle of a message
+    THello hello;
+    hello.Type = static_cast<uint32_t>(THello::MessageType);
+    hello.Len = sizeof(THello);
+    hello.Src = 7;
+    NNet::TVoidSuspendedTask h2 = [](NNet::TSocket& socket, THello& hello) -> NNet::TVoidSuspendedTask {
+        co_await NNet::TByteWriter(socket).Write(&hello, sizeof(hello.Type));
+        co_return;
+    }(oldRemote, hello);
+    for (int i = 0; i < 10 && !h1.done(); i++) {
+        loop.Step();
+    }
+    assert_false(h1.done());
+
+    node->Attach(std::move(newLocal));
+    auto h3 = reader(node->Sock(), newReceived, newFailed);
+    NNet::TVoidSuspendedTask h4 = [](NNet::TSocket& socket, THello& hello) -> NNet::TVoidSuspendedTask {
+        co_await TMessageWriter(socket).Write(hello);
+        co_return;
+    }(newRemote, hello);
+    while (!(h1.done() && h3.done())) {
+        loop.Step();
+    }
+
+    // the old reader ends with its connection, the new one gets the whole message
+    assert_true(oldFailed);
+    assert_false(newFailed);
+    assert_int_equal(newReceived.Type, static_cast<uint32_t>(EMessageType::HELLO));
+    assert_int_equal(newReceived.Src, 7);
+
+    h1.destroy(); h2.destroy(); h3.destroy(); h4.destroy();
+}
+
 int main() {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_read_write),
         cmocka_unit_test(test_read_write_payload),
+        cmocka_unit_test(test_outbox_evicts_resendable),
+        cmocka_unit_test(test_connect_factory_throws),
+        cmocka_unit_test(test_reconnect_backoff),
+        cmocka_unit_test(test_lanes_weighted),
+        cmocka_unit_test(test_reconnect_during_read),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 };
@@ -0,0 +1,106 @@
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include <timerwheel.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+extern "C" {
+#include <cmocka.h>
+}
+
+using namespace std::chrono_literals;
+
+void test_fire_exact_deadline(void**) {
+    auto t0 = std::chrono::steady_clock::now();
+    TTimerWheel wheel(t0);
+    std::vector<uint64_t> fired;
+    wheel.Schedule(t0 + 1500us, 1);
+    assert_true(wheel.NextExpiry() == t0 + 1500us);
+
+    wheel.Advance(t0 + 1450us, fired);
+    assert_int_equal(fired.size(), 0);
+    wheel.Advance(t0 + 1500us, fired);
+    assert_int_equal(fired.size(), 1);
+    assert_int_equal(fired[0], 1);
+    assert_true(wheel.Empty());
+    assert_true(wheel.NextExpiry() == ITimeSource::Max);
+}
+
+void test_fire_in_order(void**) {
+    auto t0 = std::chrono::steady_clock::now();
+    TTimerWheel wheel(t0);
+    std::vector<uint64_t> fired;
+    wheel.Schedule(t0 + 5s, 3);
+    wheel.Schedule(t0 + 10ms, 1);
+    wheel.Schedule(t0 + 200ms, 2);
+    wheel.Schedule(t0 + 30min, 4);
+
+    uint64_t expected = 1;
+    while (!wheel.Empty()) {
+        auto next = wheel.NextExpiry();
+        fired.clear();
+        wheel.Advance(next, fired);
+        for (auto id : fired) {
+            assert_int_equal(id, expected++);
+        }
+    }
+    assert_int_equal(expected, 5);
+}
+
+void test_past_deadline(void**) {
+    auto t0 = std::chrono::steady_clock::now();
+    TTimerWheel wheel(t0);
+    std::vector<uint64_t> fired;
+    wheel.Advance(t0 + 1s, fired);
+    wheel.Schedule(t0 + 100ms, 1);
+    assert_true(wheel.NextExpiry() <= t0 + 1s);
+    wheel.Advance(t0 + 1s, fired);
+    assert_int_equal(fired.size(), 1);
+}
+
+void test_next_expiry_random(void**) {
+    // deadlines spread over several levels, checked against a plain map
+    auto t0 = std::chrono::steady_clock::now();
+    TTimerWheel wheel(t0);
+    std::multimap<ITimeSource::Time, uint64_t> pending;
+    std::vector<uint64_t> fired;
+    auto now = t0;
+    uint32_t seed = 31337;
+    auto next = [&]() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    };
+    uint64_t id = 0;
+    for (int round = 0; round < 20000; round++) {
+        if (next() % 3) {
+            auto delay = std::chrono::microseconds(next() % (1u << (6 + 6 * (next() % 4)))) * 100;
+            wheel.Schedule(now + delay, ++id);
+            pending.emplace(now + delay, id);
+        } else {
+            now += std::chrono::microseconds(next() % 200000);
+            fired.clear();
+            wheel.Advance(now, fired);
+            assert_int_equal(fired.size(), std::distance(pending.begin(), pending.upper_bound(now)));
+            pending.erase(pending.begin(), pending.upper_bound(now));
+        }
+        assert_int_equal(wheel.Count(), pending.size());
+        auto expected = pending.empty() ? ITimeSource::Max : pending.begin()->first;
+        assert_true(wheel.NextExpiry() == expected);
+    }
+}
+
+int main() {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_fire_exact_deadline),
+        cmocka_unit_test(test_fire_in_order),
+        cmocka_unit_test(test_past_deadline),
+        cmocka_unit_test(test_next_expiry_random),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}